@@ -17,22 +17,64 @@ struct _PvApplication
     GtkApplication parent_instance;
 
     PvMap         *map;
+    gboolean       map_loaded;
     PvCamera      *camera;
+    PvRenderer    *renderer;
 };
 
 G_DEFINE_TYPE (PvApplication, pv_application, GTK_TYPE_APPLICATION)
 
+static PvWindow *
+get_window (PvApplication *self)
+{
+    GtkWindow *window = gtk_application_get_active_window (GTK_APPLICATION (self));
+    return window != NULL ? PV_WINDOW (window) : NULL;
+}
+
+/* Show the map once it has been loaded */
 static void
-load_map (PvApplication *self)
+show_map (PvApplication *self)
+{
+    PvWindow *window = get_window (self);
+    if (!self->map_loaded || window == NULL)
+        return;
+
+    pv_window_set_status (window, NULL);
+    pv_renderer_set_map (self->renderer, self->map);
+    pv_window_redraw (window);
+}
+
+static void
+load_progress_cb (PvApplication *self,
+                  guint64        n_bytes,
+                  guint          n_areas,
+                  guint          n_areas_total)
 {
+    PvWindow *window = get_window (self);
+    if (window == NULL)
+        return;
+
+    g_autofree gchar *status = NULL;
+    if (n_areas_total > 0)
+        status = g_strdup_printf ("Decoding map %u%%", n_areas * 100 / n_areas_total);
+    else
+        status = g_strdup_printf ("Loading map %" G_GUINT64_FORMAT " KiB", n_bytes / 1024);
+    pv_window_set_status (window, status);
+}
+
+static void
+load_map_cb (GObject      *object,
+             GAsyncResult *result,
+             gpointer      user_data)
+{
+    g_autoptr(PvApplication) self = PV_APPLICATION (user_data);
     g_autoptr(GError) error = NULL;
 
-    self->map = pv_map_new ();
-    g_autoptr(GFile) file = g_file_new_for_uri ("resource:///com/example/pivox/map.pivox");
-    g_autoptr(GFileInputStream) stream = g_file_read (file, NULL, &error);
-    if (stream == NULL ||
-        !pv_map_load (self->map, G_INPUT_STREAM (stream), NULL, &error)) {
+    if (!pv_map_load_finish (PV_MAP (object), result, &error)) {
         g_printerr ("Failed to load map: %s\n", error->message);
+        PvWindow *window = get_window (self);
+        if (window != NULL)
+            pv_window_set_status (window, "Failed to load map");
         return;
     }
     g_printerr ("Map name: %s\n", pv_map_get_name (self->map));
@@ -45,6 +87,27 @@ load_map (PvApplication *self)
         pv_map_get_block_color (self->map, i, &red, &green, &blue);
         g_printerr ("Block %zi: %s #%02x%02x%02x\n", i, name, red, green, blue);
     }
+
+    pv_camera_set_target (self->camera, pv_map_get_width (self->map) / 2.0, pv_map_get_height (self->map) / 2.0, 0.0);
+    self->map_loaded = TRUE;
+    show_map (self);
+}
+
+/* Load the map in the background so the window can be shown straight away */
+static void
+load_map (PvApplication *self)
+{
+    g_autoptr(GError) error = NULL;
+
+    self->map = pv_map_new ();
+    pv_map_set_storage (self->map, PV_MAP_STORAGE_PALETTE);
+    g_signal_connect_object (self->map, "load-progress", G_CALLBACK (load_progress_cb), self, G_CONNECT_SWAPPED);
+    g_autoptr(GBytes) data = g_resources_lookup_data ("/com/example/pivox/map.pivox", G_RESOURCE_LOOKUP_FLAGS_NONE, &error);
+    if (data == NULL) {
+        g_printerr ("Failed to load map: %s\n", error->message);
+        return;
+    }
+    pv_map_load_bytes_async (self->map, data, NULL, load_map_cb, g_object_ref (self));
 }
 
 static void
@@ -56,10 +119,15 @@ pv_application_activate (GApplication *app)
     gtk_application_add_window (GTK_APPLICATION (self), GTK_WINDOW (window));
     gtk_widget_show (GTK_WIDGET (window));
 
-    g_autoptr(PvRenderer) renderer = pv_renderer_new ();
-    pv_renderer_set_map (renderer, self->map);
-    pv_renderer_set_camera (renderer, self->camera);
-    pv_window_set_renderer (window, renderer);
+    if (self->renderer == NULL) {
+        self->renderer = pv_renderer_new ();
+        pv_renderer_set_camera (self->renderer, self->camera);
+    }
+    pv_window_set_renderer (window, self->renderer);
+    if (self->map_loaded)
+        show_map (self);
+    else
+        pv_window_set_status (window, "Loading map");
 }
 
 static void
@@ -68,6 +136,7 @@ pv_application_dispose (GObject *object)
     PvApplication *self = PV_APPLICATION (object);
 
     g_clear_object (&self->map);
+    g_clear_object (&self->renderer);
 
     G_OBJECT_CLASS (pv_application_parent_class)->dispose (object);
 }
@@ -85,11 +154,10 @@ pv_application_class_init (PvApplicationClass *klass)
 void
 pv_application_init (PvApplication *self)
 {
-    load_map (self);
-
     self->camera = pv_camera_new ();
     pv_camera_set_position (self->camera, 0.0, 0.0, 7.0);
-    pv_camera_set_target (self->camera, pv_map_get_width (self->map) / 2.0, pv_map_get_height (self->map) / 2.0, 0.0);
+
+    load_map (self);
 }
 
 PvApplication *
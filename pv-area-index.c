@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2018 Robert Ancell
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version. See http://www.gnu.org/copyleft/gpl.html the full text of the
+ * license.
+ */
+
+#include "pv-area-index.h"
+
+/* Maximum number of areas in a leaf node */
+#define LEAF_SIZE 4
+
+/* Number of areas that can be added before the tree is rebuilt */
+#define MIN_PENDING 64
+
+typedef struct
+{
+    guint64 x0, y0, z0;
+    guint64 x1, y1, z1;
+} Box;
+
+typedef struct
+{
+    Box   box;
+
+    /* Leaf nodes: first entry in items and number of areas.
+     * Internal nodes: index of the first child (the second child follows it) and zero */
+    guint first;
+    guint count;
+} Node;
+
+/* A bounding volume hierarchy over the map areas */
+struct _PvAreaIndex
+{
+    /* Bounds of each area */
+    GArray *boxes;
+
+    /* Tree over the first tree_count areas, the rest are checked linearly */
+    GArray *nodes;
+    guint  *items;
+    guint   tree_count;
+};
+
+PvAreaIndex *
+pv_area_index_new (void)
+{
+    PvAreaIndex *index = g_new0 (PvAreaIndex, 1);
+    index->boxes = g_array_new (FALSE, FALSE, sizeof (Box));
+    index->nodes = g_array_new (FALSE, FALSE, sizeof (Node));
+    return index;
+}
+
+void
+pv_area_index_free (PvAreaIndex *index)
+{
+    g_array_unref (index->boxes);
+    g_array_unref (index->nodes);
+    g_free (index->items);
+    g_free (index);
+}
+
+void
+pv_area_index_clear (PvAreaIndex *index)
+{
+    g_array_set_size (index->boxes, 0);
+    g_array_set_size (index->nodes, 0);
+    g_clear_pointer (&index->items, g_free);
+    index->tree_count = 0;
+}
+
+guint
+pv_area_index_add (PvAreaIndex *index,
+                   guint64      x,
+                   guint64      y,
+                   guint64      z,
+                   guint64      width,
+                   guint64      height,
+                   guint64      depth)
+{
+    Box box = { x, y, z, x + width, y + height, z + depth };
+    g_array_append_val (index->boxes, box);
+    return index->boxes->len - 1;
+}
+
+static gboolean
+box_is_empty (const Box *box)
+{
+    return box->x0 >= box->x1 || box->y0 >= box->y1 || box->z0 >= box->z1;
+}
+
+static gboolean
+box_overlaps (const Box *a, const Box *b)
+{
+    return a->x0 < b->x1 && b->x0 < a->x1 &&
+           a->y0 < b->y1 && b->y0 < a->y1 &&
+           a->z0 < b->z1 && b->z0 < a->z1;
+}
+
+static void
+box_union (Box *box, const Box *other)
+{
+    box->x0 = MIN (box->x0, other->x0);
+    box->y0 = MIN (box->y0, other->y0);
+    box->z0 = MIN (box->z0, other->z0);
+    box->x1 = MAX (box->x1, other->x1);
+    box->y1 = MAX (box->y1, other->y1);
+    box->z1 = MAX (box->z1, other->z1);
+}
+
+/* Twice the center of a box along an axis */
+static guint64
+box_center (const Box *box, int axis)
+{
+    switch (axis) {
+    case 0:
+        return box->x0 + box->x1;
+    case 1:
+        return box->y0 + box->y1;
+    default:
+        return box->z0 + box->z1;
+    }
+}
+
+/* Reorder items so the n'th item is in sorted position along axis */
+static void
+select_nth (const Box *boxes,
+            guint     *items,
+            guint      length,
+            guint      n,
+            int        axis)
+{
+    gint64 left = 0, right = (gint64) length - 1;
+    while (left < right) {
+        guint64 pivot = box_center (&boxes[items[(left + right) / 2]], axis);
+        gint64 i = left, j = right;
+        while (i <= j) {
+            while (box_center (&boxes[items[i]], axis) < pivot)
+                i++;
+            while (box_center (&boxes[items[j]], axis) > pivot)
+                j--;
+            if (i <= j) {
+                guint t = items[i];
+                items[i] = items[j];
+                items[j] = t;
+                i++;
+                j--;
+            }
+        }
+        if (n <= j)
+            right = j;
+        else if (n >= i)
+            left = i;
+        else
+            break;
+    }
+}
+
+static void
+build_node (PvAreaIndex *index,
+            guint        node_index,
+            guint        first,
+            guint        count)
+{
+    const Box *boxes = (const Box *) index->boxes->data;
+    guint *items = index->items + first;
+
+    Box box = boxes[items[0]], centers;
+    centers.x0 = centers.x1 = box_center (&box, 0);
+    centers.y0 = centers.y1 = box_center (&box, 1);
+    centers.z0 = centers.z1 = box_center (&box, 2);
+    for (guint i = 1; i < count; i++) {
+        const Box *b = &boxes[items[i]];
+        box_union (&box, b);
+        Box c = { box_center (b, 0), box_center (b, 1), box_center (b, 2),
+                  box_center (b, 0), box_center (b, 1), box_center (b, 2) };
+        box_union (&centers, &c);
+    }
+
+    Node *node = &g_array_index (index->nodes, Node, node_index);
+    node->box = box;
+    if (count <= LEAF_SIZE) {
+        node->first = first;
+        node->count = count;
+        return;
+    }
+
+    /* Split at the median along the axis the areas are most spread out on */
+    guint64 spread_x = centers.x1 - centers.x0, spread_y = centers.y1 - centers.y0, spread_z = centers.z1 - centers.z0;
+    int axis = 0;
+    if (spread_y > spread_x && spread_y >= spread_z)
+        axis = 1;
+    else if (spread_z > spread_x && spread_z > spread_y)
+        axis = 2;
+    guint half = count / 2;
+    select_nth (boxes, items, count, half, axis);
+
+    guint child_index = index->nodes->len;
+    node->first = child_index;
+    node->count = 0;
+    g_array_set_size (index->nodes, index->nodes->len + 2);
+    build_node (index, child_index, first, half);
+    build_node (index, child_index + 1, first + half, count - half);
+}
+
+static void
+rebuild (PvAreaIndex *index)
+{
+    g_array_set_size (index->nodes, 0);
+    g_clear_pointer (&index->items, g_free);
+
+    /* Areas with no volume never overlap anything so are left out of the tree */
+    const Box *boxes = (const Box *) index->boxes->data;
+    index->items = g_new (guint, MAX (index->boxes->len, 1));
+    guint n_items = 0;
+    for (guint i = 0; i < index->boxes->len; i++)
+        if (!box_is_empty (&boxes[i]))
+            index->items[n_items++] = i;
+    index->tree_count = index->boxes->len;
+
+    if (n_items > 0) {
+        g_array_set_size (index->nodes, 1);
+        build_node (index, 0, 0, n_items);
+    }
+}
+
+static gint
+compare_area (gconstpointer a, gconstpointer b)
+{
+    guint area_a = *((const guint *) a), area_b = *((const guint *) b);
+    return area_a < area_b ? -1 : area_a > area_b;
+}
+
+void
+pv_area_index_query (PvAreaIndex *index,
+                     guint64      x,
+                     guint64      y,
+                     guint64      z,
+                     guint64      width,
+                     guint64      height,
+                     guint64      depth,
+                     GArray      *areas)
+{
+    guint pending = index->boxes->len - index->tree_count;
+    if (pending > MAX (MIN_PENDING, index->tree_count / 8))
+        rebuild (index);
+
+    g_array_set_size (areas, 0);
+
+    Box box = { x, y, z, x + width, y + height, z + depth };
+    const Box *boxes = (const Box *) index->boxes->data;
+
+    if (index->nodes->len > 0) {
+        guint stack[64];
+        guint stack_length = 0;
+        stack[stack_length++] = 0;
+        while (stack_length > 0) {
+            const Node *node = &g_array_index (index->nodes, Node, stack[--stack_length]);
+            if (!box_overlaps (&node->box, &box))
+                continue;
+
+            if (node->count == 0) {
+                stack[stack_length++] = node->first;
+                stack[stack_length++] = node->first + 1;
+                continue;
+            }
+
+            for (guint i = 0; i < node->count; i++) {
+                guint area = index->items[node->first + i];
+                if (box_overlaps (&boxes[area], &box))
+                    g_array_append_val (areas, area);
+            }
+        }
+
+        /* Later areas override earlier ones, so they must be returned in order */
+        g_array_sort (areas, compare_area);
+    }
+
+    for (guint i = index->tree_count; i < index->boxes->len; i++)
+        if (!box_is_empty (&boxes[i]) && box_overlaps (&boxes[i], &box))
+            g_array_append_val (areas, i);
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2018 Robert Ancell
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version. See http://www.gnu.org/copyleft/gpl.html the full text of the
+ * license.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef struct _PvAreaIndex PvAreaIndex;
+
+PvAreaIndex *pv_area_index_new   (void);
+
+void         pv_area_index_free  (PvAreaIndex *index);
+
+void         pv_area_index_clear (PvAreaIndex *index);
+
+guint        pv_area_index_add   (PvAreaIndex *index,
+                                  guint64      x,
+                                  guint64      y,
+                                  guint64      z,
+                                  guint64      width,
+                                  guint64      height,
+                                  guint64      depth);
+
+void         pv_area_index_query (PvAreaIndex *index,
+                                  guint64      x,
+                                  guint64      y,
+                                  guint64      z,
+                                  guint64      width,
+                                  guint64      height,
+                                  guint64      depth,
+                                  GArray      *areas);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PvAreaIndex, pv_area_index_free)
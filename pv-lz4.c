@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2018 Robert Ancell
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version. See http://www.gnu.org/copyleft/gpl.html the full text of the
+ * license.
+ */
+
+#include <string.h>
+
+#include "pv-lz4.h"
+
+/* Encoder and decoder for the LZ4 block format */
+
+#define MIN_MATCH      4
+#define HASH_BITS      12
+#define MAX_OFFSET     65535
+
+/* Matches can't start in the last 12 bytes and the last 5 bytes are always literals */
+#define MATCH_LIMIT    12
+#define LAST_LITERALS  5
+
+static guint32
+read_u32 (const guint8 *data)
+{
+    guint32 value;
+    memcpy (&value, data, 4);
+    return value;
+}
+
+static guint32
+hash_sequence (guint32 sequence)
+{
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+gsize
+pv_lz4_compress_bound (gsize length)
+{
+    return length + length / 255 + 16;
+}
+
+static guint8 *
+write_length (guint8 *out, gsize length)
+{
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = length;
+    return out;
+}
+
+static guint8 *
+write_sequence (guint8       *out,
+                const guint8 *literals,
+                gsize         n_literals,
+                gsize         offset,
+                gsize         match_length)
+{
+    guint8 *token = out++;
+    *token = MIN (n_literals, 15) << 4;
+    if (n_literals >= 15)
+        out = write_length (out, n_literals - 15);
+    memcpy (out, literals, n_literals);
+    out += n_literals;
+
+    if (match_length == 0)
+        return out;
+
+    *out++ = offset & 0xFF;
+    *out++ = offset >> 8;
+    match_length -= MIN_MATCH;
+    *token |= MIN (match_length, 15);
+    if (match_length >= 15)
+        out = write_length (out, match_length - 15);
+
+    return out;
+}
+
+/* Compress data into output, which must be at least pv_lz4_compress_bound() long.
+ * Returns the number of bytes written */
+gsize
+pv_lz4_compress (const guint8 *data,
+                 gsize         length,
+                 guint8       *output)
+{
+    guint8 *out = output;
+    gsize anchor = 0;
+
+    if (length > MATCH_LIMIT) {
+        guint32 table[1 << HASH_BITS];
+        memset (table, 0, sizeof (table));
+
+        gsize match_limit = length - MATCH_LIMIT;
+        gsize i = 0;
+        while (i < match_limit) {
+            guint32 sequence = read_u32 (data + i);
+            guint32 h = hash_sequence (sequence);
+            gsize candidate = table[h];
+            table[h] = i;
+            if (candidate >= i || i - candidate > MAX_OFFSET || read_u32 (data + candidate) != sequence) {
+                i++;
+                continue;
+            }
+
+            /* Extend the match, leaving the required literals at the end */
+            gsize match_length = MIN_MATCH;
+            gsize max_length = length - LAST_LITERALS - i;
+            while (match_length < max_length && data[candidate + match_length] == data[i + match_length])
+                match_length++;
+
+            out = write_sequence (out, data + anchor, i - anchor, i - candidate, match_length);
+            i += match_length;
+            anchor = i;
+        }
+    }
+
+    return write_sequence (out, data + anchor, length - anchor, 0, 0) - output;
+}
+
+static gboolean
+read_length (const guint8 **in,
+             const guint8  *end,
+             gsize         *length)
+{
+    guint8 value;
+    do {
+        if (*in >= end)
+            return FALSE;
+        value = *(*in)++;
+        *length += value;
+    } while (value == 255);
+    return TRUE;
+}
+
+/* Decompress data into output.
+ * Returns the number of bytes written or -1 if the data is invalid or doesn't fit */
+gssize
+pv_lz4_decompress (const guint8 *data,
+                   gsize         length,
+                   guint8       *output,
+                   gsize         output_length)
+{
+    const guint8 *in = data, *end = data + length;
+    gsize n_written = 0;
+
+    while (in < end) {
+        guint8 token = *in++;
+
+        gsize n_literals = token >> 4;
+        if (n_literals == 15 && !read_length (&in, end, &n_literals))
+            return -1;
+        if (n_literals > (gsize) (end - in) || n_literals > output_length - n_written)
+            return -1;
+        memcpy (output + n_written, in, n_literals);
+        in += n_literals;
+        n_written += n_literals;
+
+        /* Last sequence has no match */
+        if (in == end)
+            break;
+
+        if (end - in < 2)
+            return -1;
+        gsize offset = in[0] | in[1] << 8;
+        in += 2;
+        if (offset == 0 || offset > n_written)
+            return -1;
+
+        gsize match_length = token & 0xF;
+        if (match_length == 15 && !read_length (&in, end, &match_length))
+            return -1;
+        match_length += MIN_MATCH;
+        if (match_length > output_length - n_written)
+            return -1;
+
+        /* Byte at a time as matches can overlap the data being written */
+        const guint8 *match = output + n_written - offset;
+        guint8 *o = output + n_written;
+        for (gsize i = 0; i < match_length; i++)
+            o[i] = match[i];
+        n_written += match_length;
+    }
+
+    return n_written;
+}
@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2018 Robert Ancell
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version. See http://www.gnu.org/copyleft/gpl.html the full text of the
+ * license.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+gsize  pv_lz4_compress_bound (gsize         length);
+
+gsize  pv_lz4_compress       (const guint8 *data,
+                              gsize         length,
+                              guint8       *output);
+
+gssize pv_lz4_decompress     (const guint8 *data,
+                              gsize         length,
+                              guint8       *output,
+                              gsize         output_length);
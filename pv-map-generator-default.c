@@ -27,10 +27,12 @@ pv_map_generator_default_generate (PvMapGenerator *generator)
     pv_map_set_name (map, "Default Map");
     pv_map_set_description (map, "Default generated map");
 
-    guint air =   pv_map_add_block (map, "Air",     0,   0,   0);
-    guint rock =  pv_map_add_block (map, "Rock",  136, 138, 133);
-    guint dirt =  pv_map_add_block (map, "Dirt",  233, 185, 110);
-    guint grass = pv_map_add_block (map, "Grass", 138, 226,  52);
+    guint air =    pv_map_add_block (map, "Air",      0,   0,   0);
+    guint rock =   pv_map_add_block (map, "Rock",   136, 138, 133);
+    guint dirt =   pv_map_add_block (map, "Dirt",   233, 185, 110);
+    guint grass =  pv_map_add_block (map, "Grass",  138, 226,  52);
+    guint wood =   pv_map_add_block (map, "Wood",   143,  89,   2);
+    guint leaves = pv_map_add_block (map, "Leaves",  78, 154,   6);
 
     guint8 blocks[16 * 16 * 16];
     for (guint x = 0; x < 16; x++)
@@ -48,10 +50,30 @@ pv_map_generator_default_generate (PvMapGenerator *generator)
                 gsize index = ((z * 16) + y) * 16 + x;
                 blocks[index] = block_id;
             }
+    pv_map_add_area_rle (map,
+                         0, 0, 0,
+                         16, 16, 16,
+                         blocks);
+
+    /* A tree on top, too varied for runs to help */
+    guint8 tree[3 * 3 * 5];
+    for (guint x = 0; x < 3; x++)
+        for (guint y = 0; y < 3; y++)
+            for (guint z = 0; z < 5; z++) {
+                guint block_id;
+                if (x == 1 && y == 1 && z < 4)
+                    block_id = wood;
+                else if (z >= 2)
+                    block_id = leaves;
+                else
+                    block_id = air;
+                gsize index = ((z * 3) + y) * 3 + x;
+                tree[index] = block_id;
+            }
     pv_map_add_area_raster8 (map,
-                             0, 0, 0,
-                             16, 16, 16,
-                             blocks);
+                             7, 7, 8,
+                             3, 3, 5,
+                             tree);
 
     return map;
 }
@@ -10,17 +10,363 @@
 
 #include <ctype.h>
 #include <json-glib/json-glib.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
+#include "pv-area-index.h"
+#include "pv-lz4.h"
 #include "pv-map.h"
+#include "pv-packed-blocks.h"
+#include "pv-voxel-dag.h"
+#include "pv-xxhash.h"
+
+/* Blocks are decoded from the areas into chunks of CHUNK_SIZE×CHUNK_SIZE×CHUNK_SIZE */
+#define CHUNK_SHIFT  5
+#define CHUNK_SIZE   (1 << CHUNK_SHIFT)
+#define CHUNK_MASK   (CHUNK_SIZE - 1)
+#define CHUNK_VOXELS (CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE)
+G_STATIC_ASSERT (CHUNK_SIZE == PV_MAP_CHUNK_SIZE);
+
+/* Chunks track which 4x4x4 bricks contain non-default blocks */
+#define BRICK_SHIFT 2
+#define BRICK_SIZE (1 << BRICK_SHIFT)
+#define BRICK_MASK (BRICK_SIZE - 1)
+#define CHUNK_BRICKS (CHUNK_SIZE / BRICK_SIZE)
+G_STATIC_ASSERT (BRICK_SIZE == PV_MAP_BRICK_SIZE);
+
+/* Regions with at least this many blocks are fetched using multiple threads */
+#define PARALLEL_GET_BLOCKS_VOLUME (CHUNK_VOXELS * 64)
+
+/* Maximum number of edited chunks to keep uncompacted before compacting them all */
+#define MAX_PENDING_CHUNKS 64
+
+/* Chunks containing a single block type are stored as a value in uniform_chunks instead of as a Chunk.
+ * The key packs the chunk coordinates into this many bits each, larger coordinates are kept as a Chunk */
+#define UNIFORM_CHUNK_BITS (sizeof (gpointer) * 8 / 3)
+#define UNIFORM_CHUNK_PRESENT (1u << 16)
+#define UNIFORM_CHUNK_EDITED (1u << 17)
+
+/* Maximum number of block types in a chunk to keep counts of each for */
+#define MAX_SUMMED_BLOCKS 4
+
+/* LZ4 data is split into independently compressed frames of at most this size */
+#define LZ4_FRAME_SIZE 65536
+
+/* Amount of deflate data decompressed at a time */
+#define DEFLATE_BUFFER_SIZE 16384
+
+/* Summed-volume tables for a chunk, each entry is the count of blocks in
+ * the box from the chunk origin to that block inclusive.
+ * These are shared with snapshots so are never modified once created */
+typedef struct
+{
+    /* Block types with tables or -1 if the chunk has too many to track */
+    gint     n_blocks;
+    guint16  blocks[MAX_SUMMED_BLOCKS];
+
+    /* Table of non-default blocks, followed by a table for each block type */
+    guint16  sums[];
+} ChunkSums;
+
+typedef struct
+{
+    /* Location in chunks */
+    guint64  x;
+    guint64  y;
+    guint64  z;
+
+    /* Blocks in Z, Y, X order or NULL if all the default block.
+     * These are reference counted so they can be shared with snapshots */
+    guint16 *blocks;
+
+    /* TRUE if blocks may be shared with a snapshot and must be copied before modifying */
+    gboolean shared;
+
+    /* Blocks stored in a DAG if blocks is NULL */
+    PvVoxelDag *dag;
+    guint32  node;
+
+    /* Blocks stored with a palette if blocks is NULL.
+     * If neither dag or packed are set, all the blocks are the one in node */
+    PvPackedBlocks *packed;
+
+    /* TRUE if blocks have been set, so the chunk is saved as an area after the others */
+    gboolean edited;
+
+    /* TRUE if the blocks have been edited and the chunk is waiting to be compacted */
+    gboolean pending;
+
+    /* Bricks that contain non-default blocks, bit (by * 8 + bx) of brick_occupancy[bz] */
+    guint64  brick_occupancy[CHUNK_BRICKS];
+
+    /* Blocks that are not the default block, bit x of occupancy[z * 32 + y].
+     * NULL if the whole chunk is empty or the whole chunk is occupied, as brick_occupancy is then exact */
+    guint32 *occupancy;
+
+    /* Summed-volume tables or NULL if not being tracked or the chunk is uniform */
+    ChunkSums *sums;
+
+    /* Hash of the blocks, the same for all chunks with the same contents.
+     * Calculated when first needed by pv_map_diff if hash_valid is FALSE */
+    guint64  hash;
+    gboolean hash_valid;
+} Chunk;
+
+/* Level of the tree of chunk hashes, each node combines 2x2x2 nodes from the level below */
+typedef struct
+{
+    guint64   width;
+    guint64   height;
+    guint64   depth;
+    guint64  *hashes;
+
+    /* TRUE for nodes with a hash that is up to date */
+    gboolean *valid;
+} HashLevel;
+
+/* A box of chunks that areas are being decoded into */
+typedef struct
+{
+    guint64  x;
+    guint64  y;
+    guint64  z;
+    guint64  width;
+    guint64  height;
+    guint64  depth;
+
+    /* Chunks to write to, NULL for chunks to not modify */
+    Chunk  **chunks;
+} ChunkGrid;
+
+/* Deflate data blocks decompressed during an operation that applies the same areas many times,
+ * as deflate data can't be decoded from part way through */
+typedef struct
+{
+    GMutex      mutex;
+    GHashTable *data;
+} DecodeCache;
+
+typedef struct
+{
+    gchar  *name;
+    guint8  red;
+    guint8  green;
+    guint8  blue;
+} BlockType;
+
+/* Values are stored in binary headers so must not be changed */
+typedef enum
+{
+    AREA_TYPE_UNKNOWN,
+    AREA_TYPE_FILL,
+    AREA_TYPE_RASTER8,
+    AREA_TYPE_COORD8_8,
+    AREA_TYPE_RLE,
+    AREA_TYPE_RASTER16,
+} AreaType;
+
+typedef struct
+{
+    AreaType    type;
+    guint64     x;
+    guint64     y;
+    guint64     z;
+    guint64     width;
+    guint64     height;
+    guint64     depth;
+
+    /* Block to fill with for AREA_TYPE_FILL */
+    guint16     block;
+
+    /* Data block used or -1 if none */
+    gint64      data;
+
+    /* Compression used for the data block in the file */
+    PvMapCompression compression;
+
+    /* Original JSON for areas of unknown type so they are preserved when saved */
+    JsonObject *object;
+} Area;
+
+typedef struct
+{
+    gint             ref_count;
+
+    /* Data or NULL if not yet read from the stream */
+    GBytes          *data;
+
+    /* Stream and location to read data from */
+    GInputStream    *stream;
+    goffset          offset;
+
+    /* How data is encoded in memory */
+    PvMapCompression compression;
+} DataBlock;
+
+/* Data block being compressed for saving */
+typedef struct
+{
+    guint            index;
+    PvMapCompression compression;
+    GBytes          *data;
+    GError          *error;
+    gboolean         complete;
+} EncodeJob;
+
+/* Areas and data blocks to be saved after the ones in the map */
+typedef struct
+{
+    GArray           *areas;
+    GPtrArray        *data_blocks;
+    GHashTable       *data_block_ids;
+
+    /* Compression to write each data block with, the map's blocks followed by these */
+    PvMapCompression *compression;
+} SaveData;
+
+typedef struct
+{
+    PvMap           *map;
+    SaveData        *save;
+    GCancellable    *cancellable;
+    GMutex           mutex;
+    GCond            cond;
+} EncodeContext;
+
+/* State of a map being loaded on another thread */
+typedef struct
+{
+    GTask           *task;
+
+    /* Source being loaded, one of these is set */
+    GInputStream    *stream;
+    GBytes          *bytes;
+
+    /* Progress waiting to be reported in the task context */
+    GMutex           mutex;
+    guint64          n_bytes;
+    guint            n_areas;
+    guint            n_areas_total;
+    gboolean         report_pending;
+} LoadData;
+
+/* Map being saved on another thread */
+typedef struct
+{
+    PvMap           *snapshot;
+    GOutputStream   *stream;
+} SaveAsyncData;
+
+/* Chunk being converted into an area when compacting */
+typedef struct
+{
+    PvMap           *map;
+    Chunk           *chunk;
+    Area             area;
+    GBytes          *data;
+} CompactJob;
+
+/* Reads forwards through a data block, decompressing as required */
+typedef struct
+{
+    const guint8    *data;
+    gsize            data_length;
+    PvMapCompression compression;
+
+    /* Amount of data consumed */
+    gsize            offset;
+
+    /* Decoded data and its location in the decoded stream */
+    const guint8    *window;
+    gsize            window_offset;
+    gsize            window_length;
+    gboolean         finished;
+
+    guint8          *buffer;
+    GConverter      *converter;
+} DataReader;
 
 struct _PvMap
 {
     GObject       parent_instance;
 
+    guint64       width;
+    guint64       height;
+    guint64       depth;
+    gchar        *name;
+    gchar        *description;
+    gchar        *author;
+    gchar        *author_email;
+    GArray       *blocks;
+    GArray       *areas;
+
+    /* Unknown JSON members from block 0 that are written back on save */
     JsonObject   *root;
+
     GPtrArray    *data_blocks;
+
+    /* Index of the data block with each uncompressed payload added in memory, so identical ones are shared */
+    GHashTable   *data_block_ids;
+
+    /* Data block containing the offsets of the other data blocks or -1 if none */
+    gint64        data_table;
+
+    /* TRUE if block types and areas are saved in a binary data block instead of the JSON */
+    gboolean      binary_header;
+
+    /* Data block containing the binary header being loaded or -1 if none */
+    gint64        binary_header_block;
+
+    /* First failure to read a data block from the stream after loading, or NULL */
+    GError       *read_error;
+
+    /* TRUE if this is a snapshot and can't be modified */
+    gboolean      read_only;
+
+    /* How decoded chunks are stored */
+    PvMapStorage  storage;
+    PvVoxelDag   *dag;
+
+    /* TRUE if chunks keep summed-volume tables for counting blocks */
+    gboolean      summed_volumes;
+
+    /* Compression to use for new areas */
+    PvMapCompression compression;
+
+    /* Bounds of the areas for finding the ones that affect a region */
+    PvAreaIndex  *area_index;
+
+    /* Chunks that have been decoded from areas */
+    GHashTable   *chunks;
+
+    /* Decoded chunks that contain a single block type, stored without a Chunk */
+    GHashTable   *uniform_chunks;
+
+    /* Edited chunks that haven't been compacted yet */
+    GPtrArray    *pending_chunks;
+
+    /* Levels above the chunks in the hash tree, built on demand or NULL if not built */
+    GArray       *hash_levels;
+
+    /* Regions changed since the last changed signal */
+    GArray       *changed_regions;
+    guint         changes_freeze_count;
+
+    /* Worker threads for fetching large regions, created on first use */
+    GThreadPool  *row_pool;
 };
 
+enum
+{
+    SIGNAL_CHANGED,
+    SIGNAL_LOAD_PROGRESS,
+    SIGNAL_LAST
+};
+
+static guint signals[SIGNAL_LAST] = { 0 };
+
 G_DEFINE_TYPE (PvMap, pv_map, G_TYPE_OBJECT)
 
 static guint32
@@ -67,6 +413,87 @@ write_uint32 (GOutputStream *stream,
     return g_output_stream_write_all (stream, buffer, 4, NULL, cancellable, error);
 }
 
+/* Read a little-endian number of size octets */
+static gboolean
+read_uint (const guint8 *data,
+           gsize         length,
+           gsize        *offset,
+           gsize         size,
+           guint64      *value)
+{
+    if (length - *offset < size)
+        return FALSE;
+
+    *value = 0;
+    for (gsize i = 0; i < size; i++)
+        *value |= (guint64) data[*offset + i] << (i * 8);
+    *offset += size;
+
+    return TRUE;
+}
+
+static gboolean
+read_varint (const guint8 *data,
+             gsize         length,
+             gsize        *offset,
+             guint64      *value)
+{
+    *value = 0;
+    for (int shift = 0; *offset < length && shift <= 63; shift += 7) {
+        guint8 v = data[(*offset)++];
+        *value |= (guint64) (v & 0x7F) << shift;
+        if ((v & 0x80) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void
+append_uint8 (GByteArray *data,
+              guint8      value)
+{
+    g_byte_array_append (data, &value, 1);
+}
+
+static void
+append_uint16 (GByteArray *data,
+               guint16     value)
+{
+    guint8 buffer[2] = { value & 0xFF, value >> 8 };
+    g_byte_array_append (data, buffer, 2);
+}
+
+static void
+append_uint32 (GByteArray *data,
+               guint32     value)
+{
+    guint8 buffer[4];
+    for (int i = 0; i < 4; i++)
+        buffer[i] = (value >> (i * 8)) & 0xFF;
+    g_byte_array_append (data, buffer, 4);
+}
+
+static void
+append_uint64 (GByteArray *data,
+               guint64     value)
+{
+    guint8 buffer[8];
+    for (int i = 0; i < 8; i++)
+        buffer[i] = (value >> (i * 8)) & 0xFF;
+    g_byte_array_append (data, buffer, 8);
+}
+
+/* Write a little-endian base 128 number */
+static void
+append_varint (GByteArray *data,
+               guint64     value)
+{
+    do {
+        append_uint8 (data, (value & 0x7F) | (value > 0x7F ? 0x80 : 0));
+        value >>= 7;
+    } while (value != 0);
+}
+
 gint64
 get_int64_member (JsonObject *object, const gchar *member_name, gint64 default_value)
 {
@@ -98,320 +525,569 @@ get_string_member (JsonObject *object, const gchar *member_name, const gchar *de
     return json_node_get_string (node);
 }
 
-static void
-pv_map_dispose (GObject *object)
+static guint
+chunk_hash (gconstpointer key)
 {
-    PvMap *self = PV_MAP (object);
+    const Chunk *chunk = key;
+    return (guint) (chunk->x * 73856093u ^ chunk->y * 19349663u ^ chunk->z * 83492791u);
+}
 
-    g_clear_pointer (&self->root, json_object_unref);
-    g_clear_pointer (&self->data_blocks, g_ptr_array_unref);
+static gboolean
+chunk_equal (gconstpointer a, gconstpointer b)
+{
+    const Chunk *chunk_a = a, *chunk_b = b;
+    return chunk_a->x == chunk_b->x && chunk_a->y == chunk_b->y && chunk_a->z == chunk_b->z;
+}
 
-    G_OBJECT_CLASS (pv_map_parent_class)->dispose (object);
+static guint
+uniform_chunk_hash (gconstpointer key)
+{
+    gsize k = GPOINTER_TO_SIZE (key);
+    gsize mask = ((gsize) 1 << UNIFORM_CHUNK_BITS) - 1;
+    return (guint) ((k & mask) * 73856093u ^ ((k >> UNIFORM_CHUNK_BITS) & mask) * 19349663u ^ (k >> (UNIFORM_CHUNK_BITS * 2)) * 83492791u);
 }
 
-void
-pv_map_class_init (PvMapClass *klass)
+/* Get the key for a chunk in uniform_chunks. Returns FALSE if the coordinates are too large to pack */
+static gboolean
+get_uniform_chunk_key (guint64   x,
+                       guint64   y,
+                       guint64   z,
+                       gpointer *key)
 {
-    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    if ((x | y | z) >> UNIFORM_CHUNK_BITS != 0)
+        return FALSE;
+    *key = GSIZE_TO_POINTER ((gsize) x | (gsize) y << UNIFORM_CHUNK_BITS | (gsize) z << (UNIFORM_CHUNK_BITS * 2));
+    return TRUE;
+}
 
-    object_class->dispose = pv_map_dispose;
+static guint64
+get_blocks_hash (const guint16 *blocks)
+{
+    return pv_xxhash64 (blocks, sizeof (guint16) * CHUNK_VOXELS, 0);
 }
 
-void
-pv_map_init (PvMap *self)
+/* Get the hash of a chunk containing only the default block */
+static guint64
+get_empty_hash (void)
 {
-    self->root = json_object_new ();
-    self->data_blocks = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+    static gsize initialized = 0;
+    static guint64 hash;
+    if (g_once_init_enter (&initialized)) {
+        g_autofree guint16 *blocks = g_new0 (guint16, CHUNK_VOXELS);
+        hash = get_blocks_hash (blocks);
+        g_once_init_leave (&initialized, 1);
+    }
+    return hash;
 }
 
-PvMap *
-pv_map_new (void)
+static Chunk *
+chunk_new (guint64 x, guint64 y, guint64 z)
 {
-    return g_object_new (pv_map_get_type (), NULL);
+    Chunk *chunk = g_new0 (Chunk, 1);
+    chunk->x = x;
+    chunk->y = y;
+    chunk->z = z;
+    chunk->node = PV_VOXEL_DAG_UNIFORM (0);
+    chunk->hash = get_empty_hash ();
+    chunk->hash_valid = TRUE;
+    return chunk;
 }
 
-gboolean
-pv_map_load (PvMap        *self,
-             GInputStream *stream,
-             GCancellable *cancellable,
-             GError      **error)
+static void
+chunk_free (Chunk *chunk)
 {
-    g_return_val_if_fail (PV_IS_MAP (self), FALSE);
+    g_clear_pointer (&chunk->blocks, g_atomic_rc_box_release);
+    g_clear_pointer (&chunk->occupancy, g_free);
+    g_clear_pointer (&chunk->sums, g_atomic_rc_box_release);
+    if (chunk->dag != NULL)
+        pv_voxel_dag_unref_node (chunk->dag, chunk->node);
+    g_clear_pointer (&chunk->packed, pv_packed_blocks_unref);
+    g_free (chunk);
+}
 
-    guint32 id;
-    g_autoptr(GError) local_error = NULL;
-    if (!read_uint32 (stream, &id, cancellable, &local_error) ||
-        id != id_to_uint ("PiVx")) {
-        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Not a Pivox map file");
-        return FALSE;
+/* Fill in a chunk from its entry in uniform_chunks */
+static void
+chunk_init_uniform (Chunk   *chunk,
+                    gpointer key,
+                    guint    value)
+{
+    gsize k = GPOINTER_TO_SIZE (key);
+    gsize mask = ((gsize) 1 << UNIFORM_CHUNK_BITS) - 1;
+    guint16 block = value & 0xFFFF;
+    memset (chunk, 0, sizeof (Chunk));
+    chunk->x = k & mask;
+    chunk->y = (k >> UNIFORM_CHUNK_BITS) & mask;
+    chunk->z = k >> (UNIFORM_CHUNK_BITS * 2);
+    chunk->node = PV_VOXEL_DAG_UNIFORM (block);
+    chunk->edited = (value & UNIFORM_CHUNK_EDITED) != 0;
+    if (block != 0)
+        memset (chunk->brick_occupancy, 0xFF, sizeof (chunk->brick_occupancy));
+    else {
+        chunk->hash = get_empty_hash ();
+        chunk->hash_valid = TRUE;
     }
+}
 
-    int block_count = 0;
-    while (TRUE) {
-        guint32 block_length;
-        if (!read_uint32 (stream, &block_length, cancellable, error))
-            return FALSE;
-
-        /* Terminate on zero length block */
-        if (block_length == 0)
-            break;
-
-        guint8 *block = malloc (block_length);
-        if (block == NULL) {
-            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                         "Unable to load Pivox map file: Not able to allocate %d octets for block %d", block_length, block_count);
-            return FALSE;
-        }
+/* Get the occupied bricks in a row of bricks, bit bx is set for each brick with non-default blocks */
+static guint8
+get_brick_row_occupancy (const guint32 *occupancy,
+                         int            by,
+                         int            bz)
+{
+    /* Combine the rows in each brick, then check each group of four bits */
+    guint32 bits = 0;
+    for (int z = 0; z < BRICK_SIZE; z++)
+        for (int y = 0; y < BRICK_SIZE; y++)
+            bits |= occupancy[(bz * BRICK_SIZE + z) * CHUNK_SIZE + by * BRICK_SIZE + y];
 
-        gsize n_read;
-        if (!g_input_stream_read_all (stream, block, block_length, &n_read, cancellable, error)) {
-            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                         "Unable to load Pivox map file: Failed to read block %d: %s", block_count, local_error->message);
-            return FALSE;
-        }
-        if (n_read != block_length) {
-            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                         "Unable to load Pivox map file: Not enough space for block %d", block_count);
-            return FALSE;
-        }
+    guint8 brick_bits = 0;
+    for (int bx = 0; bx < CHUNK_BRICKS; bx++)
+        if ((bits >> (bx * BRICK_SIZE)) & 0xF)
+            brick_bits |= 1 << bx;
+    return brick_bits;
+}
 
-        if (block_count == 0) {
-            g_autoptr(JsonParser) parser = json_parser_new ();
-            g_autoptr(GError) local_error = NULL;
-            if (!json_parser_load_from_data (parser, (const gchar *) block, block_length, &local_error)) {
-                g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Unable to load Pivox map file: Block 0 does not contain valid JSON data: %s", local_error->message);
-                return FALSE;
-            }
-            JsonNode *root = json_parser_steal_root (parser);
-            if (!JSON_NODE_HOLDS_OBJECT (root)) {
-                g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                                     "Unable to load Pivox map file: Block 0 does not contain a JSON object");
-                return FALSE;
-            }
-            g_clear_pointer (&self->root, json_object_unref);
-            self->root = json_node_dup_object (root);
-        }
-        else {
-            g_ptr_array_add (self->data_blocks, g_bytes_new_take (g_steal_pointer (&block), block_length));
-        }
+static void
+chunk_update_occupancy (Chunk *chunk)
+{
+    if (chunk->occupancy == NULL)
+        chunk->occupancy = g_new (guint32, CHUNK_SIZE * CHUNK_SIZE);
 
-        block_count++;
+    gboolean is_full = TRUE;
+    for (gsize i = 0; i < CHUNK_SIZE * CHUNK_SIZE; i++) {
+        const guint16 *row = chunk->blocks + i * CHUNK_SIZE;
+        guint32 bits = 0;
+        for (int x = 0; x < CHUNK_SIZE; x++)
+            if (row[x] != 0)
+                bits |= 1u << x;
+        chunk->occupancy[i] = bits;
+        if (bits != G_MAXUINT32)
+            is_full = FALSE;
     }
 
-    if (block_count == 0) {
-        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                     "Unable to load Pivox map file: Contains no data blocks");
-        return FALSE;
+    gboolean is_empty = TRUE;
+    for (int bz = 0; bz < CHUNK_BRICKS; bz++) {
+        guint64 brick_bits = 0;
+        for (int by = 0; by < CHUNK_BRICKS; by++)
+            brick_bits |= (guint64) get_brick_row_occupancy (chunk->occupancy, by, bz) << (by * CHUNK_BRICKS);
+        chunk->brick_occupancy[bz] = brick_bits;
+        if (brick_bits != 0)
+            is_empty = FALSE;
     }
 
-    return TRUE;
+    if (is_empty || is_full)
+        g_clear_pointer (&chunk->occupancy, g_free);
 }
 
-gboolean
-pv_map_save (PvMap         *self,
-             GOutputStream *stream,
-             GCancellable  *cancellable,
-             GError       **error)
+static gboolean
+chunk_is_empty (Chunk *chunk)
 {
-    if (!g_output_stream_write_all (stream, "PiVx", 4, NULL, cancellable, error))
-        return FALSE;
-
-    g_autoptr(JsonGenerator) generator = json_generator_new ();
-    g_autoptr(JsonNode) node = json_node_new (JSON_NODE_OBJECT);
-    json_node_set_object (node, self->root);
-    json_generator_set_root (generator, node);
-    json_generator_set_pretty (generator, TRUE);
-    gsize json_data_length;
-    g_autofree gchar *json_data = json_generator_to_data (generator, &json_data_length);
-
-    if (!write_uint32 (stream, json_data_length, cancellable, error) ||
-        !g_output_stream_write_all (stream, json_data, json_data_length, NULL, cancellable, error))
-        return FALSE;
-
-    for (guint i = 0; i < self->data_blocks->len; i++) {
-        GBytes *data_block = g_ptr_array_index (self->data_blocks, i);
-        gsize data_length;
-        gconstpointer data = g_bytes_get_data (data_block, &data_length);
-        if (!write_uint32 (stream, data_length, cancellable, error) ||
-            !g_output_stream_write_all (stream, data, data_length, NULL, cancellable, error))
+    for (int bz = 0; bz < CHUNK_BRICKS; bz++)
+        if (chunk->brick_occupancy[bz] != 0)
             return FALSE;
-    }
-
-    if (!write_uint32 (stream, 0, cancellable, error))
-        return FALSE;
-
     return TRUE;
 }
 
-void
-pv_map_set_width (PvMap  *self,
-                  guint64 width)
+/* Check if a brick contains non-default blocks, using chunk coordinates */
+static gboolean
+chunk_is_brick_occupied (Chunk *chunk,
+                         guint  x,
+                         guint  y,
+                         guint  z)
 {
-    g_return_if_fail (PV_IS_MAP (self));
-    json_object_set_int_member (self->root, "width", width);
+    return (chunk->brick_occupancy[z >> BRICK_SHIFT] >> ((y >> BRICK_SHIFT) * CHUNK_BRICKS + (x >> BRICK_SHIFT))) & 1;
 }
 
-guint64
-pv_map_get_width (PvMap *self)
+/* Get the occupancy of a row of blocks in a chunk */
+static guint32
+chunk_get_occupancy (Chunk *chunk,
+                     guint  y,
+                     guint  z)
 {
-    g_return_val_if_fail (PV_IS_MAP (self), 0);
-    return get_uint64_member (self->root, "width", 1);
+    if (chunk->occupancy != NULL)
+        return chunk->occupancy[z * CHUNK_SIZE + y];
+
+    guint32 bits = 0;
+    for (int bx = 0; bx < CHUNK_BRICKS; bx++)
+        if (chunk_is_brick_occupied (chunk, bx * BRICK_SIZE, y, z))
+            bits |= 0xFu << (bx * BRICK_SIZE);
+    return bits;
 }
 
-void
-pv_map_set_height (PvMap   *self,
-                   guint64  height)
+static void
+build_sums (guint16       *sums,
+            const guint16 *blocks,
+            gboolean       match_all,
+            guint16        block)
 {
-    g_return_if_fail (PV_IS_MAP (self));
-    json_object_set_int_member (self->root, "height", height);
+    for (int z = 0; z < CHUNK_SIZE; z++)
+        for (int y = 0; y < CHUNK_SIZE; y++) {
+            gsize offset = (z * CHUNK_SIZE + y) * CHUNK_SIZE;
+            guint16 row_sum = 0;
+            for (int x = 0; x < CHUNK_SIZE; x++) {
+                if (match_all ? blocks[offset + x] != 0 : blocks[offset + x] == block)
+                    row_sum++;
+                guint16 sum = row_sum;
+                if (y > 0)
+                    sum += sums[offset + x - CHUNK_SIZE];
+                if (z > 0)
+                    sum += sums[offset + x - CHUNK_SIZE * CHUNK_SIZE];
+                if (y > 0 && z > 0)
+                    sum -= sums[offset + x - CHUNK_SIZE * CHUNK_SIZE - CHUNK_SIZE];
+                sums[offset + x] = sum;
+            }
+        }
 }
 
-guint64
-pv_map_get_height (PvMap *self)
+static void
+chunk_update_sums (Chunk         *chunk,
+                   const guint16 *blocks)
 {
-    g_return_val_if_fail (PV_IS_MAP (self), 0);
-    return get_uint64_member (self->root, "height", 1);
-}
+    /* Find the block types used, if there are only a few */
+    gint n_blocks = 0;
+    guint16 types[MAX_SUMMED_BLOCKS];
+    for (gsize i = 0; i < CHUNK_VOXELS && n_blocks >= 0; i++) {
+        guint16 block = blocks[i];
+        if (block == 0)
+            continue;
+        gint j;
+        for (j = 0; j < n_blocks && types[j] != block; j++);
+        if (j < n_blocks)
+            continue;
+        if (n_blocks == MAX_SUMMED_BLOCKS)
+            n_blocks = -1;
+        else
+            types[n_blocks++] = block;
+    }
 
-void
-pv_map_set_depth (PvMap  *self,
-                  guint64 depth)
-{
-    g_return_if_fail (PV_IS_MAP (self));
-    json_object_set_int_member (self->root, "depth", depth);
+    gsize n_tables = 1 + MAX (n_blocks, 0);
+    g_clear_pointer (&chunk->sums, g_atomic_rc_box_release);
+    chunk->sums = g_atomic_rc_box_alloc (sizeof (ChunkSums) + sizeof (guint16) * CHUNK_VOXELS * n_tables);
+    chunk->sums->n_blocks = n_blocks;
+    build_sums (chunk->sums->sums, blocks, TRUE, 0);
+    for (gint i = 0; i < n_blocks; i++) {
+        chunk->sums->blocks[i] = types[i];
+        build_sums (chunk->sums->sums + CHUNK_VOXELS * (i + 1), blocks, FALSE, types[i]);
+    }
 }
 
-guint64
-pv_map_get_depth (PvMap *self)
+static gint64
+get_sum (const guint16 *sums,
+         gint           x,
+         gint           y,
+         gint           z)
 {
-    g_return_val_if_fail (PV_IS_MAP (self), 0);
-    return get_uint64_member (self->root, "depth", 1);
+    if (x < 0 || y < 0 || z < 0)
+        return 0;
+    return sums[(z * CHUNK_SIZE + y) * CHUNK_SIZE + x];
 }
 
-void
-pv_map_set_name (PvMap       *self,
-                 const gchar *name)
+/* Get the total in a summed-volume table for the box [x0, x1) × [y0, y1) × [z0, z1) */
+static guint64
+sum_box (const guint16 *sums,
+         gint           x0,
+         gint           y0,
+         gint           z0,
+         gint           x1,
+         gint           y1,
+         gint           z1)
 {
-    g_return_if_fail (PV_IS_MAP (self));
-    json_object_set_string_member (self->root, "name", name);
+    x0--; y0--; z0--;
+    x1--; y1--; z1--;
+    return get_sum (sums, x1, y1, z1)
+         - get_sum (sums, x0, y1, z1) - get_sum (sums, x1, y0, z1) - get_sum (sums, x1, y1, z0)
+         + get_sum (sums, x0, y0, z1) + get_sum (sums, x0, y1, z0) + get_sum (sums, x1, y0, z0)
+         - get_sum (sums, x0, y0, z0);
 }
 
-const gchar *
-pv_map_get_name (PvMap *self)
+static guint16
+chunk_get_block (Chunk *chunk,
+                 guint  x,
+                 guint  y,
+                 guint  z)
 {
-    g_return_val_if_fail (PV_IS_MAP (self), NULL);
-    return get_string_member (self->root, "name", NULL);
+    if (chunk->blocks != NULL)
+        return chunk->blocks[(z * CHUNK_SIZE + y) * CHUNK_SIZE + x];
+    if (chunk->packed != NULL)
+        return pv_packed_blocks_get_block (chunk->packed, (z * CHUNK_SIZE + y) * CHUNK_SIZE + x);
+    if (chunk->dag == NULL)
+        return PV_VOXEL_DAG_GET_BLOCK (chunk->node);
+    return pv_voxel_dag_get_block (chunk->dag, chunk->node, x, y, z);
 }
 
-void
-pv_map_set_description (PvMap       *self,
-                        const gchar *description)
+/* TRUE if all the blocks in the chunk are the one in node */
+static gboolean
+chunk_is_uniform (Chunk *chunk)
 {
-    g_return_if_fail (PV_IS_MAP (self));
-    json_object_set_string_member (self->root, "description", description);
+    return chunk->blocks == NULL && chunk->dag == NULL && chunk->packed == NULL;
 }
 
-const gchar *
-pv_map_get_description (PvMap *self)
+/* Allocate a buffer for chunk_get_blocks to decode into, or NULL if chunks are not encoded */
+static guint16 *
+chunk_buffer_new (PvMap *self)
 {
-    g_return_val_if_fail (PV_IS_MAP (self), NULL);
-    return get_string_member (self->root, "description", NULL);
+    if (self->dag == NULL && self->storage != PV_MAP_STORAGE_PALETTE)
+        return NULL;
+    return g_new (guint16, CHUNK_VOXELS);
 }
 
-void
-pv_map_set_author (PvMap       *self,
-                   const gchar *author)
+/* Drop the block storage if the chunk only contains the default block */
+static void
+chunk_compact (PvMap *self,
+               Chunk *chunk)
 {
-    g_return_if_fail (PV_IS_MAP (self));
-    json_object_set_string_member (self->root, "author", author);
-}
+    if (chunk->blocks == NULL)
+        return;
 
-const gchar *
-pv_map_get_author (PvMap *self)
-{
-    g_return_val_if_fail (PV_IS_MAP (self), NULL);
-    return get_string_member (self->root, "author", NULL);
+    chunk->hash_valid = FALSE;
+    chunk_update_occupancy (chunk);
+    if (self->summed_volumes)
+        chunk_update_sums (chunk, chunk->blocks);
+
+    if (self->storage == PV_MAP_STORAGE_DAG) {
+        chunk->node = pv_voxel_dag_add (self->dag, chunk->blocks);
+        chunk->dag = PV_VOXEL_DAG_IS_UNIFORM (chunk->node) ? NULL : self->dag;
+    }
+    else if (self->storage == PV_MAP_STORAGE_PALETTE) {
+        chunk->packed = pv_packed_blocks_new (chunk->blocks, CHUNK_VOXELS);
+        if (pv_packed_blocks_get_palette_size (chunk->packed) == 1) {
+            chunk->node = PV_VOXEL_DAG_UNIFORM (pv_packed_blocks_get_block (chunk->packed, 0));
+            g_clear_pointer (&chunk->packed, pv_packed_blocks_unref);
+        }
+    }
+    else {
+        if (!chunk_is_empty (chunk))
+            return;
+    }
+
+    g_clear_pointer (&chunk->blocks, g_atomic_rc_box_release);
+    chunk->shared = FALSE;
+    if (chunk_is_uniform (chunk))
+        g_clear_pointer (&chunk->sums, g_atomic_rc_box_release);
 }
 
-void
-pv_map_set_author_email (PvMap       *self,
-                         const gchar *author_email)
+/* Update the occupancy of rows y0-y1, z0-z1 and the bricks containing them after blocks have been set */
+static void
+chunk_update_occupancy_rows (Chunk *chunk,
+                             guint  y0,
+                             guint  z0,
+                             guint  y1,
+                             guint  z1)
 {
-    g_return_if_fail (PV_IS_MAP (self));
-    json_object_set_string_member (self->root, "author_email", author_email);
+    if (chunk->occupancy == NULL) {
+        guint32 *occupancy = g_new (guint32, CHUNK_SIZE * CHUNK_SIZE);
+        for (int z = 0; z < CHUNK_SIZE; z++)
+            for (int y = 0; y < CHUNK_SIZE; y++)
+                occupancy[z * CHUNK_SIZE + y] = chunk_get_occupancy (chunk, y, z);
+        chunk->occupancy = occupancy;
+    }
+
+    for (guint z = z0; z < z1; z++)
+        for (guint y = y0; y < y1; y++) {
+            const guint16 *row = chunk->blocks + (z * CHUNK_SIZE + y) * CHUNK_SIZE;
+            guint32 bits = 0;
+            for (int x = 0; x < CHUNK_SIZE; x++)
+                if (row[x] != 0)
+                    bits |= 1u << x;
+            chunk->occupancy[z * CHUNK_SIZE + y] = bits;
+        }
+
+    for (guint bz = z0 >> BRICK_SHIFT; bz <= (z1 - 1) >> BRICK_SHIFT; bz++)
+        for (guint by = y0 >> BRICK_SHIFT; by <= (y1 - 1) >> BRICK_SHIFT; by++) {
+            guint64 brick_bits = get_brick_row_occupancy (chunk->occupancy, by, bz);
+            chunk->brick_occupancy[bz] &= ~((guint64) 0xFF << (by * CHUNK_BRICKS));
+            chunk->brick_occupancy[bz] |= brick_bits << (by * CHUNK_BRICKS);
+        }
 }
 
-const gchar *
-pv_map_get_author_email (PvMap *self)
+/* Get the blocks in a chunk, decoding them into buffer if required.
+ * Returns NULL if all the blocks are the same, and sets block */
+static const guint16 *
+chunk_get_blocks (Chunk   *chunk,
+                  guint16 *buffer,
+                  guint16 *block)
 {
-    g_return_val_if_fail (PV_IS_MAP (self), NULL);
-    return get_string_member (self->root, "author_email", NULL);
+    *block = 0;
+    if (chunk->blocks != NULL)
+        return chunk->blocks;
+    if (chunk->packed != NULL) {
+        pv_packed_blocks_decode (chunk->packed, buffer);
+        return buffer;
+    }
+    if (chunk->dag == NULL) {
+        *block = PV_VOXEL_DAG_GET_BLOCK (chunk->node);
+        return NULL;
+    }
+
+    pv_voxel_dag_decode (chunk->dag, chunk->node, buffer);
+    return buffer;
 }
 
-guint
-pv_map_add_block (PvMap       *self,
-                  const gchar *name,
-                  guint8       red,
-                  guint8       green,
-                  guint8       blue)
+/* Get the blocks in a chunk for modifying */
+static guint16 *
+chunk_get_writable_blocks (Chunk *chunk)
 {
-    g_return_val_if_fail (PV_IS_MAP (self), 0);
-
-    JsonArray *blocks;
-    if (json_object_has_member (self->root, "blocks"))
-        blocks = json_object_get_array_member (self->root, "blocks");
-    else {
-        blocks = json_array_new ();
-        json_object_set_array_member (self->root, "blocks", blocks);
+    if (chunk->blocks == NULL) {
+        chunk->blocks = g_atomic_rc_box_alloc (sizeof (guint16) * CHUNK_VOXELS);
+        if (chunk->packed != NULL) {
+            pv_packed_blocks_decode (chunk->packed, chunk->blocks);
+            g_clear_pointer (&chunk->packed, pv_packed_blocks_unref);
+        }
+        else if (chunk->dag != NULL) {
+            pv_voxel_dag_decode (chunk->dag, chunk->node, chunk->blocks);
+            pv_voxel_dag_unref_node (chunk->dag, chunk->node);
+            chunk->dag = NULL;
+        }
+        else {
+            guint16 block = PV_VOXEL_DAG_GET_BLOCK (chunk->node);
+            for (gsize i = 0; i < CHUNK_VOXELS; i++)
+                chunk->blocks[i] = block;
+        }
+        chunk->node = PV_VOXEL_DAG_UNIFORM (0);
+    }
+    else if (chunk->shared) {
+        guint16 *blocks = g_atomic_rc_box_dup (sizeof (guint16) * CHUNK_VOXELS, chunk->blocks);
+        g_atomic_rc_box_release (chunk->blocks);
+        chunk->blocks = blocks;
     }
+    chunk->shared = FALSE;
 
-    JsonObject *block = json_object_new ();
-    json_array_add_object_element (blocks, block);
+    return chunk->blocks;
+}
 
-    if (name != NULL)
-        json_object_set_string_member (block, "name", name);
-    g_autofree gchar *color = g_strdup_printf ("#%02x%02x%02x", red, green, blue);
-    json_object_set_string_member (block, "color", color);
+/* Look up a decoded chunk, or NULL if not decoded.
+ * Chunks stored in uniform_chunks are filled into uniform, which must not be modified */
+static Chunk *
+lookup_chunk (PvMap  *self,
+              guint64 x,
+              guint64 y,
+              guint64 z,
+              Chunk  *uniform)
+{
+    Chunk key = { x, y, z, NULL };
+    Chunk *chunk = g_hash_table_lookup (self->chunks, &key);
+    if (chunk != NULL)
+        return chunk;
 
-    return pv_map_get_block_count (self) - 1;
+    gpointer uniform_key;
+    if (!get_uniform_chunk_key (x, y, z, &uniform_key))
+        return NULL;
+    guint value = GPOINTER_TO_UINT (g_hash_table_lookup (self->uniform_chunks, uniform_key));
+    if (value == 0)
+        return NULL;
+    chunk_init_uniform (uniform, uniform_key, value);
+    return uniform;
 }
 
-gsize
-pv_map_get_block_count (PvMap *self)
+/* Look up a decoded chunk for modifying, replacing its uniform_chunks entry with a Chunk if it has one */
+static Chunk *
+lookup_writable_chunk (PvMap  *self,
+                       guint64 x,
+                       guint64 y,
+                       guint64 z)
 {
-    g_return_val_if_fail (PV_IS_MAP (self), 0);
+    Chunk uniform;
+    Chunk *chunk = lookup_chunk (self, x, y, z, &uniform);
+    if (chunk != &uniform)
+        return chunk;
+
+    gpointer key;
+    get_uniform_chunk_key (x, y, z, &key);
+    g_hash_table_remove (self->uniform_chunks, key);
+    chunk = g_new (Chunk, 1);
+    *chunk = uniform;
+    g_hash_table_add (self->chunks, chunk);
+    return chunk;
+}
 
-    if (!json_object_has_member (self->root, "blocks"))
+/* Get the value to store a chunk with in uniform_chunks, or 0 if it needs to be kept as a Chunk */
+static guint
+chunk_get_uniform_value (Chunk *chunk)
+{
+    gpointer key;
+    if (!chunk_is_uniform (chunk) || chunk->pending || !get_uniform_chunk_key (chunk->x, chunk->y, chunk->z, &key))
         return 0;
+    return PV_VOXEL_DAG_GET_BLOCK (chunk->node) | UNIFORM_CHUNK_PRESENT | (chunk->edited ? UNIFORM_CHUNK_EDITED : 0);
+}
+
+/* Add a newly decoded chunk to the map */
+static void
+add_chunk (PvMap *self,
+           Chunk *chunk)
+{
+    guint value = chunk_get_uniform_value (chunk);
+    if (value == 0) {
+        g_hash_table_add (self->chunks, chunk);
+        return;
+    }
 
-    return json_array_get_length (json_object_get_array_member (self->root, "blocks"));
+    gpointer key;
+    get_uniform_chunk_key (chunk->x, chunk->y, chunk->z, &key);
+    g_hash_table_insert (self->uniform_chunks, key, GUINT_TO_POINTER (value));
+    chunk_free (chunk);
 }
 
-JsonObject *
-get_block (PvMap  *self,
-           guint16 block_id)
+/* Replace a chunk in the map with a uniform_chunks entry if it now only contains one block type */
+static void
+shrink_chunk (PvMap *self,
+              Chunk *chunk)
 {
-    g_return_val_if_fail (json_object_has_member (self->root, "blocks"), NULL);
+    guint value = chunk_get_uniform_value (chunk);
+    if (value == 0)
+        return;
 
-    JsonArray *blocks = json_object_get_array_member (self->root, "blocks");
-    g_return_val_if_fail (block_id < json_array_get_length (blocks), NULL);
+    gpointer key;
+    get_uniform_chunk_key (chunk->x, chunk->y, chunk->z, &key);
+    g_hash_table_insert (self->uniform_chunks, key, GUINT_TO_POINTER (value));
+    g_hash_table_remove (self->chunks, chunk);
+}
 
-    return json_array_get_object_element (blocks, block_id);
+/* Compact chunks that have been edited since they were last compacted */
+static void
+flush_pending_chunks (PvMap *self)
+{
+    for (guint i = 0; i < self->pending_chunks->len; i++) {
+        Chunk *chunk = g_ptr_array_index (self->pending_chunks, i);
+        chunk_compact (self, chunk);
+        chunk->pending = FALSE;
+        shrink_chunk (self, chunk);
+    }
+    g_ptr_array_set_size (self->pending_chunks, 0);
 }
 
-const gchar *
-pv_map_get_block_name (PvMap  *self,
-                       guint16 block_id)
+static void
+hash_level_clear (HashLevel *level)
 {
-    g_return_val_if_fail (PV_IS_MAP (self), NULL);
+    g_clear_pointer (&level->hashes, g_free);
+    g_clear_pointer (&level->valid, g_free);
+}
 
-    JsonObject *block = get_block (self, block_id);
-    if (block == NULL)
-        return NULL;
+/* Mark the nodes in the hash tree above the given chunks as needing to be recalculated */
+static void
+invalidate_hashes (PvMap  *self,
+                   guint64 x0,
+                   guint64 y0,
+                   guint64 z0,
+                   guint64 x1,
+                   guint64 y1,
+                   guint64 z1)
+{
+    if (self->hash_levels == NULL)
+        return;
 
-    return get_string_member (block, "name", NULL);
+    for (guint i = 0; i < self->hash_levels->len; i++) {
+        HashLevel *level = &g_array_index (self->hash_levels, HashLevel, i);
+        x0 >>= 1;
+        y0 >>= 1;
+        z0 >>= 1;
+        x1 = MIN ((x1 + 1) >> 1, level->width);
+        y1 = MIN ((y1 + 1) >> 1, level->height);
+        z1 = MIN ((z1 + 1) >> 1, level->depth);
+        for (guint64 z = z0; z < z1; z++)
+            for (guint64 y = y0; y < y1; y++)
+                for (guint64 x = x0; x < x1; x++)
+                    level->valid[(z * level->height + y) * level->width + x] = FALSE;
+    }
 }
 
 static guint8
@@ -451,149 +1127,4205 @@ parse_rgb (const gchar *color,
     *blue = parse_hex (color[5]) << 4 | parse_hex (color[6]);
 }
 
-void
-pv_map_get_block_color (PvMap  *self,
-                        guint16 block_id,
-                        guint8 *red,
-                        guint8 *green,
-                        guint8 *blue)
+static void
+block_type_clear (BlockType *block)
 {
-    g_return_if_fail (PV_IS_MAP (self));
+    g_clear_pointer (&block->name, g_free);
+}
 
-    JsonObject *block = get_block (self, block_id);
-    if (block == NULL)
-        return;
+static void
+area_clear (Area *area)
+{
+    g_clear_pointer (&area->object, json_object_unref);
+}
 
-    const gchar *color = get_string_member (block, "color", NULL);
-    parse_rgb (color, red, green, blue);
+static AreaType
+parse_area_type (const gchar *type)
+{
+    if (g_strcmp0 (type, "fill") == 0)
+        return AREA_TYPE_FILL;
+    else if (g_strcmp0 (type, "raster8") == 0)
+        return AREA_TYPE_RASTER8;
+    else if (g_strcmp0 (type, "rle") == 0)
+        return AREA_TYPE_RLE;
+    else if (g_strcmp0 (type, "raster16") == 0)
+        return AREA_TYPE_RASTER16;
+    else if (g_strcmp0 (type, "coord8.8") == 0)
+        return AREA_TYPE_COORD8_8;
+    else
+        return AREA_TYPE_UNKNOWN;
 }
 
-void
-pv_map_add_area_raster8 (PvMap  *self,
-                         guint64 x,
-                         guint64 y,
-                         guint64 z,
-                         guint64 width,
-                         guint64 height,
-                         guint64 depth,
-                         guint8 *blocks)
+static gboolean
+parse_compression (const gchar      *compression,
+                   PvMapCompression *value)
 {
-    g_return_if_fail (PV_IS_MAP (self));
+    if (g_strcmp0 (compression, "none") == 0)
+        *value = PV_MAP_COMPRESSION_NONE;
+    else if (g_strcmp0 (compression, "deflate") == 0)
+        *value = PV_MAP_COMPRESSION_DEFLATE;
+    else if (g_strcmp0 (compression, "lz4") == 0)
+        *value = PV_MAP_COMPRESSION_LZ4;
+    else
+        return FALSE;
+    return TRUE;
+}
 
-    JsonArray *areas;
-    if (json_object_has_member (self->root, "areas"))
-        areas = json_object_get_array_member (self->root, "areas");
-    else {
-        areas = json_array_new ();
-        json_object_set_array_member (self->root, "areas", areas);
+static const gchar *
+compression_to_string (PvMapCompression compression)
+{
+    switch (compression) {
+    case PV_MAP_COMPRESSION_DEFLATE:
+        return "deflate";
+    case PV_MAP_COMPRESSION_LZ4:
+        return "lz4";
+    default:
+        return "none";
     }
+}
 
-    JsonObject *area = json_object_new ();
-    json_array_add_object_element (areas, area);
+static DataBlock *
+data_block_new (GBytes          *data,
+                PvMapCompression compression)
+{
+    DataBlock *block = g_new0 (DataBlock, 1);
+    block->ref_count = 1;
+    block->data = data;
+    block->compression = compression;
+    return block;
+}
+
+static DataBlock *
+data_block_ref (DataBlock *block)
+{
+    g_atomic_int_inc (&block->ref_count);
+    return block;
+}
 
-    json_object_set_string_member (area, "type", "raster8");
-    json_object_set_int_member (area, "x", x);
-    json_object_set_int_member (area, "y", y);
-    json_object_set_int_member (area, "z", z);
-    json_object_set_int_member (area, "width", width);
-    json_object_set_int_member (area, "height", height);
-    json_object_set_int_member (area, "depth", depth);
-    json_object_set_int_member (area, "data", self->data_blocks->len);
-    json_object_set_string_member (area, "compression", "none");
+static void
+data_block_unref (DataBlock *block)
+{
+    if (!g_atomic_int_dec_and_test (&block->ref_count))
+        return;
 
-    g_ptr_array_add (self->data_blocks, g_bytes_new (blocks, width * height * depth));
+    g_clear_pointer (&block->data, g_bytes_unref);
+    g_clear_object (&block->stream);
+    g_free (block);
 }
 
-void
-pv_map_get_blocks (PvMap   *self,
-                   guint64  fill_x,
-                   guint64  fill_y,
-                   guint64  fill_z,
-                   guint64  fill_width,
-                   guint64  fill_height,
-                   guint64  fill_depth,
-                   guint16 *fill_blocks)
+static guint
+data_hash (gconstpointer key)
 {
-    g_return_if_fail (PV_IS_MAP (self));
+    gsize length;
+    gconstpointer data = g_bytes_get_data ((GBytes *) key, &length);
+    return (guint) pv_xxhash64 (data, length, 0);
+}
 
-    /* Start with default block */
-    memset (fill_blocks, 0, sizeof (guint16) * fill_width * fill_height * fill_depth);
+/* Add a data block, or reuse an existing one with the same contents. Returns the block index */
+static gint64
+add_data_block (PvMap  *self,
+                GBytes *data)
+{
+    gpointer id;
+    if (g_hash_table_lookup_extended (self->data_block_ids, data, NULL, &id)) {
+        g_bytes_unref (data);
+        return GPOINTER_TO_UINT (id);
+    }
 
-    if (!json_object_has_member (self->root, "areas"))
-        return;
+    guint index = self->data_blocks->len;
+    g_ptr_array_add (self->data_blocks, data_block_new (data, PV_MAP_COMPRESSION_NONE));
+    g_hash_table_insert (self->data_block_ids, g_bytes_ref (data), GUINT_TO_POINTER (index));
 
-    JsonArray *areas = json_object_get_array_member (self->root, "areas");
-    guint n_areas = json_array_get_length (areas);
-    for (guint i = 0; i < n_areas; i++) {
-        JsonObject *area = json_array_get_object_element (areas, i);
+    return index;
+}
 
-        guint64 area_x = get_uint64_member (area, "x", 0);
-        guint64 area_width = get_uint64_member (area, "width", 0);
-        if (area_x > fill_x + fill_width || area_x + area_width < fill_x)
-            continue;
+static void
+data_reader_init (DataReader      *reader,
+                  GBytes          *data,
+                  PvMapCompression compression)
+{
+    memset (reader, 0, sizeof (DataReader));
+    reader->data = g_bytes_get_data (data, &reader->data_length);
+    reader->compression = compression;
 
-        guint64 area_y = get_uint64_member (area, "y", 0);
-        guint64 area_height = get_uint64_member (area, "height", 0);
-        if (area_y > fill_y + fill_height || area_y + area_height < fill_y)
-            continue;
+    switch (reader->compression) {
+    case PV_MAP_COMPRESSION_NONE:
+        reader->window = reader->data;
+        reader->window_length = reader->data_length;
+        reader->finished = TRUE;
+        break;
+    case PV_MAP_COMPRESSION_DEFLATE:
+        reader->buffer = g_malloc (DEFLATE_BUFFER_SIZE);
+        reader->converter = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW));
+        break;
+    case PV_MAP_COMPRESSION_LZ4:
+        reader->buffer = g_malloc (LZ4_FRAME_SIZE);
+        break;
+    }
+}
 
-        guint64 area_z = get_uint64_member (area, "z", 0);
-        guint64 area_depth = get_uint64_member (area, "depth", 0);
-        if (area_z > fill_z + fill_depth || area_z + area_depth < fill_z)
-            continue;
+static void
+data_reader_clear (DataReader *reader)
+{
+    g_clear_pointer (&reader->buffer, g_free);
+    g_clear_object (&reader->converter);
+}
 
-        /* Get overlapping area */
-        guint64 x0 = MAX (fill_x, area_x);
-        guint64 x1 = MIN (fill_x + fill_width, area_x + area_width);
-        guint64 y0 = MAX (fill_y, area_y);
-        guint64 y1 = MIN (fill_y + fill_height, area_y + area_height);
-        guint64 z0 = MAX (fill_z, area_z);
-        guint64 z1 = MIN (fill_z + fill_depth, area_z + area_depth);
+/* Move past LZ4 frames that end before offset without decompressing them */
+static void
+data_reader_skip (DataReader *reader,
+                  gsize       offset)
+{
+    reader->window_offset += reader->window_length;
+    reader->window_length = 0;
 
-        const guint8 *data = NULL;
-        gsize data_length;
-        if (json_object_has_member (area, "data")) {
-            gint64 data_block_index = json_object_get_int_member (area, "data");
-            g_assert (data_block_index >= 0);
-            g_assert (data_block_index < self->data_blocks->len);
-            GBytes *data_block = g_ptr_array_index (self->data_blocks, data_block_index);
-            data = g_bytes_get_data (data_block, &data_length);
-        }
-
-        const gchar *type = json_object_get_string_member (area, "type");
-        if (g_strcmp0 (type, "fill") == 0) {
-            gint64 block = json_object_get_int_member (area, "block");
-            g_assert (block < 65536);
-            for (guint x = x0; x < x1; x++)
-               for (guint y = y0; y < y1; y++)
-                   for (guint z = z0; z < z1; z++)
-                       fill_blocks[((z - fill_z) * fill_height + (y - fill_y)) * fill_width + (x - fill_x)] = block;
+    while (TRUE) {
+        gsize header_offset = reader->offset;
+        guint64 frame_length, compressed_length;
+        if (!read_uint (reader->data, reader->data_length, &header_offset, 4, &frame_length) ||
+            !read_uint (reader->data, reader->data_length, &header_offset, 4, &compressed_length) ||
+            reader->window_offset + frame_length > offset ||
+            compressed_length > reader->data_length - header_offset)
+            return;
+        reader->offset = header_offset + compressed_length;
+        reader->window_offset += frame_length;
+    }
+}
+
+/* Decode the next piece of data into the window */
+static void
+data_reader_fill (DataReader *reader)
+{
+    reader->window_offset += reader->window_length;
+    reader->window_length = 0;
+    reader->window = reader->buffer;
+
+    if (reader->compression == PV_MAP_COMPRESSION_DEFLATE) {
+        gsize n_read, n_written;
+        g_autoptr(GError) error = NULL;
+        GConverterResult result = g_converter_convert (reader->converter,
+                                                       reader->data + reader->offset, reader->data_length - reader->offset,
+                                                       reader->buffer, DEFLATE_BUFFER_SIZE,
+                                                       G_CONVERTER_INPUT_AT_END,
+                                                       &n_read, &n_written,
+                                                       &error);
+        if (result == G_CONVERTER_ERROR) {
+            g_warning ("Failed to decompress data block: %s", error->message);
+            reader->finished = TRUE;
+            return;
         }
-        else if (g_strcmp0 (type, "raster8") == 0) {
-            // FIXME "compression"
-            for (guint x = x0; x < x1; x++)
-               for (guint y = y0; y < y1; y++)
-                   for (guint z = z0; z < z1; z++) {
-                       gsize offset = (((z - area_z) * area_height) + (y - area_y)) * area_width + (x - area_x);
-                       guint8 block = 0;
-                       if (offset < data_length)
-                           block = data[offset];
-                       fill_blocks[((z - fill_z) * fill_height + (y - fill_y)) * fill_width + (x - fill_x)] = block;
-                   }
-        }
-        else if (g_strcmp0 (type, "coord8.8") == 0) {
-            // FIXME "compression"
-            gsize offset = 0;
-            while (offset < data_length) {
-                guint8 x = data[offset * 4 + 0] + area_x - fill_x;
-                guint8 y = data[offset * 4 + 1] + area_y - fill_y;
-                guint8 z = data[offset * 4 + 2] + area_z - fill_z;
-                guint8 block = data[offset * 4 + 3];
-                fill_blocks[(z * fill_height + y) * fill_width + x] = block;
-                offset += 4;
-            }
+        reader->offset += n_read;
+        reader->window_length = n_written;
+        if (result == G_CONVERTER_FINISHED || (n_read == 0 && n_written == 0))
+            reader->finished = TRUE;
+    }
+    else if (reader->compression == PV_MAP_COMPRESSION_LZ4) {
+        if (reader->data_length - reader->offset < 8) {
+            reader->finished = TRUE;
+            return;
         }
-        else
-            g_warning ("Ignoring unknown area type '%s'", type);
+
+        const guint8 *header = reader->data + reader->offset;
+        guint32 frame_length = header[0] | header[1] << 8 | header[2] << 16 | (guint32) header[3] << 24;
+        guint32 compressed_length = header[4] | header[5] << 8 | header[6] << 16 | (guint32) header[7] << 24;
+        reader->offset += 8;
+        gssize n_written = -1;
+        if (frame_length <= LZ4_FRAME_SIZE && compressed_length <= reader->data_length - reader->offset)
+            n_written = pv_lz4_decompress (reader->data + reader->offset, compressed_length, reader->buffer, frame_length);
+        if (n_written != frame_length) {
+            g_warning ("Failed to decompress data block: Invalid LZ4 frame");
+            reader->finished = TRUE;
+            return;
+        }
+        reader->offset += compressed_length;
+        reader->window_length = n_written;
+    }
+    else
+        reader->finished = TRUE;
+}
+
+/* Get the decoded data at offset and how much of it is available.
+ * Offsets must not go backwards. Returns 0 if past the end of the data */
+static gsize
+data_reader_get (DataReader    *reader,
+                 gsize          offset,
+                 const guint8 **data)
+{
+    while (offset >= reader->window_offset + reader->window_length) {
+        if (reader->finished)
+            return 0;
+        if (reader->compression == PV_MAP_COMPRESSION_LZ4)
+            data_reader_skip (reader, offset);
+        data_reader_fill (reader);
+    }
+
+    *data = reader->window + (offset - reader->window_offset);
+    return reader->window_offset + reader->window_length - offset;
+}
+
+/* Copy length bytes of decoded data at offset, returns the number of bytes copied */
+static gsize
+data_reader_read (DataReader *reader,
+                  gsize       offset,
+                  guint8     *buffer,
+                  gsize       length)
+{
+    gsize n_read = 0;
+    while (n_read < length) {
+        const guint8 *data;
+        gsize n_available = data_reader_get (reader, offset + n_read, &data);
+        if (n_available == 0)
+            break;
+        n_available = MIN (n_available, length - n_read);
+        memcpy (buffer + n_read, data, n_available);
+        n_read += n_available;
+    }
+    return n_read;
+}
+
+/* Read the next run from rle data, returns FALSE if no more runs */
+static gboolean
+data_reader_read_run (DataReader *reader,
+                      gsize      *offset,
+                      guint64    *length,
+                      guint8     *block)
+{
+    /* Length is stored as a little-endian base 128 number */
+    *length = 0;
+    for (int shift = 0;; shift += 7) {
+        guint8 value;
+        if (shift > 63 || data_reader_read (reader, *offset, &value, 1) != 1)
+            return FALSE;
+        (*offset)++;
+        *length |= (guint64) (value & 0x7F) << shift;
+        if ((value & 0x80) == 0)
+            break;
+    }
+
+    if (data_reader_read (reader, *offset, block, 1) != 1)
+        return FALSE;
+    (*offset)++;
+
+    return TRUE;
+}
+
+/* Convert raster8 data into runs of the same block */
+static GBytes *
+encode_rle (const guint8 *blocks,
+            gsize         length)
+{
+    g_autoptr(GByteArray) output = g_byte_array_new ();
+    for (gsize offset = 0; offset < length;) {
+        guint8 block = blocks[offset];
+        gsize run_length = 1;
+        while (offset + run_length < length && blocks[offset + run_length] == block)
+            run_length++;
+        offset += run_length;
+
+        guint8 value[11];
+        gsize value_length = 0;
+        do {
+            value[value_length] = run_length & 0x7F;
+            run_length >>= 7;
+            if (run_length != 0)
+                value[value_length] |= 0x80;
+            value_length++;
+        } while (run_length != 0);
+        value[value_length] = block;
+        value_length++;
+        g_byte_array_append (output, value, value_length);
+    }
+
+    return g_byte_array_free_to_bytes (g_steal_pointer (&output));
+}
+
+/* Convert blocks into little-endian raster16 data */
+static GBytes *
+encode_raster16 (const guint16 *blocks,
+                 gsize          length)
+{
+    guint8 *data = g_malloc (length * 2);
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    memcpy (data, blocks, length * 2);
+#else
+    for (gsize i = 0; i < length; i++) {
+        data[i * 2] = blocks[i] & 0xFF;
+        data[i * 2 + 1] = blocks[i] >> 8;
+    }
+#endif
+    return g_bytes_new_take (data, length * 2);
+}
+
+static GBytes *
+deflate_data (const guint8 *data,
+              gsize         length)
+{
+    g_autoptr(GZlibCompressor) compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, -1);
+    g_autoptr(GByteArray) output = g_byte_array_sized_new (length / 4 + 64);
+    gsize offset = 0;
+    while (TRUE) {
+        guint8 buffer[DEFLATE_BUFFER_SIZE];
+        gsize n_read, n_written;
+        g_autoptr(GError) error = NULL;
+        GConverterResult result = g_converter_convert (G_CONVERTER (compressor),
+                                                       data + offset, length - offset,
+                                                       buffer, sizeof (buffer),
+                                                       G_CONVERTER_INPUT_AT_END,
+                                                       &n_read, &n_written,
+                                                       &error);
+        if (result == G_CONVERTER_ERROR) {
+            /* Can only fail if out of memory */
+            g_warning ("Failed to compress data block: %s", error->message);
+            return NULL;
+        }
+        offset += n_read;
+        g_byte_array_append (output, buffer, n_written);
+        if (result == G_CONVERTER_FINISHED)
+            break;
+    }
+
+    return g_byte_array_free_to_bytes (g_steal_pointer (&output));
+}
+
+static GBytes *
+lz4_data (const guint8 *data,
+          gsize         length)
+{
+    g_autoptr(GByteArray) output = g_byte_array_sized_new (length / 4 + 64);
+    g_autofree guint8 *buffer = g_malloc (pv_lz4_compress_bound (LZ4_FRAME_SIZE) + 8);
+    for (gsize offset = 0; offset < length; offset += LZ4_FRAME_SIZE) {
+        gsize frame_length = MIN (length - offset, LZ4_FRAME_SIZE);
+        gsize compressed_length = pv_lz4_compress (data + offset, frame_length, buffer + 8);
+        buffer[0] = frame_length & 0xFF;
+        buffer[1] = (frame_length >> 8) & 0xFF;
+        buffer[2] = (frame_length >> 16) & 0xFF;
+        buffer[3] = (frame_length >> 24) & 0xFF;
+        buffer[4] = compressed_length & 0xFF;
+        buffer[5] = (compressed_length >> 8) & 0xFF;
+        buffer[6] = (compressed_length >> 16) & 0xFF;
+        buffer[7] = (compressed_length >> 24) & 0xFF;
+        g_byte_array_append (output, buffer, compressed_length + 8);
     }
+
+    return g_byte_array_free_to_bytes (g_steal_pointer (&output));
+}
+
+/* Get the uncompressed contents of a data block */
+static GBytes *
+decode_data_block (DataBlock *block)
+{
+    if (block->compression == PV_MAP_COMPRESSION_NONE)
+        return g_bytes_ref (block->data);
+
+    g_autoptr(GByteArray) decoded = g_byte_array_new ();
+    DataReader reader;
+    data_reader_init (&reader, block->data, block->compression);
+    const guint8 *d;
+    gsize n;
+    while ((n = data_reader_get (&reader, decoded->len, &d)) > 0)
+        g_byte_array_append (decoded, d, n);
+    data_reader_clear (&reader);
+
+    return g_byte_array_free_to_bytes (g_steal_pointer (&decoded));
+}
+
+/* Get the contents of a data block using the given compression */
+static GBytes *
+encode_data_block (DataBlock       *block,
+                   PvMapCompression compression)
+{
+    if (block->compression == compression)
+        return g_bytes_ref (block->data);
+
+    g_autoptr(GBytes) data = decode_data_block (block);
+    gsize length;
+    const guint8 *raw = g_bytes_get_data (data, &length);
+    GBytes *encoded = NULL;
+    switch (compression) {
+    case PV_MAP_COMPRESSION_NONE:
+        return g_steal_pointer (&data);
+    case PV_MAP_COMPRESSION_DEFLATE:
+        encoded = deflate_data (raw, length);
+        break;
+    case PV_MAP_COMPRESSION_LZ4:
+        encoded = lz4_data (raw, length);
+        break;
+    }
+
+    return encoded;
+}
+
+static void
+decode_cache_init (DecodeCache *cache)
+{
+    g_mutex_init (&cache->mutex);
+    cache->data = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) g_bytes_unref);
+}
+
+static void
+decode_cache_clear (DecodeCache *cache)
+{
+    g_mutex_clear (&cache->mutex);
+    g_clear_pointer (&cache->data, g_hash_table_unref);
+}
+
+/* Get the uncompressed contents of a data block, decompressing it the first time it is used */
+static GBytes *
+decode_cache_get (DecodeCache *cache,
+                  DataBlock   *block)
+{
+    g_mutex_lock (&cache->mutex);
+    GBytes *data = g_hash_table_lookup (cache->data, block);
+    if (data == NULL) {
+        data = decode_data_block (block);
+        g_hash_table_insert (cache->data, block, data);
+    }
+    g_mutex_unlock (&cache->mutex);
+
+    return data;
+}
+
+static const gchar *
+area_type_to_string (AreaType type)
+{
+    switch (type) {
+    case AREA_TYPE_FILL:
+        return "fill";
+    case AREA_TYPE_RASTER8:
+        return "raster8";
+    case AREA_TYPE_COORD8_8:
+        return "coord8.8";
+    case AREA_TYPE_RLE:
+        return "rle";
+    case AREA_TYPE_RASTER16:
+        return "raster16";
+    default:
+        return NULL;
+    }
+}
+
+static Area *
+get_area (PvMap *self,
+          guint  area_id)
+{
+    return &g_array_index (self->areas, Area, area_id);
+}
+
+static void
+index_area (PvMap *self,
+            Area  *area)
+{
+    pv_area_index_add (self->area_index, area->x, area->y, area->z, area->width, area->height, area->depth);
+}
+
+static const gchar *header_members[] = { "name", "description", "author", "author_email", "width", "height", "depth", "blocks", "areas", "data_table", "binary_header", NULL };
+
+/* Convert the JSON in block 0 into the map model */
+static gboolean
+parse_header (PvMap      *self,
+              JsonObject *root,
+              GError    **error)
+{
+    self->data_table = get_int64_member (root, "data_table", -1);
+    self->binary_header_block = get_int64_member (root, "binary_header", -1);
+    self->binary_header = self->binary_header_block >= 0;
+    self->width = get_uint64_member (root, "width", 1);
+    self->height = get_uint64_member (root, "height", 1);
+    self->depth = get_uint64_member (root, "depth", 1);
+    g_free (self->name);
+    self->name = g_strdup (get_string_member (root, "name", NULL));
+    g_free (self->description);
+    self->description = g_strdup (get_string_member (root, "description", NULL));
+    g_free (self->author);
+    self->author = g_strdup (get_string_member (root, "author", NULL));
+    g_free (self->author_email);
+    self->author_email = g_strdup (get_string_member (root, "author_email", NULL));
+
+    g_array_set_size (self->blocks, 0);
+    if (json_object_has_member (root, "blocks")) {
+        JsonArray *blocks = json_object_get_array_member (root, "blocks");
+        guint n_blocks = blocks != NULL ? json_array_get_length (blocks) : 0;
+        if (n_blocks > G_MAXUINT16 + 1) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Unable to load Pivox map file: Too many block types (%u)", n_blocks);
+            return FALSE;
+        }
+        for (guint i = 0; i < n_blocks; i++) {
+            JsonObject *object = json_array_get_object_element (blocks, i);
+            BlockType block = { NULL, 0, 0, 0 };
+            if (object != NULL) {
+                block.name = g_strdup (get_string_member (object, "name", NULL));
+                parse_rgb (get_string_member (object, "color", NULL), &block.red, &block.green, &block.blue);
+            }
+            g_array_append_val (self->blocks, block);
+        }
+    }
+
+    g_array_set_size (self->areas, 0);
+    if (json_object_has_member (root, "areas")) {
+        JsonArray *areas = json_object_get_array_member (root, "areas");
+        guint n_areas = areas != NULL ? json_array_get_length (areas) : 0;
+        for (guint i = 0; i < n_areas; i++) {
+            JsonObject *object = json_array_get_object_element (areas, i);
+            Area area = { AREA_TYPE_UNKNOWN, 0, 0, 0, 0, 0, 0, 0, -1, PV_MAP_COMPRESSION_NONE, NULL };
+            if (object == NULL) {
+                g_array_append_val (self->areas, area);
+                continue;
+            }
+
+            const gchar *type = get_string_member (object, "type", NULL);
+            area.type = parse_area_type (type);
+            area.x = get_uint64_member (object, "x", 0);
+            area.y = get_uint64_member (object, "y", 0);
+            area.z = get_uint64_member (object, "z", 0);
+            area.width = get_uint64_member (object, "width", 0);
+            area.height = get_uint64_member (object, "height", 0);
+            area.depth = get_uint64_member (object, "depth", 0);
+            area.data = get_int64_member (object, "data", -1);
+            const gchar *compression = get_string_member (object, "compression", "none");
+            if (!parse_compression (compression, &area.compression)) {
+                g_warning ("Ignoring area with unknown compression '%s'", compression);
+                area.type = AREA_TYPE_UNKNOWN;
+            }
+            if (area.type == AREA_TYPE_FILL) {
+                guint64 block = get_uint64_member (object, "block", 0);
+                if (block > G_MAXUINT16) {
+                    area_clear (&area);
+                    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                 "Unable to load Pivox map file: Area %u has invalid block %" G_GUINT64_FORMAT, i, block);
+                    return FALSE;
+                }
+                area.block = block;
+            }
+            if (area.type == AREA_TYPE_UNKNOWN) {
+                if (parse_area_type (type) == AREA_TYPE_UNKNOWN)
+                    g_warning ("Ignoring unknown area type '%s'", type);
+                area.object = json_object_ref (object);
+            }
+            g_array_append_val (self->areas, area);
+        }
+    }
+
+    /* Keep any other members so they are not lost on save */
+    for (int i = 0; header_members[i] != NULL; i++)
+        if (json_object_has_member (root, header_members[i]))
+            json_object_remove_member (root, header_members[i]);
+    g_clear_pointer (&self->root, json_object_unref);
+    self->root = json_object_ref (root);
+
+    return TRUE;
+}
+
+static void
+save_data_init (SaveData *save)
+{
+    save->areas = g_array_new (FALSE, TRUE, sizeof (Area));
+    g_array_set_clear_func (save->areas, (GDestroyNotify) area_clear);
+    save->data_blocks = g_ptr_array_new_with_free_func ((GDestroyNotify) data_block_unref);
+    save->data_block_ids = g_hash_table_new_full (data_hash, (GEqualFunc) g_bytes_equal, (GDestroyNotify) g_bytes_unref, NULL);
+    save->compression = NULL;
+}
+
+static void
+save_data_clear (SaveData *save)
+{
+    g_clear_pointer (&save->areas, g_array_unref);
+    g_clear_pointer (&save->data_blocks, g_ptr_array_unref);
+    g_clear_pointer (&save->data_block_ids, g_hash_table_unref);
+    g_clear_pointer (&save->compression, g_free);
+}
+
+static guint
+get_n_save_areas (PvMap    *self,
+                  SaveData *save)
+{
+    return self->areas->len + save->areas->len;
+}
+
+static Area *
+get_save_area (PvMap    *self,
+               SaveData *save,
+               guint     index)
+{
+    if (index < self->areas->len)
+        return get_area (self, index);
+    return &g_array_index (save->areas, Area, index - self->areas->len);
+}
+
+static guint
+get_n_save_data_blocks (PvMap    *self,
+                        SaveData *save)
+{
+    return self->data_blocks->len + save->data_blocks->len;
+}
+
+/* Convert the map model into the JSON for block 0 */
+static JsonObject *
+generate_header (PvMap    *self,
+                 SaveData *save)
+{
+    JsonObject *root = json_object_new ();
+
+    if (self->name != NULL)
+        json_object_set_string_member (root, "name", self->name);
+    if (self->description != NULL)
+        json_object_set_string_member (root, "description", self->description);
+    if (self->author != NULL)
+        json_object_set_string_member (root, "author", self->author);
+    if (self->author_email != NULL)
+        json_object_set_string_member (root, "author_email", self->author_email);
+    json_object_set_int_member (root, "width", self->width);
+    json_object_set_int_member (root, "height", self->height);
+    json_object_set_int_member (root, "depth", self->depth);
+
+    if (self->blocks->len > 0 && !self->binary_header) {
+        JsonArray *blocks = json_array_new ();
+        for (guint i = 0; i < self->blocks->len; i++) {
+            BlockType *block = &g_array_index (self->blocks, BlockType, i);
+            JsonObject *object = json_object_new ();
+            if (block->name != NULL)
+                json_object_set_string_member (object, "name", block->name);
+            g_autofree gchar *color = g_strdup_printf ("#%02x%02x%02x", block->red, block->green, block->blue);
+            json_object_set_string_member (object, "color", color);
+            json_array_add_object_element (blocks, object);
+        }
+        json_object_set_array_member (root, "blocks", blocks);
+    }
+
+    guint n_areas = get_n_save_areas (self, save);
+    if (n_areas > 0) {
+        JsonArray *areas = json_array_new ();
+        for (guint i = 0; i < n_areas; i++) {
+            Area *area = get_save_area (self, save, i);
+            if (area->object != NULL) {
+                json_array_add_object_element (areas, json_object_ref (area->object));
+                continue;
+            }
+            if (self->binary_header)
+                continue;
+
+            JsonObject *object = json_object_new ();
+            json_object_set_string_member (object, "type", area_type_to_string (area->type));
+            json_object_set_int_member (object, "x", area->x);
+            json_object_set_int_member (object, "y", area->y);
+            json_object_set_int_member (object, "z", area->z);
+            json_object_set_int_member (object, "width", area->width);
+            json_object_set_int_member (object, "height", area->height);
+            json_object_set_int_member (object, "depth", area->depth);
+            if (area->type == AREA_TYPE_FILL)
+                json_object_set_int_member (object, "block", area->block);
+            if (area->data >= 0) {
+                json_object_set_int_member (object, "data", area->data);
+                json_object_set_string_member (object, "compression", compression_to_string (save->compression[area->data]));
+            }
+            json_array_add_object_element (areas, object);
+        }
+        if (json_array_get_length (areas) > 0)
+            json_object_set_array_member (root, "areas", areas);
+        else
+            json_array_unref (areas);
+    }
+
+    /* The binary header and data table are written after the other data blocks */
+    guint64 n_data_blocks = get_n_save_data_blocks (self, save);
+    if (self->binary_header) {
+        json_object_set_int_member (root, "binary_header", n_data_blocks);
+        n_data_blocks++;
+    }
+    if (n_data_blocks > 0)
+        json_object_set_int_member (root, "data_table", n_data_blocks);
+
+    GList *members = json_object_get_members (self->root);
+    for (GList *link = members; link != NULL; link = link->next) {
+        const gchar *member_name = link->data;
+        if (!json_object_has_member (root, member_name))
+            json_object_set_member (root, member_name, json_node_copy (json_object_get_member (self->root, member_name)));
+    }
+    g_list_free (members);
+
+    return root;
+}
+
+#define BINARY_HEADER_VERSION 1
+
+/* Convert a binary header containing block types and areas into the map model.
+ * Areas of unknown type are stored in the JSON and referenced by index */
+/* Read a block type as written by append_block_types() */
+static gboolean
+read_block_type (const guint8 *data,
+                 gsize         length,
+                 gsize        *offset,
+                 BlockType    *block)
+{
+    guint64 name_length, red, green, blue;
+    if (!read_varint (data, length, offset, &name_length) || name_length > length - *offset)
+        return FALSE;
+    gsize name_offset = *offset;
+    if (name_length > 0)
+        *offset += name_length - 1;
+    if (!read_uint (data, length, offset, 1, &red) ||
+        !read_uint (data, length, offset, 1, &green) ||
+        !read_uint (data, length, offset, 1, &blue))
+        return FALSE;
+
+    block->name = name_length > 0 ? g_strndup ((const gchar *) data + name_offset, name_length - 1) : NULL;
+    block->red = red;
+    block->green = green;
+    block->blue = blue;
+    return TRUE;
+}
+
+static gboolean
+parse_binary_header (PvMap        *self,
+                     const guint8 *data,
+                     gsize         length,
+                     GError      **error)
+{
+    gsize offset = 0;
+    guint64 version, n_blocks;
+    if (!read_uint (data, length, &offset, 1, &version) || version != BINARY_HEADER_VERSION) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Unable to load Pivox map file: Unsupported binary header");
+        return FALSE;
+    }
+
+    if (!read_varint (data, length, &offset, &n_blocks))
+        goto truncated;
+    if (n_blocks > G_MAXUINT16 + 1) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Unable to load Pivox map file: Too many block types (%" G_GUINT64_FORMAT ")", n_blocks);
+        return FALSE;
+    }
+    g_array_set_size (self->blocks, 0);
+    for (guint64 i = 0; i < n_blocks; i++) {
+        BlockType block;
+        if (!read_block_type (data, length, &offset, &block))
+            goto truncated;
+        g_array_append_val (self->blocks, block);
+    }
+
+    /* Areas from the JSON are only used where the binary header references them */
+    g_autoptr(GArray) json_areas = g_steal_pointer (&self->areas);
+    self->areas = g_array_new (FALSE, TRUE, sizeof (Area));
+    g_array_set_clear_func (self->areas, (GDestroyNotify) area_clear);
+
+    guint64 n_areas;
+    if (!read_varint (data, length, &offset, &n_areas))
+        goto truncated;
+    for (guint64 i = 0; i < n_areas; i++) {
+        guint64 type;
+        if (!read_uint (data, length, &offset, 1, &type))
+            goto truncated;
+
+        if (type == AREA_TYPE_UNKNOWN) {
+            guint64 index;
+            if (!read_varint (data, length, &offset, &index))
+                goto truncated;
+            if (index >= json_areas->len) {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Unable to load Pivox map file: Area %" G_GUINT64_FORMAT " uses missing JSON area %" G_GUINT64_FORMAT, i, index);
+                return FALSE;
+            }
+            Area area = g_array_index (json_areas, Area, index);
+            if (area.object != NULL)
+                json_object_ref (area.object);
+            g_array_append_val (self->areas, area);
+            continue;
+        }
+        if (type > AREA_TYPE_RASTER16) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Unable to load Pivox map file: Area %" G_GUINT64_FORMAT " has unknown type %" G_GUINT64_FORMAT, i, type);
+            return FALSE;
+        }
+
+        Area area = { type, 0, 0, 0, 0, 0, 0, 0, -1, PV_MAP_COMPRESSION_NONE, NULL };
+        guint64 block = 0, data_index, compression = PV_MAP_COMPRESSION_NONE;
+        if (!read_varint (data, length, &offset, &area.x) ||
+            !read_varint (data, length, &offset, &area.y) ||
+            !read_varint (data, length, &offset, &area.z) ||
+            !read_varint (data, length, &offset, &area.width) ||
+            !read_varint (data, length, &offset, &area.height) ||
+            !read_varint (data, length, &offset, &area.depth) ||
+            (type == AREA_TYPE_FILL && !read_varint (data, length, &offset, &block)) ||
+            !read_varint (data, length, &offset, &data_index) ||
+            (data_index > 0 && !read_uint (data, length, &offset, 1, &compression)))
+            goto truncated;
+        if (block > G_MAXUINT16) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Unable to load Pivox map file: Area %" G_GUINT64_FORMAT " has invalid block %" G_GUINT64_FORMAT, i, block);
+            return FALSE;
+        }
+        if (data_index > G_MAXINT64 || compression > PV_MAP_COMPRESSION_LZ4) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Unable to load Pivox map file: Area %" G_GUINT64_FORMAT " has invalid data block", i);
+            return FALSE;
+        }
+        area.block = block;
+        area.data = (gint64) data_index - 1;
+        area.compression = compression;
+        g_array_append_val (self->areas, area);
+    }
+
+    return TRUE;
+
+truncated:
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Unable to load Pivox map file: Binary header is truncated");
+    return FALSE;
+}
+
+/* Write the number of block types followed by the name and color of each */
+static void
+append_block_types (GByteArray *data,
+                    GArray     *blocks)
+{
+    append_varint (data, blocks->len);
+    for (guint i = 0; i < blocks->len; i++) {
+        BlockType *block = &g_array_index (blocks, BlockType, i);
+        if (block->name != NULL) {
+            gsize name_length = strlen (block->name);
+            append_varint (data, name_length + 1);
+            g_byte_array_append (data, (const guint8 *) block->name, name_length);
+        }
+        else
+            append_varint (data, 0);
+        append_uint8 (data, block->red);
+        append_uint8 (data, block->green);
+        append_uint8 (data, block->blue);
+    }
+}
+
+/* Convert the block types and areas into a binary header, to be written after the other data blocks */
+static GBytes *
+generate_binary_header (PvMap    *self,
+                        SaveData *save)
+{
+    g_autoptr(GByteArray) data = g_byte_array_new ();
+
+    append_uint8 (data, BINARY_HEADER_VERSION);
+    append_block_types (data, self->blocks);
+
+    /* Unknown areas are in the JSON in the same order, ones without any JSON are dropped */
+    guint n_save_areas = get_n_save_areas (self, save);
+    guint n_areas = 0;
+    for (guint i = 0; i < n_save_areas; i++) {
+        Area *area = get_save_area (self, save, i);
+        if (area->type != AREA_TYPE_UNKNOWN || area->object != NULL)
+            n_areas++;
+    }
+    guint n_json_areas = 0;
+    append_varint (data, n_areas);
+    for (guint i = 0; i < n_save_areas; i++) {
+        Area *area = get_save_area (self, save, i);
+        if (area->type == AREA_TYPE_UNKNOWN && area->object == NULL)
+            continue;
+        if (area->object != NULL) {
+            append_uint8 (data, AREA_TYPE_UNKNOWN);
+            append_varint (data, n_json_areas);
+            n_json_areas++;
+            continue;
+        }
+
+        append_uint8 (data, area->type);
+        append_varint (data, area->x);
+        append_varint (data, area->y);
+        append_varint (data, area->z);
+        append_varint (data, area->width);
+        append_varint (data, area->height);
+        append_varint (data, area->depth);
+        if (area->type == AREA_TYPE_FILL)
+            append_varint (data, area->block);
+        append_varint (data, area->data + 1);
+        if (area->data >= 0)
+            append_uint8 (data, save->compression[area->data]);
+    }
+
+    return g_byte_array_free_to_bytes (g_steal_pointer (&data));
+}
+
+static void
+pv_map_dispose (GObject *object)
+{
+    PvMap *self = PV_MAP (object);
+
+    g_clear_pointer (&self->name, g_free);
+    g_clear_pointer (&self->description, g_free);
+    g_clear_pointer (&self->author, g_free);
+    g_clear_pointer (&self->author_email, g_free);
+    g_clear_pointer (&self->blocks, g_array_unref);
+    g_clear_pointer (&self->areas, g_array_unref);
+    g_clear_pointer (&self->root, json_object_unref);
+    g_clear_pointer (&self->data_blocks, g_ptr_array_unref);
+    g_clear_pointer (&self->data_block_ids, g_hash_table_unref);
+    g_clear_error (&self->read_error);
+    g_clear_pointer (&self->area_index, pv_area_index_free);
+    g_clear_pointer (&self->pending_chunks, g_ptr_array_unref);
+    g_clear_pointer (&self->chunks, g_hash_table_unref);
+    g_clear_pointer (&self->uniform_chunks, g_hash_table_unref);
+    g_clear_pointer (&self->hash_levels, g_array_unref);
+    g_clear_pointer (&self->dag, pv_voxel_dag_unref);
+    g_clear_pointer (&self->changed_regions, g_array_unref);
+    if (self->row_pool != NULL) {
+        g_thread_pool_free (self->row_pool, FALSE, TRUE);
+        self->row_pool = NULL;
+    }
+
+    G_OBJECT_CLASS (pv_map_parent_class)->dispose (object);
+}
+
+void
+pv_map_class_init (PvMapClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    object_class->dispose = pv_map_dispose;
+
+    signals[SIGNAL_CHANGED] = g_signal_new ("changed",
+                                            G_TYPE_FROM_CLASS (klass),
+                                            G_SIGNAL_RUN_LAST,
+                                            0,
+                                            NULL, NULL,
+                                            NULL,
+                                            G_TYPE_NONE,
+                                            1, G_TYPE_ARRAY);
+    signals[SIGNAL_LOAD_PROGRESS] = g_signal_new ("load-progress",
+                                                  G_TYPE_FROM_CLASS (klass),
+                                                  G_SIGNAL_RUN_LAST,
+                                                  0,
+                                                  NULL, NULL,
+                                                  NULL,
+                                                  G_TYPE_NONE,
+                                                  3, G_TYPE_UINT64, G_TYPE_UINT, G_TYPE_UINT);
+}
+
+void
+pv_map_init (PvMap *self)
+{
+    self->width = 1;
+    self->height = 1;
+    self->depth = 1;
+    self->blocks = g_array_new (FALSE, TRUE, sizeof (BlockType));
+    g_array_set_clear_func (self->blocks, (GDestroyNotify) block_type_clear);
+    self->areas = g_array_new (FALSE, TRUE, sizeof (Area));
+    g_array_set_clear_func (self->areas, (GDestroyNotify) area_clear);
+    self->root = json_object_new ();
+    self->data_blocks = g_ptr_array_new_with_free_func ((GDestroyNotify) data_block_unref);
+    self->data_block_ids = g_hash_table_new_full (data_hash, g_bytes_equal, (GDestroyNotify) g_bytes_unref, NULL);
+    self->data_table = -1;
+    self->binary_header_block = -1;
+    self->area_index = pv_area_index_new ();
+    self->chunks = g_hash_table_new_full (chunk_hash, chunk_equal, (GDestroyNotify) chunk_free, NULL);
+    self->uniform_chunks = g_hash_table_new (uniform_chunk_hash, g_direct_equal);
+    self->pending_chunks = g_ptr_array_new ();
+    self->changed_regions = g_array_new (FALSE, FALSE, sizeof (PvMapRegion));
+}
+
+PvMap *
+pv_map_new (void)
+{
+    return g_object_new (pv_map_get_type (), NULL);
+}
+
+PvMap *
+pv_map_snapshot (PvMap *self)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), NULL);
+
+    flush_pending_chunks (self);
+
+    PvMap *snapshot = pv_map_new ();
+    snapshot->read_only = TRUE;
+
+    snapshot->width = self->width;
+    snapshot->height = self->height;
+    snapshot->depth = self->depth;
+    snapshot->name = g_strdup (self->name);
+    snapshot->description = g_strdup (self->description);
+    snapshot->author = g_strdup (self->author);
+    snapshot->author_email = g_strdup (self->author_email);
+    for (guint i = 0; i < self->blocks->len; i++) {
+        BlockType block = g_array_index (self->blocks, BlockType, i);
+        block.name = g_strdup (block.name);
+        g_array_append_val (snapshot->blocks, block);
+    }
+    for (guint i = 0; i < self->areas->len; i++) {
+        Area area = *get_area (self, i);
+        if (area.object != NULL)
+            json_object_ref (area.object);
+        g_array_append_val (snapshot->areas, area);
+        index_area (snapshot, &area);
+    }
+    GList *members = json_object_get_members (self->root);
+    for (GList *link = members; link != NULL; link = link->next) {
+        const gchar *member_name = link->data;
+        json_object_set_member (snapshot->root, member_name, json_node_copy (json_object_get_member (self->root, member_name)));
+    }
+    g_list_free (members);
+    for (guint i = 0; i < self->data_blocks->len; i++)
+        g_ptr_array_add (snapshot->data_blocks, data_block_ref (g_ptr_array_index (self->data_blocks, i)));
+    GHashTableIter data_iter;
+    GBytes *data;
+    gpointer id;
+    g_hash_table_iter_init (&data_iter, self->data_block_ids);
+    while (g_hash_table_iter_next (&data_iter, (gpointer *) &data, &id))
+        g_hash_table_insert (snapshot->data_block_ids, g_bytes_ref (data), id);
+    snapshot->data_table = self->data_table;
+    snapshot->binary_header = self->binary_header;
+    snapshot->binary_header_block = self->binary_header_block;
+    snapshot->compression = self->compression;
+    snapshot->storage = self->storage;
+    snapshot->summed_volumes = self->summed_volumes;
+    if (self->dag != NULL)
+        snapshot->dag = pv_voxel_dag_ref (self->dag);
+
+    /* Share the decoded chunks, they will be copied if the map modifies them */
+    GHashTableIter iter;
+    Chunk *chunk;
+    g_hash_table_iter_init (&iter, self->chunks);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &chunk, NULL)) {
+        Chunk *c = chunk_new (chunk->x, chunk->y, chunk->z);
+        if (chunk->blocks != NULL) {
+            c->blocks = g_atomic_rc_box_acquire (chunk->blocks);
+            c->shared = TRUE;
+            chunk->shared = TRUE;
+        }
+        if (chunk->dag != NULL)
+            pv_voxel_dag_ref_node (chunk->dag, chunk->node);
+        c->dag = chunk->dag;
+        c->node = chunk->node;
+        if (chunk->packed != NULL)
+            c->packed = pv_packed_blocks_ref (chunk->packed);
+        c->edited = chunk->edited;
+        c->hash = chunk->hash;
+        c->hash_valid = chunk->hash_valid;
+        memcpy (c->brick_occupancy, chunk->brick_occupancy, sizeof (chunk->brick_occupancy));
+        if (chunk->occupancy != NULL)
+            c->occupancy = g_memdup2 (chunk->occupancy, sizeof (guint32) * CHUNK_SIZE * CHUNK_SIZE);
+        if (chunk->sums != NULL)
+            c->sums = g_atomic_rc_box_acquire (chunk->sums);
+        g_hash_table_add (snapshot->chunks, c);
+    }
+    gpointer key, value;
+    g_hash_table_iter_init (&iter, self->uniform_chunks);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        g_hash_table_insert (snapshot->uniform_chunks, key, value);
+
+    if (self->hash_levels != NULL) {
+        snapshot->hash_levels = g_array_new (FALSE, FALSE, sizeof (HashLevel));
+        g_array_set_clear_func (snapshot->hash_levels, (GDestroyNotify) hash_level_clear);
+        for (guint i = 0; i < self->hash_levels->len; i++) {
+            HashLevel level = g_array_index (self->hash_levels, HashLevel, i);
+            gsize n_nodes = level.width * level.height * level.depth;
+            level.hashes = g_memdup2 (level.hashes, sizeof (guint64) * n_nodes);
+            level.valid = g_memdup2 (level.valid, sizeof (gboolean) * n_nodes);
+            g_array_append_val (snapshot->hash_levels, level);
+        }
+    }
+
+    return snapshot;
+}
+
+static GBytes *
+read_data_block (GInputStream *stream,
+                 goffset       offset,
+                 GError      **error)
+{
+    guint32 block_length;
+    if (!g_seekable_seek (G_SEEKABLE (stream), offset, G_SEEK_SET, NULL, error) ||
+        !read_uint32 (stream, &block_length, NULL, error))
+        return NULL;
+
+    g_autofree guint8 *block = g_try_malloc (block_length);
+    if (block == NULL && block_length > 0) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Not able to allocate %u octets", block_length);
+        return NULL;
+    }
+
+    gsize n_read;
+    if (!g_input_stream_read_all (stream, block, block_length, &n_read, NULL, error))
+        return NULL;
+    if (n_read != block_length) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough data");
+        return NULL;
+    }
+
+    return g_bytes_new_take (g_steal_pointer (&block), block_length);
+}
+
+G_LOCK_DEFINE_STATIC (data_block_stream);
+
+/* Get a data block, reading it from the stream if this is the first use.
+ * Returns NULL if it can't be read, and keeps the first failure in read_error */
+static DataBlock *
+get_data_block (PvMap   *self,
+                guint    index,
+                GError **error)
+{
+    DataBlock *block = g_ptr_array_index (self->data_blocks, index);
+    if (g_atomic_pointer_get (&block->data) != NULL)
+        return block;
+
+    /* Streams may be shared between maps and snapshots */
+    G_LOCK (data_block_stream);
+    if (block->data == NULL) {
+        g_autoptr(GError) read_error = NULL;
+        GBytes *data = read_data_block (block->stream, block->offset, &read_error);
+        if (data == NULL) {
+            if (self->read_error == NULL)
+                self->read_error = g_error_new (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                                "Unable to read data block %u: %s", index, read_error->message);
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Unable to read data block %u: %s", index, read_error->message);
+            block = NULL;
+        }
+        else {
+            g_atomic_pointer_set (&block->data, data);
+            g_clear_object (&block->stream);
+        }
+    }
+    G_UNLOCK (data_block_stream);
+
+    return block;
+}
+
+static void
+clear_data (PvMap *self)
+{
+    g_ptr_array_set_size (self->data_blocks, 0);
+    g_hash_table_remove_all (self->data_block_ids);
+    pv_area_index_clear (self->area_index);
+    g_ptr_array_set_size (self->pending_chunks, 0);
+    g_hash_table_remove_all (self->chunks);
+    g_hash_table_remove_all (self->uniform_chunks);
+    g_clear_pointer (&self->hash_levels, g_array_unref);
+    g_clear_error (&self->read_error);
+}
+
+static gboolean
+load_header (PvMap        *self,
+             const guint8 *data,
+             gsize         length,
+             GError      **error)
+{
+    g_autoptr(JsonParser) parser = json_parser_new ();
+    g_autoptr(GError) local_error = NULL;
+    if (!json_parser_load_from_data (parser, (const gchar *) data, length, &local_error)) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Unable to load Pivox map file: Block 0 does not contain valid JSON data: %s", local_error->message);
+        return FALSE;
+    }
+    g_autoptr(JsonNode) root = json_parser_steal_root (parser);
+    if (!JSON_NODE_HOLDS_OBJECT (root)) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Unable to load Pivox map file: Block 0 does not contain a JSON object");
+        return FALSE;
+    }
+
+    return parse_header (self, json_node_get_object (root), error);
+}
+
+/* Replace the block types and areas with the ones from the binary header data block */
+static gboolean
+load_binary_header (PvMap   *self,
+                    GError **error)
+{
+    if (self->binary_header_block < 0)
+        return TRUE;
+
+    if (self->binary_header_block >= self->data_blocks->len) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Unable to load Pivox map file: Missing binary header block %" G_GINT64_FORMAT, self->binary_header_block);
+        return FALSE;
+    }
+
+    DataBlock *block = get_data_block (self, self->binary_header_block, error);
+    if (block == NULL)
+        return FALSE;
+    gsize length;
+    const guint8 *data = g_bytes_get_data (block->data, &length);
+    if (!parse_binary_header (self, data, length, error))
+        return FALSE;
+
+    /* The header is written after the blocks that areas use, so can be dropped without changing their indexes */
+    if (self->binary_header_block == self->data_blocks->len - 1)
+        g_ptr_array_set_size (self->data_blocks, self->binary_header_block);
+    self->binary_header_block = -1;
+
+    return TRUE;
+}
+
+/* Check the areas match the loaded data blocks and index them */
+static gboolean
+link_areas (PvMap   *self,
+            int      block_count,
+            GError **error)
+{
+    if (block_count == 0) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Unable to load Pivox map file: Contains no data blocks");
+        return FALSE;
+    }
+
+    /* Data blocks are encoded with the compression of the areas that use them */
+    g_autofree gboolean *have_compression = g_new0 (gboolean, self->data_blocks->len);
+    for (guint i = 0; i < self->areas->len; i++) {
+        Area *area = get_area (self, i);
+        if (area->data >= (gint64) self->data_blocks->len) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Unable to load Pivox map file: Area %u uses missing data block %" G_GINT64_FORMAT, i, area->data);
+            return FALSE;
+        }
+        if (area->data >= 0 && area->object == NULL) {
+            DataBlock *data_block = g_ptr_array_index (self->data_blocks, area->data);
+            if (!have_compression[area->data]) {
+                data_block->compression = area->compression;
+                have_compression[area->data] = TRUE;
+            }
+            else if (data_block->compression != area->compression) {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Unable to load Pivox map file: Area %u uses data block %" G_GINT64_FORMAT " with different compression", i, area->data);
+                return FALSE;
+            }
+        }
+        index_area (self, area);
+    }
+
+    return TRUE;
+}
+
+/* Read the data table at the end of the stream and set up the data blocks to be read from it */
+static gboolean
+load_data_table (PvMap        *self,
+                 GInputStream *stream,
+                 goffset       start,
+                 GCancellable *cancellable)
+{
+    if (self->data_table <= 0 || self->data_table > G_MAXUINT32 / 8 ||
+        !G_IS_SEEKABLE (stream) || !g_seekable_can_seek (G_SEEKABLE (stream)))
+        return FALSE;
+
+    /* Table is the last block before the terminator */
+    goffset position = g_seekable_tell (G_SEEKABLE (stream));
+    guint32 table_length = self->data_table * 8;
+    g_autofree guint8 *table = g_try_malloc (table_length);
+    guint32 length, terminator;
+    gsize n_read;
+    if (table == NULL ||
+        !g_seekable_seek (G_SEEKABLE (stream), -(goffset) (table_length + 8), G_SEEK_END, cancellable, NULL) ||
+        !read_uint32 (stream, &length, cancellable, NULL) ||
+        length != table_length ||
+        !g_input_stream_read_all (stream, table, table_length, &n_read, cancellable, NULL) ||
+        n_read != table_length ||
+        !read_uint32 (stream, &terminator, cancellable, NULL) ||
+        terminator != 0) {
+        /* Fall back to reading all the blocks */
+        if (!g_seekable_seek (G_SEEKABLE (stream), position, G_SEEK_SET, cancellable, NULL))
+            g_warning ("Failed to return to data blocks after reading data table");
+        return FALSE;
+    }
+
+    for (gint64 i = 0; i < self->data_table; i++) {
+        guint64 offset = 0;
+        for (int j = 0; j < 8; j++)
+            offset |= (guint64) table[i * 8 + j] << (j * 8);
+        DataBlock *block = data_block_new (NULL, PV_MAP_COMPRESSION_NONE);
+        block->stream = g_object_ref (stream);
+        block->offset = start + offset;
+        g_ptr_array_add (self->data_blocks, block);
+    }
+
+    return TRUE;
+}
+
+static void
+load_data_free (LoadData *data)
+{
+    g_clear_object (&data->stream);
+    g_clear_pointer (&data->bytes, g_bytes_unref);
+    g_mutex_clear (&data->mutex);
+    g_free (data);
+}
+
+static gboolean
+emit_load_progress (GTask *task)
+{
+    PvMap *self = g_task_get_source_object (task);
+    LoadData *data = g_task_get_task_data (task);
+
+    g_mutex_lock (&data->mutex);
+    guint64 n_bytes = data->n_bytes;
+    guint n_areas = data->n_areas;
+    guint n_areas_total = data->n_areas_total;
+    data->report_pending = FALSE;
+    g_mutex_unlock (&data->mutex);
+
+    g_signal_emit (self, signals[SIGNAL_LOAD_PROGRESS], 0, n_bytes, n_areas, n_areas_total);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Record load progress from the worker thread, to be emitted in the task context */
+static void
+load_data_report (LoadData *data,
+                  guint64   n_bytes,
+                  guint     n_areas,
+                  guint     n_areas_total)
+{
+    if (data == NULL)
+        return;
+
+    g_mutex_lock (&data->mutex);
+    data->n_bytes = n_bytes;
+    data->n_areas = n_areas;
+    data->n_areas_total = n_areas_total;
+    gboolean schedule = !data->report_pending;
+    data->report_pending = TRUE;
+    g_mutex_unlock (&data->mutex);
+
+    if (schedule)
+        g_main_context_invoke_full (g_task_get_context (data->task), G_PRIORITY_DEFAULT,
+                                    (GSourceFunc) emit_load_progress, g_object_ref (data->task), g_object_unref);
+}
+
+static gboolean
+load_stream (PvMap        *self,
+             GInputStream *stream,
+             LoadData     *load,
+             GCancellable *cancellable,
+             GError      **error)
+{
+    /* Buffer the stream so the block lengths don't need a read each.
+     * Only seekable streams are buffered, so the data read past the end of the map can be returned */
+    g_autoptr(GInputStream) buffered_stream = NULL;
+    if (G_IS_BUFFERED_INPUT_STREAM (stream) || !G_IS_SEEKABLE (stream) || !g_seekable_can_seek (G_SEEKABLE (stream)))
+        buffered_stream = g_object_ref (stream);
+    else {
+        buffered_stream = g_buffered_input_stream_new (stream);
+        g_filter_input_stream_set_close_base_stream (G_FILTER_INPUT_STREAM (buffered_stream), FALSE);
+    }
+
+    goffset start = G_IS_SEEKABLE (buffered_stream) ? g_seekable_tell (G_SEEKABLE (buffered_stream)) : 0;
+    guint32 id;
+    if (!read_uint32 (buffered_stream, &id, cancellable, NULL) ||
+        id != id_to_uint ("PiVx")) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Not a Pivox map file");
+        return FALSE;
+    }
+
+    clear_data (self);
+
+    guint64 n_bytes = 4;
+    int block_count = 0;
+    while (TRUE) {
+        guint32 block_length;
+        if (!read_uint32 (buffered_stream, &block_length, cancellable, error))
+            return FALSE;
+        n_bytes += 4 + block_length;
+
+        /* Terminate on zero length block */
+        if (block_length == 0)
+            break;
+
+        g_autofree guint8 *block = g_try_malloc (block_length);
+        if (block == NULL) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Unable to load Pivox map file: Not able to allocate %u octets for block %d", block_length, block_count);
+            return FALSE;
+        }
+
+        gsize n_read;
+        g_autoptr(GError) local_error = NULL;
+        if (!g_input_stream_read_all (buffered_stream, block, block_length, &n_read, cancellable, &local_error)) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Unable to load Pivox map file: Failed to read block %d: %s", block_count, local_error->message);
+            return FALSE;
+        }
+        if (n_read != block_length) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Unable to load Pivox map file: Not enough space for block %d", block_count);
+            return FALSE;
+        }
+
+        load_data_report (load, n_bytes, 0, 0);
+
+        if (block_count == 0) {
+            if (!load_header (self, block, block_length, error))
+                return FALSE;
+
+            /* Read the other blocks when they are needed.
+             * The block count includes the binary header, which is dropped once loaded */
+            if (load_data_table (self, buffered_stream, start, cancellable)) {
+                int n_blocks = 1 + self->data_blocks->len;
+                return load_binary_header (self, error) && link_areas (self, n_blocks, error);
+            }
+        }
+        else if (block_count - 1 != self->data_table) {
+            g_ptr_array_add (self->data_blocks, data_block_new (g_bytes_new_take (g_steal_pointer (&block), block_length), PV_MAP_COMPRESSION_NONE));
+        }
+
+        block_count++;
+    }
+
+    /* Leave the stream positioned after the terminator */
+    if (buffered_stream != stream &&
+        !g_seekable_seek (G_SEEKABLE (stream), start + n_bytes, G_SEEK_SET, cancellable, error))
+        return FALSE;
+
+    return load_binary_header (self, error) && link_areas (self, block_count, error);
+}
+
+gboolean
+pv_map_load (PvMap        *self,
+             GInputStream *stream,
+             GCancellable *cancellable,
+             GError      **error)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), FALSE);
+    g_return_val_if_fail (!self->read_only, FALSE);
+
+    return load_stream (self, stream, NULL, cancellable, error);
+}
+
+gboolean
+pv_map_load_bytes (PvMap   *self,
+                   GBytes  *bytes,
+                   GError **error)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), FALSE);
+    g_return_val_if_fail (!self->read_only, FALSE);
+
+    gsize length;
+    const guint8 *data = g_bytes_get_data (bytes, &length);
+    if (length < 4 || (data[3] << 24 | data[2] << 16 | data[1] << 8 | data[0]) != id_to_uint ("PiVx")) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Not a Pivox map file");
+        return FALSE;
+    }
+
+    clear_data (self);
+
+    /* Data blocks reference the original data rather than being copied */
+    gsize offset = 4;
+    int block_count = 0;
+    while (TRUE) {
+        if (length - offset < 4) {
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough data");
+            return FALSE;
+        }
+        const guint8 *header = data + offset;
+        guint32 block_length = header[3] << 24 | header[2] << 16 | header[1] << 8 | header[0];
+        offset += 4;
+
+        /* Terminate on zero length block */
+        if (block_length == 0)
+            break;
+
+        if (length - offset < block_length) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Unable to load Pivox map file: Not enough space for block %d", block_count);
+            return FALSE;
+        }
+
+        if (block_count == 0) {
+            if (!load_header (self, data + offset, block_length, error))
+                return FALSE;
+        }
+        else if (block_count - 1 != self->data_table) {
+            g_ptr_array_add (self->data_blocks, data_block_new (g_bytes_new_from_bytes (bytes, offset, block_length), PV_MAP_COMPRESSION_NONE));
+        }
+        offset += block_length;
+
+        block_count++;
+    }
+
+    return load_binary_header (self, error) && link_areas (self, block_count, error);
+}
+
+gboolean
+pv_map_load_file (PvMap       *self,
+                  const gchar *filename,
+                  GError     **error)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), FALSE);
+    g_return_val_if_fail (!self->read_only, FALSE);
+
+    g_autoptr(GMappedFile) file = g_mapped_file_new (filename, FALSE, error);
+    if (file == NULL)
+        return FALSE;
+    g_autoptr(GBytes) bytes = g_mapped_file_get_bytes (file);
+
+    return pv_map_load_bytes (self, bytes, error);
+}
+
+/* Get the first failure to read a data block that was left in the stream when loading, or NULL */
+const GError *
+pv_map_get_read_error (PvMap *self)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), NULL);
+    return self->read_error;
+}
+
+static DataBlock *
+get_save_data_block (PvMap    *self,
+                     SaveData *save,
+                     guint     index,
+                     GError  **error)
+{
+    if (index < self->data_blocks->len)
+        return get_data_block (self, index, error);
+    return g_ptr_array_index (save->data_blocks, index - self->data_blocks->len);
+}
+
+/* Add a data block to be saved, reusing any identical block, returns the index of the block */
+static gint64
+add_save_data_block (PvMap    *self,
+                     SaveData *save,
+                     GBytes   *data)
+{
+    gpointer id;
+    if (g_hash_table_lookup_extended (self->data_block_ids, data, NULL, &id) ||
+        g_hash_table_lookup_extended (save->data_block_ids, data, NULL, &id)) {
+        g_bytes_unref (data);
+        return GPOINTER_TO_UINT (id);
+    }
+
+    guint index = get_n_save_data_blocks (self, save);
+    g_ptr_array_add (save->data_blocks, data_block_new (data, PV_MAP_COMPRESSION_NONE));
+    g_hash_table_insert (save->data_block_ids, g_bytes_ref (data), GUINT_TO_POINTER (index));
+
+    return index;
+}
+
+/* Make an area containing the contents of a chunk, returns the data for it or NULL for a fill area */
+static GBytes *
+encode_chunk (PvMap    *self,
+              Chunk    *chunk,
+              guint16  *buffer,
+              Area     *area)
+{
+    Area a = { AREA_TYPE_FILL,
+               chunk->x * CHUNK_SIZE, chunk->y * CHUNK_SIZE, chunk->z * CHUNK_SIZE,
+               CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE,
+               0, -1, self->compression, NULL };
+    *area = a;
+
+    const guint16 *chunk_blocks = chunk_get_blocks (chunk, buffer, &area->block);
+    if (chunk_blocks == NULL)
+        return NULL;
+
+    gboolean is_raster8 = TRUE;
+    for (gsize i = 0; i < CHUNK_VOXELS && is_raster8; i++)
+        if (chunk_blocks[i] > G_MAXUINT8)
+            is_raster8 = FALSE;
+
+    if (is_raster8) {
+        guint8 *blocks = g_malloc (CHUNK_VOXELS);
+        for (gsize i = 0; i < CHUNK_VOXELS; i++)
+            blocks[i] = chunk_blocks[i];
+        area->type = AREA_TYPE_RASTER8;
+        return g_bytes_new_take (blocks, CHUNK_VOXELS);
+    }
+    else {
+        area->type = AREA_TYPE_RASTER16;
+        return encode_raster16 (chunk_blocks, CHUNK_VOXELS);
+    }
+}
+
+/* Add areas containing the contents of edited chunks to save.
+ * The edits stay in the chunks rather than being added to the map, so saving again writes one area per chunk */
+static void
+store_edits (PvMap    *self,
+             SaveData *save)
+{
+    g_autofree guint16 *buffer = chunk_buffer_new (self);
+    GHashTableIter iter;
+    Chunk *chunk;
+    g_hash_table_iter_init (&iter, self->chunks);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &chunk, NULL)) {
+        if (!chunk->edited)
+            continue;
+
+        Area area;
+        GBytes *data = encode_chunk (self, chunk, buffer, &area);
+        if (data != NULL)
+            area.data = add_save_data_block (self, save, data);
+        g_array_append_val (save->areas, area);
+    }
+
+    gpointer key, value;
+    g_hash_table_iter_init (&iter, self->uniform_chunks);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if ((GPOINTER_TO_UINT (value) & UNIFORM_CHUNK_EDITED) == 0)
+            continue;
+
+        Chunk uniform;
+        chunk_init_uniform (&uniform, key, GPOINTER_TO_UINT (value));
+        Area area;
+        encode_chunk (self, &uniform, buffer, &area);
+        g_array_append_val (save->areas, area);
+    }
+}
+
+static void
+encode_job_run (EncodeJob     *job,
+                EncodeContext *context)
+{
+    GBytes *data = NULL;
+    GError *error = NULL;
+    if (!g_cancellable_is_cancelled (context->cancellable)) {
+        DataBlock *block = get_save_data_block (context->map, context->save, job->index, &error);
+        if (block != NULL)
+            data = encode_data_block (block, job->compression);
+    }
+
+    g_mutex_lock (&context->mutex);
+    job->data = data;
+    job->error = error;
+    job->complete = TRUE;
+    g_cond_broadcast (&context->cond);
+    g_mutex_unlock (&context->mutex);
+}
+
+/* Compress the data blocks in parallel and write them out in order */
+static gboolean
+write_data_blocks (PvMap            *self,
+                   SaveData         *save,
+                   GOutputStream    *stream,
+                   guint64          *offset,
+                   guint8           *data_table,
+                   GCancellable     *cancellable,
+                   GError          **error)
+{
+    guint n_blocks = get_n_save_data_blocks (self, save);
+    if (n_blocks == 0)
+        return TRUE;
+
+    EncodeContext context;
+    context.map = self;
+    context.save = save;
+    context.cancellable = cancellable;
+    g_mutex_init (&context.mutex);
+    g_cond_init (&context.cond);
+
+    /* Limit the number of blocks in memory at once */
+    guint n_threads = MAX (g_get_num_processors (), 1);
+    guint max_in_flight = n_threads * 2;
+
+    g_autofree EncodeJob *jobs = g_new0 (EncodeJob, n_blocks);
+    GThreadPool *pool = g_thread_pool_new ((GFunc) encode_job_run, &context, n_threads, FALSE, NULL);
+
+    gboolean result = TRUE;
+    guint n_pushed = 0;
+    for (guint i = 0; i < n_blocks && result; i++) {
+        for (; n_pushed < n_blocks && n_pushed < i + max_in_flight; n_pushed++) {
+            jobs[n_pushed].index = n_pushed;
+            jobs[n_pushed].compression = save->compression[n_pushed];
+            g_thread_pool_push (pool, &jobs[n_pushed], NULL);
+        }
+
+        g_mutex_lock (&context.mutex);
+        while (!jobs[i].complete)
+            g_cond_wait (&context.cond, &context.mutex);
+        g_mutex_unlock (&context.mutex);
+
+        if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
+            result = FALSE;
+            break;
+        }
+
+        if (jobs[i].error != NULL) {
+            g_propagate_prefixed_error (error, g_steal_pointer (&jobs[i].error), "Unable to save Pivox map file: ");
+            result = FALSE;
+            break;
+        }
+        if (jobs[i].data == NULL) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Unable to save Pivox map file: Failed to compress data block %u", i);
+            result = FALSE;
+            break;
+        }
+
+        gsize data_length;
+        gconstpointer data = g_bytes_get_data (jobs[i].data, &data_length);
+        if (!write_uint32 (stream, data_length, cancellable, error) ||
+            !g_output_stream_write_all (stream, data, data_length, NULL, cancellable, error))
+            result = FALSE;
+        g_clear_pointer (&jobs[i].data, g_bytes_unref);
+
+        for (int j = 0; j < 8; j++)
+            data_table[i * 8 + j] = (*offset >> (j * 8)) & 0xFF;
+        *offset += 4 + data_length;
+    }
+
+    /* Wait for running jobs, and drop any that haven't started */
+    g_thread_pool_free (pool, TRUE, TRUE);
+    for (guint i = 0; i < n_blocks; i++) {
+        g_clear_pointer (&jobs[i].data, g_bytes_unref);
+        g_clear_error (&jobs[i].error);
+    }
+    g_mutex_clear (&context.mutex);
+    g_cond_clear (&context.cond);
+
+    return result;
+}
+
+static gboolean
+write_map (PvMap         *self,
+           SaveData      *save,
+           GOutputStream *stream,
+           GCancellable  *cancellable,
+           GError       **error)
+{
+    if (!g_output_stream_write_all (stream, "PiVx", 4, NULL, cancellable, error))
+        return FALSE;
+
+    store_edits (self, save);
+
+    /* Work out the compression for each data block from the first area that uses it.
+     * Areas sharing a block are written with this compression */
+    guint n_blocks = get_n_save_data_blocks (self, save);
+    save->compression = g_new (PvMapCompression, MAX (n_blocks, 1));
+    for (guint i = 0; i < n_blocks; i++)
+        save->compression[i] = i < self->data_blocks->len ? ((DataBlock *) g_ptr_array_index (self->data_blocks, i))->compression : PV_MAP_COMPRESSION_NONE;
+    for (guint i = get_n_save_areas (self, save); i > 0; i--) {
+        Area *area = get_save_area (self, save, i - 1);
+        if (area->data >= 0 && area->object == NULL)
+            save->compression[area->data] = area->compression;
+    }
+
+    g_autoptr(JsonGenerator) generator = json_generator_new ();
+    g_autoptr(JsonObject) root = generate_header (self, save);
+    g_autoptr(JsonNode) node = json_node_new (JSON_NODE_OBJECT);
+    json_node_set_object (node, root);
+    json_generator_set_root (generator, node);
+    json_generator_set_pretty (generator, TRUE);
+    gsize json_data_length;
+    g_autofree gchar *json_data = json_generator_to_data (generator, &json_data_length);
+
+    if (!write_uint32 (stream, json_data_length, cancellable, error) ||
+        !g_output_stream_write_all (stream, json_data, json_data_length, NULL, cancellable, error))
+        return FALSE;
+
+    /* Record where each data block is written for the data table */
+    guint n_data_blocks = n_blocks + (self->binary_header ? 1 : 0);
+    g_autofree guint8 *data_table = g_malloc (n_data_blocks * 8 + 1);
+    guint64 offset = 4 + 4 + json_data_length;
+    if (!write_data_blocks (self, save, stream, &offset, data_table, cancellable, error))
+        return FALSE;
+
+    if (self->binary_header) {
+        g_autoptr(GBytes) header = generate_binary_header (self, save);
+        gsize header_length;
+        gconstpointer header_data = g_bytes_get_data (header, &header_length);
+        if (!write_uint32 (stream, header_length, cancellable, error) ||
+            !g_output_stream_write_all (stream, header_data, header_length, NULL, cancellable, error))
+            return FALSE;
+        for (int j = 0; j < 8; j++)
+            data_table[n_blocks * 8 + j] = (offset >> (j * 8)) & 0xFF;
+    }
+
+    if (n_data_blocks > 0) {
+        if (!write_uint32 (stream, n_data_blocks * 8, cancellable, error) ||
+            !g_output_stream_write_all (stream, data_table, n_data_blocks * 8, NULL, cancellable, error))
+            return FALSE;
+    }
+
+    if (!write_uint32 (stream, 0, cancellable, error))
+        return FALSE;
+
+    return TRUE;
+}
+
+gboolean
+pv_map_save (PvMap         *self,
+             GOutputStream *stream,
+             GCancellable  *cancellable,
+             GError       **error)
+{
+    flush_pending_chunks (self);
+
+    SaveData save;
+    save_data_init (&save);
+    gboolean result = write_map (self, &save, stream, cancellable, error);
+    save_data_clear (&save);
+
+    return result;
+}
+
+static void
+save_async_data_free (SaveAsyncData *data)
+{
+    g_clear_object (&data->snapshot);
+    g_clear_object (&data->stream);
+    g_free (data);
+}
+
+static void
+save_thread (GTask         *task,
+             PvMap         *self,
+             SaveAsyncData *data,
+             GCancellable  *cancellable)
+{
+    if (g_task_return_error_if_cancelled (task))
+        return;
+
+    g_autoptr(GError) error = NULL;
+    if (!pv_map_save (data->snapshot, data->stream, cancellable, &error)) {
+        g_task_return_error (task, g_steal_pointer (&error));
+        return;
+    }
+
+    g_task_return_boolean (task, TRUE);
+}
+
+/* Save the map as it is now on a worker thread, the map can keep being modified while this runs */
+void
+pv_map_save_async (PvMap               *self,
+                   GOutputStream       *stream,
+                   GCancellable        *cancellable,
+                   GAsyncReadyCallback  callback,
+                   gpointer             user_data)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+
+    g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
+    g_task_set_source_tag (task, pv_map_save_async);
+
+    SaveAsyncData *data = g_new0 (SaveAsyncData, 1);
+    data->snapshot = pv_map_snapshot (self);
+    data->stream = g_object_ref (stream);
+    g_task_set_task_data (task, data, (GDestroyNotify) save_async_data_free);
+
+    g_task_run_in_thread (task, (GTaskThreadFunc) save_thread);
+}
+
+gboolean
+pv_map_save_finish (PvMap         *self,
+                    GAsyncResult  *result,
+                    GError       **error)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), FALSE);
+    g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+void
+pv_map_set_width (PvMap  *self,
+                  guint64 width)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+    self->width = width;
+    g_clear_pointer (&self->hash_levels, g_array_unref);
+}
+
+guint64
+pv_map_get_width (PvMap *self)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), 0);
+    return self->width;
+}
+
+void
+pv_map_set_height (PvMap   *self,
+                   guint64  height)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+    self->height = height;
+    g_clear_pointer (&self->hash_levels, g_array_unref);
+}
+
+guint64
+pv_map_get_height (PvMap *self)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), 0);
+    return self->height;
+}
+
+void
+pv_map_set_depth (PvMap  *self,
+                  guint64 depth)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+    self->depth = depth;
+    g_clear_pointer (&self->hash_levels, g_array_unref);
+}
+
+guint64
+pv_map_get_depth (PvMap *self)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), 0);
+    return self->depth;
+}
+
+void
+pv_map_set_name (PvMap       *self,
+                 const gchar *name)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+    g_free (self->name);
+    self->name = g_strdup (name);
+}
+
+const gchar *
+pv_map_get_name (PvMap *self)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), NULL);
+    return self->name;
+}
+
+void
+pv_map_set_description (PvMap       *self,
+                        const gchar *description)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+    g_free (self->description);
+    self->description = g_strdup (description);
+}
+
+const gchar *
+pv_map_get_description (PvMap *self)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), NULL);
+    return self->description;
+}
+
+void
+pv_map_set_author (PvMap       *self,
+                   const gchar *author)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+    g_free (self->author);
+    self->author = g_strdup (author);
+}
+
+const gchar *
+pv_map_get_author (PvMap *self)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), NULL);
+    return self->author;
+}
+
+void
+pv_map_set_author_email (PvMap       *self,
+                         const gchar *author_email)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+    g_free (self->author_email);
+    self->author_email = g_strdup (author_email);
+}
+
+const gchar *
+pv_map_get_author_email (PvMap *self)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), NULL);
+    return self->author_email;
+}
+
+void
+pv_map_set_compression (PvMap           *self,
+                        PvMapCompression compression)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+    self->compression = compression;
+}
+
+PvMapCompression
+pv_map_get_compression (PvMap *self)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), PV_MAP_COMPRESSION_NONE);
+    return self->compression;
+}
+
+void
+pv_map_set_binary_header (PvMap    *self,
+                          gboolean  enabled)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+    self->binary_header = enabled;
+}
+
+gboolean
+pv_map_get_binary_header (PvMap *self)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), FALSE);
+    return self->binary_header;
+}
+
+void
+pv_map_set_storage (PvMap        *self,
+                    PvMapStorage  storage)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+
+    if (self->storage == storage)
+        return;
+    flush_pending_chunks (self);
+    self->storage = storage;
+
+    if (storage == PV_MAP_STORAGE_DAG && self->dag == NULL)
+        self->dag = pv_voxel_dag_new (CHUNK_SHIFT);
+
+    /* Convert existing chunks */
+    GHashTableIter iter;
+    Chunk *chunk;
+    g_hash_table_iter_init (&iter, self->chunks);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &chunk, NULL)) {
+        if (chunk->dag != NULL || chunk->packed != NULL)
+            chunk_get_writable_blocks (chunk);
+        chunk_compact (self, chunk);
+
+        guint value = chunk_get_uniform_value (chunk);
+        if (value != 0) {
+            gpointer key;
+            get_uniform_chunk_key (chunk->x, chunk->y, chunk->z, &key);
+            g_hash_table_insert (self->uniform_chunks, key, GUINT_TO_POINTER (value));
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+}
+
+PvMapStorage
+pv_map_get_storage (PvMap *self)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), PV_MAP_STORAGE_DENSE);
+    return self->storage;
+}
+
+void
+pv_map_set_summed_volumes (PvMap    *self,
+                           gboolean  enabled)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+
+    if (self->summed_volumes == enabled)
+        return;
+    self->summed_volumes = enabled;
+
+    g_autofree guint16 *buffer = NULL;
+    GHashTableIter iter;
+    Chunk *chunk;
+    g_hash_table_iter_init (&iter, self->chunks);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &chunk, NULL)) {
+        if (!enabled || chunk_is_uniform (chunk)) {
+            g_clear_pointer (&chunk->sums, g_atomic_rc_box_release);
+            continue;
+        }
+
+        if (buffer == NULL)
+            buffer = g_new (guint16, CHUNK_VOXELS);
+        guint16 block;
+        chunk_update_sums (chunk, chunk_get_blocks (chunk, buffer, &block));
+    }
+}
+
+gboolean
+pv_map_get_summed_volumes (PvMap *self)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), FALSE);
+    return self->summed_volumes;
+}
+
+guint
+pv_map_add_block (PvMap       *self,
+                  const gchar *name,
+                  guint8       red,
+                  guint8       green,
+                  guint8       blue)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), 0);
+    g_return_val_if_fail (!self->read_only, 0);
+
+    BlockType block = { g_strdup (name), red, green, blue };
+    g_array_append_val (self->blocks, block);
+
+    return self->blocks->len - 1;
+}
+
+gsize
+pv_map_get_block_count (PvMap *self)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), 0);
+    return self->blocks->len;
+}
+
+const gchar *
+pv_map_get_block_name (PvMap  *self,
+                       guint16 block_id)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), NULL);
+    g_return_val_if_fail (block_id < self->blocks->len, NULL);
+
+    return g_array_index (self->blocks, BlockType, block_id).name;
+}
+
+void
+pv_map_get_block_color (PvMap  *self,
+                        guint16 block_id,
+                        guint8 *red,
+                        guint8 *green,
+                        guint8 *blue)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (block_id < self->blocks->len);
+
+    BlockType *block = &g_array_index (self->blocks, BlockType, block_id);
+    *red = block->red;
+    *green = block->green;
+    *blue = block->blue;
+}
+
+/* Get where to write the block at x, y, z and how many blocks can be written along the X axis.
+ * Returns NULL if this chunk is not being decoded */
+static guint16 *
+grid_get_span (ChunkGrid *grid,
+               guint64    x,
+               guint64    y,
+               guint64    z,
+               gsize     *length)
+{
+    *length = CHUNK_SIZE - (x & CHUNK_MASK);
+
+    guint64 index = (((z >> CHUNK_SHIFT) - grid->z) * grid->height + ((y >> CHUNK_SHIFT) - grid->y)) * grid->width + ((x >> CHUNK_SHIFT) - grid->x);
+    Chunk *chunk = grid->chunks[index];
+    if (chunk == NULL)
+        return NULL;
+
+    return chunk_get_writable_blocks (chunk) + (((z & CHUNK_MASK) * CHUNK_SIZE) + (y & CHUNK_MASK)) * CHUNK_SIZE + (x & CHUNK_MASK);
+}
+
+/* Set length blocks in span to block */
+static void
+fill_span (guint16 *span,
+           guint16  block,
+           gsize    length)
+{
+    if (block == 0) {
+        memset (span, 0, sizeof (guint16) * length);
+        return;
+    }
+
+    gsize i = 0;
+#ifdef __SSE2__
+    __m128i value = _mm_set1_epi16 (block);
+    for (; i + 8 <= length; i += 8)
+        _mm_storeu_si128 ((__m128i *) (span + i), value);
+#endif
+    for (; i < length; i++)
+        span[i] = block;
+}
+
+/* Convert 8 bit data into blocks */
+static void
+copy_blocks8 (guint16      *span,
+              const guint8 *data,
+              gsize         length)
+{
+    gsize i = 0;
+#if defined(__AVX2__)
+    for (; i + 16 <= length; i += 16) {
+        __m128i value = _mm_loadu_si128 ((const __m128i *) (data + i));
+        _mm256_storeu_si256 ((__m256i *) (span + i), _mm256_cvtepu8_epi16 (value));
+    }
+#elif defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128 ();
+    for (; i + 16 <= length; i += 16) {
+        __m128i value = _mm_loadu_si128 ((const __m128i *) (data + i));
+        _mm_storeu_si128 ((__m128i *) (span + i), _mm_unpacklo_epi8 (value, zero));
+        _mm_storeu_si128 ((__m128i *) (span + i + 8), _mm_unpackhi_epi8 (value, zero));
+    }
+#endif
+    for (; i < length; i++)
+        span[i] = data[i];
+}
+
+/* Convert little-endian 16 bit data into blocks */
+static void
+copy_blocks16 (guint16      *span,
+               const guint8 *data,
+               gsize         length)
+{
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    memcpy (span, data, sizeof (guint16) * length);
+#else
+    for (gsize i = 0; i < length; i++)
+        span[i] = data[i * 2] | data[i * 2 + 1] << 8;
+#endif
+}
+
+/* Write the blocks from an area into the chunks in grid */
+static void
+apply_area (PvMap       *self,
+            const Area  *area,
+            ChunkGrid   *grid,
+            DecodeCache *cache)
+{
+    /* Get overlapping area */
+    guint64 x0 = MAX (grid->x * CHUNK_SIZE, area->x);
+    guint64 x1 = MIN ((grid->x + grid->width) * CHUNK_SIZE, area->x + area->width);
+    guint64 y0 = MAX (grid->y * CHUNK_SIZE, area->y);
+    guint64 y1 = MIN ((grid->y + grid->height) * CHUNK_SIZE, area->y + area->height);
+    guint64 z0 = MAX (grid->z * CHUNK_SIZE, area->z);
+    guint64 z1 = MIN ((grid->z + grid->depth) * CHUNK_SIZE, area->z + area->depth);
+    if (x0 >= x1 || y0 >= y1 || z0 >= z1)
+        return;
+
+    /* Areas with data that can't be read are skipped, the failure is available from pv_map_get_read_error() */
+    DataReader reader;
+    memset (&reader, 0, sizeof (reader));
+    if (area->data >= 0) {
+        DataBlock *block = get_data_block (self, area->data, NULL);
+        if (block == NULL)
+            return;
+        if (block->compression == PV_MAP_COMPRESSION_DEFLATE && cache != NULL)
+            data_reader_init (&reader, decode_cache_get (cache, block), PV_MAP_COMPRESSION_NONE);
+        else
+            data_reader_init (&reader, block->data, block->compression);
+    }
+
+    switch (area->type) {
+    case AREA_TYPE_FILL:
+        for (guint64 z = z0; z < z1; z++)
+            for (guint64 y = y0; y < y1; y++)
+                for (guint64 x = x0; x < x1;) {
+                    gsize length;
+                    guint16 *span = grid_get_span (grid, x, y, z, &length);
+                    length = MIN (length, x1 - x);
+                    if (span != NULL)
+                        fill_span (span, area->block, length);
+                    x += length;
+                }
+        break;
+    case AREA_TYPE_RASTER8:
+        for (guint64 z = z0; z < z1; z++)
+            for (guint64 y = y0; y < y1; y++)
+                for (guint64 x = x0; x < x1;) {
+                    gsize length;
+                    guint16 *span = grid_get_span (grid, x, y, z, &length);
+                    length = MIN (length, x1 - x);
+                    if (span != NULL) {
+                        gsize offset = (((z - area->z) * area->height) + (y - area->y)) * area->width + (x - area->x);
+                        for (gsize i = 0; i < length;) {
+                            const guint8 *data;
+                            gsize n_available = data_reader_get (&reader, offset + i, &data);
+                            if (n_available == 0) {
+                                /* Missing data is the default block */
+                                fill_span (span + i, 0, length - i);
+                                break;
+                            }
+                            n_available = MIN (n_available, length - i);
+                            copy_blocks8 (span + i, data, n_available);
+                            i += n_available;
+                        }
+                    }
+                    x += length;
+                }
+        break;
+    case AREA_TYPE_COORD8_8:
+        for (gsize offset = 0;; offset += 4) {
+            guint8 data[4];
+            if (data_reader_read (&reader, offset, data, 4) != 4)
+                break;
+            guint64 x = area->x + data[0];
+            guint64 y = area->y + data[1];
+            guint64 z = area->z + data[2];
+            if (x < x0 || x >= x1 || y < y0 || y >= y1 || z < z0 || z >= z1)
+                continue;
+            gsize length;
+            guint16 *span = grid_get_span (grid, x, y, z, &length);
+            if (span != NULL)
+                span[0] = data[3];
+        }
+        break;
+    case AREA_TYPE_RASTER16:
+        for (guint64 z = z0; z < z1; z++)
+            for (guint64 y = y0; y < y1; y++)
+                for (guint64 x = x0; x < x1;) {
+                    gsize length;
+                    guint16 *span = grid_get_span (grid, x, y, z, &length);
+                    length = MIN (length, x1 - x);
+                    if (span != NULL) {
+                        gsize offset = ((((z - area->z) * area->height) + (y - area->y)) * area->width + (x - area->x)) * 2;
+                        for (gsize i = 0; i < length;) {
+                            const guint8 *data;
+                            gsize n_available = data_reader_get (&reader, offset + i * 2, &data) / 2;
+                            if (n_available == 0) {
+                                /* Block split across decoded data */
+                                guint8 value[2];
+                                if (data_reader_read (&reader, offset + i * 2, value, 2) != 2) {
+                                    /* Missing data is the default block */
+                                    fill_span (span + i, 0, length - i);
+                                    break;
+                                }
+                                copy_blocks16 (span + i, value, 1);
+                                i++;
+                                continue;
+                            }
+                            n_available = MIN (n_available, length - i);
+                            copy_blocks16 (span + i, data, n_available);
+                            i += n_available;
+                        }
+                    }
+                    x += length;
+                }
+        break;
+    case AREA_TYPE_RLE: {
+        /* Current run, ending at run_end voxels into the area */
+        gsize data_offset = 0;
+        guint64 run_end = 0;
+        guint8 run_block = 0;
+        for (guint64 z = z0; z < z1; z++)
+            for (guint64 y = y0; y < y1; y++)
+                for (guint64 x = x0; x < x1;) {
+                    gsize length;
+                    guint16 *span = grid_get_span (grid, x, y, z, &length);
+                    length = MIN (length, x1 - x);
+                    guint64 offset = (((z - area->z) * area->height) + (y - area->y)) * area->width + (x - area->x);
+                    for (gsize i = 0; i < length;) {
+                        while (offset + i >= run_end) {
+                            guint64 run_length;
+                            if (!data_reader_read_run (&reader, &data_offset, &run_length, &run_block) ||
+                                run_length > G_MAXUINT64 - run_end) {
+                                /* Missing data is the default block */
+                                run_block = 0;
+                                run_length = G_MAXUINT64 - run_end;
+                            }
+                            run_end += run_length;
+                        }
+                        gsize n = MIN (run_end - (offset + i), length - i);
+                        if (span != NULL)
+                            fill_span (span + i, run_block, n);
+                        i += n;
+                    }
+                    x += length;
+                }
+        break;
+    }
+    case AREA_TYPE_UNKNOWN:
+        break;
+    }
+
+    data_reader_clear (&reader);
+}
+
+/* Write a new area into any chunks that have already been decoded */
+static void
+update_chunks (PvMap      *self,
+               const Area *area)
+{
+    guint64 x = area->x, y = area->y, z = area->z;
+    guint64 width = area->width, height = area->height, depth = area->depth;
+    gsize n_decoded = g_hash_table_size (self->chunks) + g_hash_table_size (self->uniform_chunks);
+    if (width == 0 || height == 0 || depth == 0 || n_decoded == 0)
+        return;
+
+    ChunkGrid grid;
+    grid.x = x >> CHUNK_SHIFT;
+    grid.y = y >> CHUNK_SHIFT;
+    grid.z = z >> CHUNK_SHIFT;
+    grid.width = ((x + width - 1) >> CHUNK_SHIFT) - grid.x + 1;
+    grid.height = ((y + height - 1) >> CHUNK_SHIFT) - grid.y + 1;
+    grid.depth = ((z + depth - 1) >> CHUNK_SHIFT) - grid.z + 1;
+    invalidate_hashes (self, grid.x, grid.y, grid.z, grid.x + grid.width, grid.y + grid.height, grid.z + grid.depth);
+
+    /* If the area covers more chunks than have been decoded, then write them one at a time */
+    gsize n_chunks = grid.width * grid.height * grid.depth;
+    if (n_chunks > n_decoded) {
+        g_autoptr(GArray) coords = g_array_new (FALSE, FALSE, sizeof (Chunk));
+        GHashTableIter iter;
+        Chunk *chunk;
+        g_hash_table_iter_init (&iter, self->chunks);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &chunk, NULL))
+            g_array_append_val (coords, *chunk);
+        gpointer key, value;
+        g_hash_table_iter_init (&iter, self->uniform_chunks);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            Chunk uniform;
+            chunk_init_uniform (&uniform, key, GPOINTER_TO_UINT (value));
+            g_array_append_val (coords, uniform);
+        }
+
+        DecodeCache cache;
+        decode_cache_init (&cache);
+        for (guint i = 0; i < coords->len; i++) {
+            Chunk *c = &g_array_index (coords, Chunk, i);
+            if (c->x < grid.x || c->x >= grid.x + grid.width ||
+                c->y < grid.y || c->y >= grid.y + grid.height ||
+                c->z < grid.z || c->z >= grid.z + grid.depth)
+                continue;
+            chunk = lookup_writable_chunk (self, c->x, c->y, c->z);
+            ChunkGrid chunk_grid = { chunk->x, chunk->y, chunk->z, 1, 1, 1, &chunk };
+            apply_area (self, area, &chunk_grid, &cache);
+            chunk_compact (self, chunk);
+            shrink_chunk (self, chunk);
+        }
+        decode_cache_clear (&cache);
+        return;
+    }
+
+    g_autofree Chunk **chunks = g_new0 (Chunk *, n_chunks);
+    grid.chunks = chunks;
+    gsize i = 0;
+    for (guint64 cz = grid.z; cz < grid.z + grid.depth; cz++)
+        for (guint64 cy = grid.y; cy < grid.y + grid.height; cy++)
+            for (guint64 cx = grid.x; cx < grid.x + grid.width; cx++)
+                chunks[i++] = lookup_writable_chunk (self, cx, cy, cz);
+    apply_area (self, area, &grid, NULL);
+    for (i = 0; i < n_chunks; i++)
+        if (chunks[i] != NULL) {
+            chunk_compact (self, chunks[i]);
+            shrink_chunk (self, chunks[i]);
+        }
+}
+
+/* Ensure all the chunks in the given range have been decoded, reporting progress if loading.
+ * cache is used when decoding many ranges in turn, so deflate data is only decompressed once.
+ * Returns FALSE if cancelled, in which case no chunks are added */
+static gboolean
+decode_chunks_with_progress (PvMap        *self,
+                             guint64       x,
+                             guint64       y,
+                             guint64       z,
+                             guint64       width,
+                             guint64       height,
+                             guint64       depth,
+                             DecodeCache  *cache,
+                             LoadData     *load,
+                             GCancellable *cancellable)
+{
+    ChunkGrid grid = { x, y, z, width, height, depth, NULL };
+    gsize n_chunks = width * height * depth;
+    g_autofree Chunk **chunks = g_new0 (Chunk *, n_chunks);
+    grid.chunks = chunks;
+
+    gboolean have_missing = FALSE;
+    gsize i = 0;
+    Chunk uniform;
+    for (guint64 cz = z; cz < z + depth; cz++)
+        for (guint64 cy = y; cy < y + height; cy++)
+            for (guint64 cx = x; cx < x + width; cx++) {
+                if (lookup_chunk (self, cx, cy, cz, &uniform) == NULL) {
+                    chunks[i] = chunk_new (cx, cy, cz);
+                    have_missing = TRUE;
+                }
+                i++;
+            }
+    if (!have_missing)
+        return TRUE;
+
+    g_autoptr(GArray) area_ids = g_array_new (FALSE, FALSE, sizeof (guint));
+    pv_area_index_query (self->area_index,
+                         x * CHUNK_SIZE, y * CHUNK_SIZE, z * CHUNK_SIZE,
+                         width * CHUNK_SIZE, height * CHUNK_SIZE, depth * CHUNK_SIZE,
+                         area_ids);
+    for (guint j = 0; j < area_ids->len; j++) {
+        if (g_cancellable_is_cancelled (cancellable)) {
+            for (i = 0; i < n_chunks; i++)
+                g_clear_pointer (&chunks[i], chunk_free);
+            return FALSE;
+        }
+        apply_area (self, get_area (self, g_array_index (area_ids, guint, j)), &grid, cache);
+        if (load != NULL)
+            load_data_report (load, load->n_bytes, j + 1, area_ids->len);
+    }
+
+    for (i = 0; i < n_chunks; i++) {
+        if (chunks[i] == NULL)
+            continue;
+        chunk_compact (self, chunks[i]);
+        add_chunk (self, chunks[i]);
+    }
+
+    return TRUE;
+}
+
+/* Ensure all the chunks in the given range have been decoded */
+static void
+decode_chunks (PvMap  *self,
+               guint64 x,
+               guint64 y,
+               guint64 z,
+               guint64 width,
+               guint64 height,
+               guint64 depth)
+{
+    decode_chunks_with_progress (self, x, y, z, width, height, depth, NULL, NULL, NULL);
+}
+
+static void
+load_thread (GTask        *task,
+             PvMap        *self,
+             LoadData     *data,
+             GCancellable *cancellable)
+{
+    if (g_task_return_error_if_cancelled (task))
+        return;
+
+    g_autoptr(GError) error = NULL;
+    gboolean result;
+    if (data->bytes != NULL) {
+        result = pv_map_load_bytes (self, data->bytes, &error);
+        if (result)
+            load_data_report (data, g_bytes_get_size (data->bytes), 0, 0);
+    }
+    else
+        result = load_stream (self, data->stream, data, cancellable, &error);
+    if (!result) {
+        g_task_return_error (task, g_steal_pointer (&error));
+        return;
+    }
+
+    /* Decode the whole map so it is ready to use */
+    guint64 chunks_width = (self->width + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    guint64 chunks_height = (self->height + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    guint64 chunks_depth = (self->depth + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    if (!decode_chunks_with_progress (self, 0, 0, 0, chunks_width, chunks_height, chunks_depth, NULL, data, cancellable)) {
+        g_task_return_error_if_cancelled (task);
+        return;
+    }
+    if (self->read_error != NULL) {
+        g_task_return_error (task, g_error_copy (self->read_error));
+        return;
+    }
+
+    g_task_return_boolean (task, TRUE);
+}
+
+/* Load and decode a map on a worker thread. The map must not be used until the load completes.
+ * Progress is reported with the load-progress signal */
+void
+pv_map_load_async (PvMap               *self,
+                   GInputStream        *stream,
+                   GCancellable        *cancellable,
+                   GAsyncReadyCallback  callback,
+                   gpointer             user_data)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+
+    g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
+    g_task_set_source_tag (task, pv_map_load_async);
+
+    LoadData *data = g_new0 (LoadData, 1);
+    data->task = task;
+    data->stream = g_object_ref (stream);
+    g_mutex_init (&data->mutex);
+    g_task_set_task_data (task, data, (GDestroyNotify) load_data_free);
+
+    g_task_run_in_thread (task, (GTaskThreadFunc) load_thread);
+}
+
+/* Load and decode a map from memory on a worker thread, as with pv_map_load_async() */
+void
+pv_map_load_bytes_async (PvMap               *self,
+                         GBytes              *bytes,
+                         GCancellable        *cancellable,
+                         GAsyncReadyCallback  callback,
+                         gpointer             user_data)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+
+    g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
+    g_task_set_source_tag (task, pv_map_load_bytes_async);
+
+    LoadData *data = g_new0 (LoadData, 1);
+    data->task = task;
+    data->bytes = g_bytes_ref (bytes);
+    g_mutex_init (&data->mutex);
+    g_task_set_task_data (task, data, (GDestroyNotify) load_data_free);
+
+    g_task_run_in_thread (task, (GTaskThreadFunc) load_thread);
+}
+
+gboolean
+pv_map_load_finish (PvMap         *self,
+                    GAsyncResult  *result,
+                    GError       **error)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), FALSE);
+    g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+void
+pv_map_add_area_raster8 (PvMap  *self,
+                         guint64 x,
+                         guint64 y,
+                         guint64 z,
+                         guint64 width,
+                         guint64 height,
+                         guint64 depth,
+                         guint8 *blocks)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+
+    gint64 data = add_data_block (self, g_bytes_new (blocks, width * height * depth));
+    Area area = { AREA_TYPE_RASTER8, x, y, z, width, height, depth, 0, data, self->compression, NULL };
+    g_array_append_val (self->areas, area);
+
+    index_area (self, &area);
+    update_chunks (self, &area);
+}
+
+void
+pv_map_add_area_rle (PvMap  *self,
+                     guint64 x,
+                     guint64 y,
+                     guint64 z,
+                     guint64 width,
+                     guint64 height,
+                     guint64 depth,
+                     guint8 *blocks)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+
+    gint64 data = add_data_block (self, encode_rle (blocks, width * height * depth));
+    Area area = { AREA_TYPE_RLE, x, y, z, width, height, depth, 0, data, self->compression, NULL };
+    g_array_append_val (self->areas, area);
+
+    index_area (self, &area);
+    update_chunks (self, &area);
+}
+
+/* Get the average number of areas that overlap each chunk */
+static gdouble
+get_areas_per_chunk (PvMap *self)
+{
+    guint64 chunks_width = (self->width + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    guint64 chunks_height = (self->height + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    guint64 chunks_depth = (self->depth + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    guint64 n_chunks = chunks_width * chunks_height * chunks_depth;
+    if (n_chunks == 0)
+        return 0;
+
+    guint64 n_overlaps = 0;
+    for (guint i = 0; i < self->areas->len; i++) {
+        Area *area = get_area (self, i);
+        if (area->type == AREA_TYPE_UNKNOWN || area->width == 0 || area->height == 0 || area->depth == 0)
+            continue;
+        guint64 x0 = area->x >> CHUNK_SHIFT, x1 = MIN (((area->x + area->width - 1) >> CHUNK_SHIFT) + 1, chunks_width);
+        guint64 y0 = area->y >> CHUNK_SHIFT, y1 = MIN (((area->y + area->height - 1) >> CHUNK_SHIFT) + 1, chunks_height);
+        guint64 z0 = area->z >> CHUNK_SHIFT, z1 = MIN (((area->z + area->depth - 1) >> CHUNK_SHIFT) + 1, chunks_depth);
+        if (x0 < x1 && y0 < y1 && z0 < z1)
+            n_overlaps += (x1 - x0) * (y1 - y0) * (z1 - z0);
+    }
+
+    return (gdouble) n_overlaps / n_chunks;
+}
+
+static guint64
+get_data_size (PvMap *self)
+{
+    guint64 size = 0;
+    for (guint i = 0; i < self->data_blocks->len; i++) {
+        DataBlock *block = g_ptr_array_index (self->data_blocks, i);
+        if (block->data != NULL)
+            size += g_bytes_get_size (block->data);
+    }
+    return size;
+}
+
+/* Copy the JSON for an unknown area, pointing it at a different data block */
+static JsonObject *
+copy_area_object (JsonObject *object,
+                  gint64      data)
+{
+    JsonObject *copy = json_object_new ();
+    GList *members = json_object_get_members (object);
+    for (GList *link = members; link != NULL; link = link->next) {
+        const gchar *member_name = link->data;
+        json_object_set_member (copy, member_name, json_node_copy (json_object_get_member (object, member_name)));
+    }
+    g_list_free (members);
+    if (json_object_has_member (copy, "data"))
+        json_object_set_int_member (copy, "data", data);
+    return copy;
+}
+
+/* Convert the blocks in a chunk to the smallest area that contains them */
+static void
+compact_job_run (CompactJob   *job,
+                 GCancellable *cancellable)
+{
+    if (g_cancellable_is_cancelled (cancellable) || job->chunk == NULL)
+        return;
+
+    Area *area = &job->area;
+    g_autofree guint16 *buffer = chunk_buffer_new (job->map);
+    const guint16 *chunk_blocks = chunk_get_blocks (job->chunk, buffer, &area->block);
+    if (chunk_blocks == NULL)
+        return;
+
+    /* Get the blocks inside the map */
+    gsize length = area->width * area->height * area->depth;
+    g_autofree guint16 *blocks = g_new (guint16, length);
+    guint16 max_block = 0;
+    gboolean is_uniform = TRUE;
+    gsize offset = 0;
+    for (guint64 z = 0; z < area->depth; z++)
+        for (guint64 y = 0; y < area->height; y++) {
+            const guint16 *row = chunk_blocks + (z * CHUNK_SIZE + y) * CHUNK_SIZE;
+            for (guint64 x = 0; x < area->width; x++) {
+                blocks[offset] = row[x];
+                max_block = MAX (max_block, row[x]);
+                if (row[x] != blocks[0])
+                    is_uniform = FALSE;
+                offset++;
+            }
+        }
+    if (is_uniform) {
+        area->block = blocks[0];
+        return;
+    }
+
+    if (max_block <= G_MAXUINT8) {
+        guint8 *data = g_malloc (length);
+        for (gsize i = 0; i < length; i++)
+            data[i] = blocks[i];
+        g_autoptr(GBytes) rle_data = encode_rle (data, length);
+        if (g_bytes_get_size (rle_data) < length) {
+            area->type = AREA_TYPE_RLE;
+            job->data = g_steal_pointer (&rle_data);
+            g_free (data);
+        }
+        else {
+            area->type = AREA_TYPE_RASTER8;
+            job->data = g_bytes_new_take (data, length);
+        }
+    }
+    else {
+        area->type = AREA_TYPE_RASTER16;
+        job->data = encode_raster16 (blocks, length);
+    }
+}
+
+/* Replace the areas with one non-overlapping area per chunk, merging runs of filled chunks along X */
+gboolean
+pv_map_compact (PvMap             *self,
+                PvMapCompactStats *stats,
+                GCancellable      *cancellable,
+                GError           **error)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), FALSE);
+    g_return_val_if_fail (!self->read_only, FALSE);
+
+    flush_pending_chunks (self);
+
+    guint64 chunks_width = (self->width + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    guint64 chunks_height = (self->height + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    guint64 chunks_depth = (self->depth + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    decode_chunks (self, 0, 0, 0, chunks_width, chunks_height, chunks_depth);
+
+    /* Don't replace areas that couldn't be read with empty ones */
+    if (self->read_error != NULL) {
+        g_propagate_error (error, g_error_copy (self->read_error));
+        return FALSE;
+    }
+
+    PvMapCompactStats s;
+    s.n_areas_before = self->areas->len;
+    s.data_size_before = get_data_size (self);
+    s.areas_per_chunk_before = get_areas_per_chunk (self);
+
+    /* Encode chunks in parallel */
+    g_autoptr(GArray) jobs = g_array_new (FALSE, FALSE, sizeof (CompactJob));
+    for (guint64 cz = 0; cz < chunks_depth; cz++)
+        for (guint64 cy = 0; cy < chunks_height; cy++)
+            for (guint64 cx = 0; cx < chunks_width; cx++) {
+                Chunk uniform;
+                Chunk *chunk = lookup_chunk (self, cx, cy, cz, &uniform);
+                if (chunk_is_empty (chunk))
+                    continue;
+
+                /* Uniform chunks have no Chunk to encode, they are just filled with their block */
+                CompactJob job;
+                job.map = self;
+                job.chunk = chunk != &uniform ? chunk : NULL;
+                Area area = { AREA_TYPE_FILL,
+                              cx * CHUNK_SIZE, cy * CHUNK_SIZE, cz * CHUNK_SIZE,
+                              MIN (self->width - cx * CHUNK_SIZE, CHUNK_SIZE),
+                              MIN (self->height - cy * CHUNK_SIZE, CHUNK_SIZE),
+                              MIN (self->depth - cz * CHUNK_SIZE, CHUNK_SIZE),
+                              PV_VOXEL_DAG_GET_BLOCK (chunk->node), -1, self->compression, NULL };
+                job.area = area;
+                job.data = NULL;
+                g_array_append_val (jobs, job);
+            }
+    guint n_threads = MAX (g_get_num_processors (), 1);
+    GThreadPool *pool = g_thread_pool_new ((GFunc) compact_job_run, cancellable, n_threads, FALSE, NULL);
+    for (guint i = 0; i < jobs->len; i++)
+        g_thread_pool_push (pool, &g_array_index (jobs, CompactJob, i), NULL);
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+    if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
+        for (guint i = 0; i < jobs->len; i++)
+            g_clear_pointer (&g_array_index (jobs, CompactJob, i).data, g_bytes_unref);
+        return FALSE;
+    }
+
+    /* Keep unknown areas and the data blocks they use as they can't be decoded */
+    g_autoptr(GArray) areas = g_array_new (FALSE, FALSE, sizeof (Area));
+    g_array_set_clear_func (areas, (GDestroyNotify) area_clear);
+    g_autoptr(GPtrArray) data_blocks = g_ptr_array_new_with_free_func ((GDestroyNotify) data_block_unref);
+    g_autoptr(GHashTable) data_indexes = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (guint i = 0; i < self->areas->len; i++) {
+        Area *area = get_area (self, i);
+        if (area->type != AREA_TYPE_UNKNOWN)
+            continue;
+        Area a = *area;
+        if (a.data >= 0 && a.data < (gint64) self->data_blocks->len) {
+            gpointer index;
+            if (!g_hash_table_lookup_extended (data_indexes, GINT_TO_POINTER (a.data), NULL, &index)) {
+                index = GUINT_TO_POINTER (data_blocks->len);
+                g_ptr_array_add (data_blocks, data_block_ref (g_ptr_array_index (self->data_blocks, a.data)));
+                g_hash_table_insert (data_indexes, GINT_TO_POINTER (a.data), index);
+            }
+            a.data = GPOINTER_TO_UINT (index);
+        }
+        a.object = area->object != NULL ? copy_area_object (area->object, a.data) : NULL;
+        g_array_append_val (areas, a);
+    }
+    g_ptr_array_unref (self->data_blocks);
+    self->data_blocks = g_steal_pointer (&data_blocks);
+    g_hash_table_remove_all (self->data_block_ids);
+
+    for (guint i = 0; i < jobs->len; i++) {
+        CompactJob *job = &g_array_index (jobs, CompactJob, i);
+        if (job->data != NULL) {
+            job->area.data = add_data_block (self, g_steal_pointer (&job->data));
+            g_array_append_val (areas, job->area);
+            continue;
+        }
+
+        /* Extend the previous fill if this continues it. Jobs are in X order so only
+         * runs along X are merged, rows of chunks in Y and Z remain separate areas */
+        Area *last = areas->len > 0 ? &g_array_index (areas, Area, areas->len - 1) : NULL;
+        if (last != NULL && last->type == AREA_TYPE_FILL && last->block == job->area.block &&
+            last->x + last->width == job->area.x && last->y == job->area.y && last->z == job->area.z &&
+            last->height == job->area.height && last->depth == job->area.depth)
+            last->width += job->area.width;
+        else
+            g_array_append_val (areas, job->area);
+    }
+
+    g_array_unref (self->areas);
+    self->areas = g_steal_pointer (&areas);
+    pv_area_index_clear (self->area_index);
+    for (guint i = 0; i < self->areas->len; i++)
+        index_area (self, get_area (self, i));
+
+    /* The chunks are unchanged, but edits are now stored in the areas */
+    GHashTableIter iter;
+    Chunk *chunk;
+    g_hash_table_iter_init (&iter, self->chunks);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &chunk, NULL))
+        chunk->edited = FALSE;
+    gpointer value;
+    g_hash_table_iter_init (&iter, self->uniform_chunks);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        g_hash_table_iter_replace (&iter, GUINT_TO_POINTER (GPOINTER_TO_UINT (value) & ~UNIFORM_CHUNK_EDITED));
+
+    s.n_areas_after = self->areas->len;
+    s.data_size_after = get_data_size (self);
+    s.areas_per_chunk_after = get_areas_per_chunk (self);
+    if (stats != NULL)
+        *stats = s;
+
+    return TRUE;
+}
+
+static void
+emit_changed (PvMap *self)
+{
+    if (self->changes_freeze_count > 0 || self->changed_regions->len == 0)
+        return;
+
+    g_autoptr(GArray) regions = g_steal_pointer (&self->changed_regions);
+    self->changed_regions = g_array_new (FALSE, FALSE, sizeof (PvMapRegion));
+    g_signal_emit (self, signals[SIGNAL_CHANGED], 0, regions);
+}
+
+static guint64
+region_volume (const PvMapRegion *region)
+{
+    return region->width * region->height * region->depth;
+}
+
+/* Record a region as changed, merging it with other changed regions where that doesn't add any unchanged space */
+static void
+add_changed_region (PvMap             *self,
+                    const PvMapRegion *region)
+{
+    PvMapRegion merged = *region;
+    gboolean have_merge = TRUE;
+    while (have_merge) {
+        have_merge = FALSE;
+        for (guint i = 0; i < self->changed_regions->len; i++) {
+            PvMapRegion *r = &g_array_index (self->changed_regions, PvMapRegion, i);
+            PvMapRegion bounds;
+            bounds.x = MIN (merged.x, r->x);
+            bounds.y = MIN (merged.y, r->y);
+            bounds.z = MIN (merged.z, r->z);
+            bounds.width = MAX (merged.x + merged.width, r->x + r->width) - bounds.x;
+            bounds.height = MAX (merged.y + merged.height, r->y + r->height) - bounds.y;
+            bounds.depth = MAX (merged.z + merged.depth, r->z + r->depth) - bounds.z;
+            if (region_volume (&bounds) > region_volume (&merged) + region_volume (r))
+                continue;
+
+            merged = bounds;
+            g_array_remove_index_fast (self->changed_regions, i);
+            have_merge = TRUE;
+            break;
+        }
+    }
+    g_array_append_val (self->changed_regions, merged);
+}
+
+static gboolean
+is_uniform (const guint16 *blocks)
+{
+    for (gsize i = 1; i < CHUNK_VOXELS; i++)
+        if (blocks[i] != blocks[0])
+            return FALSE;
+    return TRUE;
+}
+
+/* Call func for each chunk in the map with the blocks it contains.
+ * The blocks are only valid during the callback, and region is the part of the chunk inside the map.
+ * Chunks that haven't been decoded are decoded a row at a time and not kept, so the whole map is never in memory */
+void
+pv_map_foreach_chunk (PvMap           *self,
+                      PvMapChunkFlags  flags,
+                      PvMapChunkFunc   func,
+                      gpointer         user_data)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (func != NULL);
+
+    flush_pending_chunks (self);
+
+    guint64 chunks_width = (self->width + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    guint64 chunks_height = (self->height + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    guint64 chunks_depth = (self->depth + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+
+    DecodeCache cache;
+    decode_cache_init (&cache);
+    g_autofree guint16 *buffer = NULL;
+    g_autofree Chunk **row_chunks = g_new0 (Chunk *, chunks_width);
+    g_autoptr(GArray) area_ids = g_array_new (FALSE, FALSE, sizeof (guint));
+    Chunk uniform;
+    for (guint64 cz = 0; cz < chunks_depth; cz++)
+        for (guint64 cy = 0; cy < chunks_height; cy++) {
+            gboolean have_missing = FALSE;
+            for (guint64 cx = 0; cx < chunks_width; cx++)
+                if (lookup_chunk (self, cx, cy, cz, &uniform) == NULL) {
+                    row_chunks[cx] = chunk_new (cx, cy, cz);
+                    have_missing = TRUE;
+                }
+            if (have_missing) {
+                ChunkGrid grid = { 0, cy, cz, chunks_width, 1, 1, row_chunks };
+                g_array_set_size (area_ids, 0);
+                pv_area_index_query (self->area_index,
+                                     0, cy * CHUNK_SIZE, cz * CHUNK_SIZE,
+                                     chunks_width * CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE,
+                                     area_ids);
+                for (guint i = 0; i < area_ids->len; i++)
+                    apply_area (self, get_area (self, g_array_index (area_ids, guint, i)), &grid, &cache);
+            }
+
+            for (guint64 cx = 0; cx < chunks_width; cx++) {
+                Chunk *chunk = row_chunks[cx] != NULL ? row_chunks[cx] : lookup_chunk (self, cx, cy, cz, &uniform);
+                if ((flags & PV_MAP_CHUNK_FLAGS_SKIP_EMPTY) != 0 && row_chunks[cx] == NULL && chunk_is_empty (chunk))
+                    continue;
+
+                if (buffer == NULL)
+                    buffer = g_new (guint16, CHUNK_VOXELS);
+                guint16 block;
+                const guint16 *blocks = chunk_get_blocks (chunk, buffer, &block);
+                if (blocks != NULL && (flags & (PV_MAP_CHUNK_FLAGS_SKIP_EMPTY | PV_MAP_CHUNK_FLAGS_SKIP_UNIFORM)) != 0 && is_uniform (blocks)) {
+                    block = blocks[0];
+                    blocks = NULL;
+                }
+                if (blocks == NULL) {
+                    if ((flags & PV_MAP_CHUNK_FLAGS_SKIP_UNIFORM) != 0 ||
+                        ((flags & PV_MAP_CHUNK_FLAGS_SKIP_EMPTY) != 0 && block == 0))
+                        continue;
+                    fill_span (buffer, block, CHUNK_VOXELS);
+                    blocks = buffer;
+                }
+
+                PvMapRegion region;
+                region.x = cx * CHUNK_SIZE;
+                region.y = cy * CHUNK_SIZE;
+                region.z = cz * CHUNK_SIZE;
+                region.width = MIN (self->width - region.x, CHUNK_SIZE);
+                region.height = MIN (self->height - region.y, CHUNK_SIZE);
+                region.depth = MIN (self->depth - region.z, CHUNK_SIZE);
+                func (self, &region, blocks, user_data);
+            }
+
+            for (guint64 cx = 0; cx < chunks_width; cx++)
+                g_clear_pointer (&row_chunks[cx], chunk_free);
+        }
+    decode_cache_clear (&cache);
+}
+
+/* Count blocks in a chunk, using the summed-volume tables if present.
+ * If match_all is TRUE counts all non-default blocks */
+static guint64
+chunk_count (Chunk    *chunk,
+             gboolean  match_all,
+             guint16   block,
+             guint     x0,
+             guint     y0,
+             guint     z0,
+             guint     x1,
+             guint     y1,
+             guint     z1,
+             guint16  *buffer)
+{
+    guint64 volume = (guint64) (x1 - x0) * (y1 - y0) * (z1 - z0);
+
+    if (!match_all && block == 0)
+        return volume - chunk_count (chunk, TRUE, 0, x0, y0, z0, x1, y1, z1, buffer);
+
+    if (chunk_is_empty (chunk))
+        return 0;
+
+    if (chunk_is_uniform (chunk))
+        return match_all || PV_VOXEL_DAG_GET_BLOCK (chunk->node) == block ? volume : 0;
+
+    if (chunk->sums != NULL) {
+        if (match_all)
+            return sum_box (chunk->sums->sums, x0, y0, z0, x1, y1, z1);
+        for (gint i = 0; i < chunk->sums->n_blocks; i++)
+            if (chunk->sums->blocks[i] == block)
+                return sum_box (chunk->sums->sums + CHUNK_VOXELS * (i + 1), x0, y0, z0, x1, y1, z1);
+        if (chunk->sums->n_blocks >= 0)
+            return 0;
+    }
+
+    guint64 count = 0;
+    if (match_all) {
+        guint32 mask = (x1 - x0 == 32 ? G_MAXUINT32 : ((1u << (x1 - x0)) - 1)) << x0;
+        for (guint z = z0; z < z1; z++)
+            for (guint y = y0; y < y1; y++)
+                count += __builtin_popcount (chunk_get_occupancy (chunk, y, z) & mask);
+        return count;
+    }
+
+    guint16 b;
+    const guint16 *blocks = chunk_get_blocks (chunk, buffer, &b);
+    for (guint z = z0; z < z1; z++)
+        for (guint y = y0; y < y1; y++) {
+            const guint16 *row = blocks + (z * CHUNK_SIZE + y) * CHUNK_SIZE;
+            for (guint x = x0; x < x1; x++)
+                if (row[x] == block)
+                    count++;
+        }
+    return count;
+}
+
+static guint64
+count_blocks (PvMap   *self,
+              gboolean match_all,
+              guint16  block,
+              guint64  x,
+              guint64  y,
+              guint64  z,
+              guint64  width,
+              guint64  height,
+              guint64  depth)
+{
+    if (width == 0 || height == 0 || depth == 0)
+        return 0;
+
+    guint64 cx0 = x >> CHUNK_SHIFT;
+    guint64 cx1 = ((x + width - 1) >> CHUNK_SHIFT) + 1;
+    guint64 cy0 = y >> CHUNK_SHIFT;
+    guint64 cy1 = ((y + height - 1) >> CHUNK_SHIFT) + 1;
+    guint64 cz0 = z >> CHUNK_SHIFT;
+    guint64 cz1 = ((z + depth - 1) >> CHUNK_SHIFT) + 1;
+    decode_chunks (self, cx0, cy0, cz0, cx1 - cx0, cy1 - cy0, cz1 - cz0);
+
+    g_autofree guint16 *buffer = chunk_buffer_new (self);
+
+    guint64 count = 0;
+    for (guint64 cz = cz0; cz < cz1; cz++)
+        for (guint64 cy = cy0; cy < cy1; cy++)
+            for (guint64 cx = cx0; cx < cx1; cx++) {
+                Chunk uniform;
+                Chunk *chunk = lookup_chunk (self, cx, cy, cz, &uniform);
+
+                /* Get overlapping area in chunk coordinates */
+                guint x0 = MAX (x, cx * CHUNK_SIZE) - cx * CHUNK_SIZE;
+                guint x1 = MIN (x + width, (cx + 1) * CHUNK_SIZE) - cx * CHUNK_SIZE;
+                guint y0 = MAX (y, cy * CHUNK_SIZE) - cy * CHUNK_SIZE;
+                guint y1 = MIN (y + height, (cy + 1) * CHUNK_SIZE) - cy * CHUNK_SIZE;
+                guint z0 = MAX (z, cz * CHUNK_SIZE) - cz * CHUNK_SIZE;
+                guint z1 = MIN (z + depth, (cz + 1) * CHUNK_SIZE) - cz * CHUNK_SIZE;
+
+                count += chunk_count (chunk, match_all, block, x0, y0, z0, x1, y1, z1, buffer);
+            }
+
+    return count;
+}
+
+/* Count the non-default blocks in a region */
+guint64
+pv_map_count_occupied (PvMap  *self,
+                       guint64 x,
+                       guint64 y,
+                       guint64 z,
+                       guint64 width,
+                       guint64 height,
+                       guint64 depth)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), 0);
+    return count_blocks (self, TRUE, 0, x, y, z, width, height, depth);
+}
+
+/* Count the blocks of a given type in a region */
+guint64
+pv_map_count_blocks (PvMap  *self,
+                     guint16 block,
+                     guint64 x,
+                     guint64 y,
+                     guint64 z,
+                     guint64 width,
+                     guint64 height,
+                     guint64 depth)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), 0);
+    return count_blocks (self, FALSE, block, x, y, z, width, height, depth);
+}
+
+/* Get the bricks in the chunk containing x, y, z that contain non-default blocks,
+ * bit (by * 8 + bx) of occupancy[bz] is set for each of them */
+void
+pv_map_get_chunk_occupancy (PvMap   *self,
+                            guint64  x,
+                            guint64  y,
+                            guint64  z,
+                            guint64 *occupancy)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+
+    guint64 cx = x >> CHUNK_SHIFT, cy = y >> CHUNK_SHIFT, cz = z >> CHUNK_SHIFT;
+    decode_chunks (self, cx, cy, cz, 1, 1, 1);
+    Chunk uniform;
+    Chunk *chunk = lookup_chunk (self, cx, cy, cz, &uniform);
+    memcpy (occupancy, chunk->brick_occupancy, sizeof (chunk->brick_occupancy));
+}
+
+gboolean
+pv_map_is_empty (PvMap  *self,
+                 guint64 x,
+                 guint64 y,
+                 guint64 z,
+                 guint64 width,
+                 guint64 height,
+                 guint64 depth)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), TRUE);
+
+    if (width == 0 || height == 0 || depth == 0)
+        return TRUE;
+
+    guint64 cx0 = x >> CHUNK_SHIFT;
+    guint64 cx1 = ((x + width - 1) >> CHUNK_SHIFT) + 1;
+    guint64 cy0 = y >> CHUNK_SHIFT;
+    guint64 cy1 = ((y + height - 1) >> CHUNK_SHIFT) + 1;
+    guint64 cz0 = z >> CHUNK_SHIFT;
+    guint64 cz1 = ((z + depth - 1) >> CHUNK_SHIFT) + 1;
+    decode_chunks (self, cx0, cy0, cz0, cx1 - cx0, cy1 - cy0, cz1 - cz0);
+
+    for (guint64 cz = cz0; cz < cz1; cz++)
+        for (guint64 cy = cy0; cy < cy1; cy++)
+            for (guint64 cx = cx0; cx < cx1; cx++) {
+                Chunk uniform;
+                Chunk *chunk = lookup_chunk (self, cx, cy, cz, &uniform);
+                if (chunk_is_empty (chunk))
+                    continue;
+
+                /* Get overlapping area in chunk coordinates */
+                guint x0 = MAX (x, cx * CHUNK_SIZE) - cx * CHUNK_SIZE;
+                guint x1 = MIN (x + width, (cx + 1) * CHUNK_SIZE) - cx * CHUNK_SIZE;
+                guint y0 = MAX (y, cy * CHUNK_SIZE) - cy * CHUNK_SIZE;
+                guint y1 = MIN (y + height, (cy + 1) * CHUNK_SIZE) - cy * CHUNK_SIZE;
+                guint z0 = MAX (z, cz * CHUNK_SIZE) - cz * CHUNK_SIZE;
+                guint z1 = MIN (z + depth, (cz + 1) * CHUNK_SIZE) - cz * CHUNK_SIZE;
+
+                guint32 mask = (x1 - x0 == 32 ? G_MAXUINT32 : ((1u << (x1 - x0)) - 1)) << x0;
+                for (guint bz = z0 >> BRICK_SHIFT; bz <= (z1 - 1) >> BRICK_SHIFT; bz++)
+                    for (guint by = y0 >> BRICK_SHIFT; by <= (y1 - 1) >> BRICK_SHIFT; by++)
+                        for (guint bx = x0 >> BRICK_SHIFT; bx <= (x1 - 1) >> BRICK_SHIFT; bx++) {
+                            if (!chunk_is_brick_occupied (chunk, bx << BRICK_SHIFT, by << BRICK_SHIFT, bz << BRICK_SHIFT))
+                                continue;
+
+                            /* Check the rows in this brick */
+                            guint32 brick_mask = mask & (0xFu << (bx << BRICK_SHIFT));
+                            for (guint cz_ = MAX (z0, bz << BRICK_SHIFT); cz_ < MIN (z1, (bz + 1) << BRICK_SHIFT); cz_++)
+                                for (guint cy_ = MAX (y0, by << BRICK_SHIFT); cy_ < MIN (y1, (by + 1) << BRICK_SHIFT); cy_++)
+                                    if ((chunk_get_occupancy (chunk, cy_, cz_) & brick_mask) != 0)
+                                        return FALSE;
+                        }
+            }
+
+    return TRUE;
+}
+
+/* Find the first non-default block along a ray.
+ * Empty chunks and bricks are stepped over in one go, then blocks are stepped through individually */
+gboolean
+pv_map_raycast (PvMap           *self,
+                const gdouble   *origin,
+                const gdouble   *direction,
+                gdouble          max_distance,
+                PvMapRaycastHit *hit)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), FALSE);
+
+    gdouble length = sqrt (direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2]);
+    if (length == 0)
+        return FALSE;
+    gdouble dir[3], inv_dir[3];
+    for (int i = 0; i < 3; i++) {
+        dir[i] = direction[i] / length;
+        inv_dir[i] = 1.0 / dir[i];
+    }
+    gint64 size[3] = { self->width, self->height, self->depth };
+
+    /* Clip the ray to the map bounds */
+    gdouble t = 0, t_end = max_distance;
+    int axis = -1;
+    for (int i = 0; i < 3; i++) {
+        if (dir[i] == 0) {
+            if (origin[i] < 0 || origin[i] >= size[i])
+                return FALSE;
+            continue;
+        }
+
+        gdouble t0 = -origin[i] * inv_dir[i];
+        gdouble t1 = (size[i] - origin[i]) * inv_dir[i];
+        if (t0 > t1) {
+            gdouble temp = t0;
+            t0 = t1;
+            t1 = temp;
+        }
+        if (t0 > t) {
+            t = t0;
+            axis = i;
+        }
+        if (t1 < t_end)
+            t_end = t1;
+    }
+    if (t >= t_end)
+        return FALSE;
+
+    gint64 voxel[3];
+    for (int i = 0; i < 3; i++) {
+        if (i == axis)
+            voxel[i] = dir[i] > 0 ? 0 : size[i] - 1;
+        else
+            voxel[i] = CLAMP ((gint64) floor (origin[i] + t * dir[i]), 0, size[i] - 1);
+    }
+
+    Chunk uniform;
+    Chunk *chunk = NULL;
+    while (TRUE) {
+        guint64 cx = voxel[0] >> CHUNK_SHIFT, cy = voxel[1] >> CHUNK_SHIFT, cz = voxel[2] >> CHUNK_SHIFT;
+        if (chunk == NULL || chunk->x != cx || chunk->y != cy || chunk->z != cz) {
+            decode_chunks (self, cx, cy, cz, 1, 1, 1);
+            chunk = lookup_chunk (self, cx, cy, cz, &uniform);
+        }
+
+        /* Find the size of the empty cell we are in */
+        guint x = voxel[0] & CHUNK_MASK, y = voxel[1] & CHUNK_MASK, z = voxel[2] & CHUNK_MASK;
+        gint64 cell_size;
+        if (chunk_is_empty (chunk))
+            cell_size = CHUNK_SIZE;
+        else if (!chunk_is_brick_occupied (chunk, x, y, z))
+            cell_size = BRICK_SIZE;
+        else if (((chunk_get_occupancy (chunk, y, z) >> x) & 1) == 0)
+            cell_size = 1;
+        else {
+            if (hit != NULL) {
+                hit->x = voxel[0];
+                hit->y = voxel[1];
+                hit->z = voxel[2];
+                hit->normal_x = axis == 0 ? (dir[0] > 0 ? -1 : 1) : 0;
+                hit->normal_y = axis == 1 ? (dir[1] > 0 ? -1 : 1) : 0;
+                hit->normal_z = axis == 2 ? (dir[2] > 0 ? -1 : 1) : 0;
+                hit->distance = t;
+                hit->block = chunk_get_block (chunk, x, y, z);
+            }
+            return TRUE;
+        }
+
+        /* Step to the next cell */
+        gint64 cell_start[3];
+        gdouble t_next = G_MAXDOUBLE;
+        for (int i = 0; i < 3; i++) {
+            cell_start[i] = voxel[i] & ~(cell_size - 1);
+            if (dir[i] == 0)
+                continue;
+            gint64 boundary = dir[i] > 0 ? cell_start[i] + cell_size : cell_start[i];
+            gdouble t_boundary = (boundary - origin[i]) * inv_dir[i];
+            if (t_boundary < t_next) {
+                t_next = t_boundary;
+                axis = i;
+            }
+        }
+        if (t_next >= t_end)
+            return FALSE;
+        t = MAX (t, t_next);
+
+        for (int i = 0; i < 3; i++) {
+            if (i == axis)
+                voxel[i] = dir[i] > 0 ? cell_start[i] + cell_size : cell_start[i] - 1;
+            else
+                voxel[i] = CLAMP ((gint64) floor (origin[i] + t * dir[i]), cell_start[i], MIN (cell_start[i] + cell_size, size[i]) - 1);
+        }
+        if (voxel[axis] < 0 || voxel[axis] >= size[axis])
+            return FALSE;
+    }
+}
+
+/* Get the range of motion in which a moving box overlaps a cell.
+ * Returns the axis the cell is entered on, or -1 if it never overlaps */
+static int
+sweep_cell (const gdouble *box_min,
+            const gdouble *box_max,
+            const gdouble *motion,
+            const gint64  *cell_min,
+            gint64         cell_size,
+            gdouble       *entry,
+            gdouble       *exit)
+{
+    int axis = 0;
+    *entry = -G_MAXDOUBLE;
+    *exit = G_MAXDOUBLE;
+    for (int i = 0; i < 3; i++) {
+        gdouble lower = cell_min[i], upper = cell_min[i] + cell_size;
+        if (motion[i] == 0) {
+            if (box_min[i] >= upper || box_max[i] <= lower)
+                return -1;
+            continue;
+        }
+
+        gdouble t0 = (lower - box_max[i]) / motion[i];
+        gdouble t1 = (upper - box_min[i]) / motion[i];
+        if (t0 > t1) {
+            gdouble temp = t0;
+            t0 = t1;
+            t1 = temp;
+        }
+        if (t0 > *entry) {
+            *entry = t0;
+            axis = i;
+        }
+        if (t1 < *exit)
+            *exit = t1;
+    }
+
+    return *entry < *exit ? axis : -1;
+}
+
+typedef struct
+{
+    const gdouble  *box_min;
+    const gdouble  *box_max;
+    const gdouble  *motion;
+    gint64          start[3];
+    gint64          end[3];
+    PvMapCollision *collision;
+} Sweep;
+
+/* Check if a cell is touched by the swept box before the nearest collision so far */
+static gboolean
+sweep_touches (Sweep        *sweep,
+               const gint64 *cell_min,
+               gint64        cell_size)
+{
+    gdouble entry, exit;
+    if (sweep_cell (sweep->box_min, sweep->box_max, sweep->motion, cell_min, cell_size, &entry, &exit) < 0)
+        return FALSE;
+    return exit > 0 && entry <= sweep->collision->time;
+}
+
+static void
+sweep_block (Sweep        *sweep,
+             const gint64 *block)
+{
+    gdouble entry, exit;
+    int axis = sweep_cell (sweep->box_min, sweep->box_max, sweep->motion, block, 1, &entry, &exit);
+
+    /* Ignore blocks that already overlap so the box can move out of them */
+    if (axis < 0 || entry < 0 || entry >= sweep->collision->time)
+        return;
+
+    sweep->collision->time = entry;
+    sweep->collision->normal_x = axis == 0 ? (sweep->motion[0] > 0 ? -1 : 1) : 0;
+    sweep->collision->normal_y = axis == 1 ? (sweep->motion[1] > 0 ? -1 : 1) : 0;
+    sweep->collision->normal_z = axis == 2 ? (sweep->motion[2] > 0 ? -1 : 1) : 0;
+}
+
+static void
+sweep_brick (Sweep        *sweep,
+             Chunk        *chunk,
+             const gint64 *brick)
+{
+    gint64 chunk_origin[3] = { chunk->x * CHUNK_SIZE, chunk->y * CHUNK_SIZE, chunk->z * CHUNK_SIZE };
+    gint64 start[3], end[3];
+    for (int i = 0; i < 3; i++) {
+        start[i] = MAX (sweep->start[i], brick[i]);
+        end[i] = MIN (sweep->end[i], brick[i] + BRICK_SIZE);
+    }
+
+    for (gint64 z = start[2]; z < end[2]; z++)
+        for (gint64 y = start[1]; y < end[1]; y++) {
+            guint32 row = chunk_get_occupancy (chunk, y - chunk_origin[1], z - chunk_origin[2]);
+            for (gint64 x = start[0]; x < end[0]; x++) {
+                if (((row >> (x - chunk_origin[0])) & 1) == 0)
+                    continue;
+                gint64 block[3] = { x, y, z };
+                sweep_block (sweep, block);
+            }
+        }
+}
+
+/* Find the first point a box moving through the map touches a non-default block.
+ * The collision time is the fraction of the motion that can be completed */
+gboolean
+pv_map_sweep_box (PvMap          *self,
+                  const gdouble  *box_min,
+                  const gdouble  *box_max,
+                  const gdouble  *motion,
+                  PvMapCollision *collision)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), FALSE);
+
+    PvMapCollision result = { 1.0, 0, 0, 0 };
+    Sweep sweep = { box_min, box_max, motion, { 0 }, { 0 }, &result };
+
+    /* Get the blocks touched by the box over the whole motion */
+    gint64 size[3] = { self->width, self->height, self->depth };
+    for (int i = 0; i < 3; i++) {
+        gdouble lower = MIN (box_min[i], box_min[i] + motion[i]);
+        gdouble upper = MAX (box_max[i], box_max[i] + motion[i]);
+        sweep.start[i] = CLAMP ((gint64) floor (lower), 0, size[i]);
+        sweep.end[i] = CLAMP ((gint64) ceil (upper), 0, size[i]);
+        if (sweep.start[i] >= sweep.end[i])
+            return FALSE;
+    }
+
+    guint64 cx0 = sweep.start[0] >> CHUNK_SHIFT, cx1 = ((sweep.end[0] - 1) >> CHUNK_SHIFT) + 1;
+    guint64 cy0 = sweep.start[1] >> CHUNK_SHIFT, cy1 = ((sweep.end[1] - 1) >> CHUNK_SHIFT) + 1;
+    guint64 cz0 = sweep.start[2] >> CHUNK_SHIFT, cz1 = ((sweep.end[2] - 1) >> CHUNK_SHIFT) + 1;
+    decode_chunks (self, cx0, cy0, cz0, cx1 - cx0, cy1 - cy0, cz1 - cz0);
+
+    /* Only descend into chunks and bricks that the swept box passes through */
+    for (guint64 cz = cz0; cz < cz1; cz++)
+        for (guint64 cy = cy0; cy < cy1; cy++)
+            for (guint64 cx = cx0; cx < cx1; cx++) {
+                Chunk uniform;
+                Chunk *chunk = lookup_chunk (self, cx, cy, cz, &uniform);
+                gint64 chunk_min[3] = { cx * CHUNK_SIZE, cy * CHUNK_SIZE, cz * CHUNK_SIZE };
+                if (chunk_is_empty (chunk) || !sweep_touches (&sweep, chunk_min, CHUNK_SIZE))
+                    continue;
+
+                gint64 start[3], end[3];
+                for (int i = 0; i < 3; i++) {
+                    start[i] = (MAX (sweep.start[i], chunk_min[i]) - chunk_min[i]) >> BRICK_SHIFT;
+                    end[i] = ((MIN (sweep.end[i], chunk_min[i] + CHUNK_SIZE) - chunk_min[i] - 1) >> BRICK_SHIFT) + 1;
+                }
+                for (gint64 bz = start[2]; bz < end[2]; bz++)
+                    for (gint64 by = start[1]; by < end[1]; by++)
+                        for (gint64 bx = start[0]; bx < end[0]; bx++) {
+                            if (!chunk_is_brick_occupied (chunk, bx << BRICK_SHIFT, by << BRICK_SHIFT, bz << BRICK_SHIFT))
+                                continue;
+                            gint64 brick[3] = { chunk_min[0] + (bx << BRICK_SHIFT), chunk_min[1] + (by << BRICK_SHIFT), chunk_min[2] + (bz << BRICK_SHIFT) };
+                            if (sweep_touches (&sweep, brick, BRICK_SIZE))
+                                sweep_brick (&sweep, chunk, brick);
+                        }
+            }
+
+    if (result.time >= 1.0)
+        return FALSE;
+
+    if (collision != NULL)
+        *collision = result;
+    return TRUE;
+}
+
+void
+pv_map_set_block (PvMap  *self,
+                  guint64 x,
+                  guint64 y,
+                  guint64 z,
+                  guint16 block)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (x < self->width && y < self->height && z < self->depth);
+    pv_map_set_blocks (self, x, y, z, 1, 1, 1, &block);
+}
+
+void
+pv_map_set_blocks (PvMap         *self,
+                   guint64        set_x,
+                   guint64        set_y,
+                   guint64        set_z,
+                   guint64        set_width,
+                   guint64        set_height,
+                   guint64        set_depth,
+                   const guint16 *set_blocks)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (!self->read_only);
+    g_return_if_fail (set_x <= self->width && set_width <= self->width - set_x);
+    g_return_if_fail (set_y <= self->height && set_height <= self->height - set_y);
+    g_return_if_fail (set_z <= self->depth && set_depth <= self->depth - set_z);
+
+    if (set_width == 0 || set_height == 0 || set_depth == 0)
+        return;
+
+    guint64 cx0 = set_x >> CHUNK_SHIFT;
+    guint64 cx1 = ((set_x + set_width - 1) >> CHUNK_SHIFT) + 1;
+    guint64 cy0 = set_y >> CHUNK_SHIFT;
+    guint64 cy1 = ((set_y + set_height - 1) >> CHUNK_SHIFT) + 1;
+    guint64 cz0 = set_z >> CHUNK_SHIFT;
+    guint64 cz1 = ((set_z + set_depth - 1) >> CHUNK_SHIFT) + 1;
+    decode_chunks (self, cx0, cy0, cz0, cx1 - cx0, cy1 - cy0, cz1 - cz0);
+
+    for (guint64 cz = cz0; cz < cz1; cz++)
+        for (guint64 cy = cy0; cy < cy1; cy++)
+            for (guint64 cx = cx0; cx < cx1; cx++) {
+                Chunk *chunk = lookup_writable_chunk (self, cx, cy, cz);
+
+                /* Get overlapping area */
+                guint64 x0 = MAX (set_x, cx * CHUNK_SIZE);
+                guint64 x1 = MIN (set_x + set_width, (cx + 1) * CHUNK_SIZE);
+                guint64 y0 = MAX (set_y, cy * CHUNK_SIZE);
+                guint64 y1 = MIN (set_y + set_height, (cy + 1) * CHUNK_SIZE);
+                guint64 z0 = MAX (set_z, cz * CHUNK_SIZE);
+                guint64 z1 = MIN (set_z + set_depth, (cz + 1) * CHUNK_SIZE);
+
+                guint16 *blocks = chunk_get_writable_blocks (chunk);
+                for (guint64 z = z0; z < z1; z++)
+                    for (guint64 y = y0; y < y1; y++) {
+                        const guint16 *row = set_blocks + ((z - set_z) * set_height + (y - set_y)) * set_width + (x0 - set_x);
+                        memcpy (blocks + (((z & CHUNK_MASK) * CHUNK_SIZE) + (y & CHUNK_MASK)) * CHUNK_SIZE + (x0 & CHUNK_MASK), row, sizeof (guint16) * (x1 - x0));
+                    }
+
+                /* Only update the rows that changed, encoding is left until the chunk is next read or saved */
+                chunk_update_occupancy_rows (chunk, y0 & CHUNK_MASK, z0 & CHUNK_MASK, ((y1 - 1) & CHUNK_MASK) + 1, ((z1 - 1) & CHUNK_MASK) + 1);
+                g_clear_pointer (&chunk->sums, g_atomic_rc_box_release);
+                chunk->hash_valid = FALSE;
+                chunk->edited = TRUE;
+                if (!chunk->pending) {
+                    chunk->pending = TRUE;
+                    g_ptr_array_add (self->pending_chunks, chunk);
+                }
+            }
+    invalidate_hashes (self, cx0, cy0, cz0, cx1, cy1, cz1);
+    if (self->pending_chunks->len > MAX_PENDING_CHUNKS)
+        flush_pending_chunks (self);
+
+    /* Report whole chunks so nearby edits merge, but only the part inside the map */
+    PvMapRegion region = { cx0 * CHUNK_SIZE, cy0 * CHUNK_SIZE, cz0 * CHUNK_SIZE,
+                           MIN (cx1 * CHUNK_SIZE, self->width) - cx0 * CHUNK_SIZE,
+                           MIN (cy1 * CHUNK_SIZE, self->height) - cy0 * CHUNK_SIZE,
+                           MIN (cz1 * CHUNK_SIZE, self->depth) - cz0 * CHUNK_SIZE };
+    add_changed_region (self, &region);
+    emit_changed (self);
+}
+
+void
+pv_map_freeze_changes (PvMap *self)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    self->changes_freeze_count++;
+}
+
+void
+pv_map_thaw_changes (PvMap *self)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+    g_return_if_fail (self->changes_freeze_count > 0);
+
+    self->changes_freeze_count--;
+    if (self->changes_freeze_count == 0)
+        flush_pending_chunks (self);
+    emit_changed (self);
+}
+
+/* Copy the blocks in a chunk that are inside region */
+static void
+copy_chunk (Chunk             *chunk,
+            guint16           *buffer,
+            const PvMapRegion *region,
+            guint16           *fill_blocks)
+{
+    /* Get overlapping area */
+    guint64 x0 = MAX (region->x, chunk->x * CHUNK_SIZE);
+    guint64 x1 = MIN (region->x + region->width, (chunk->x + 1) * CHUNK_SIZE);
+    guint64 y0 = MAX (region->y, chunk->y * CHUNK_SIZE);
+    guint64 y1 = MIN (region->y + region->height, (chunk->y + 1) * CHUNK_SIZE);
+    guint64 z0 = MAX (region->z, chunk->z * CHUNK_SIZE);
+    guint64 z1 = MIN (region->z + region->depth, (chunk->z + 1) * CHUNK_SIZE);
+
+    /* Read thin slices of encoded chunks a block at a time rather than decoding the whole chunk */
+    if (chunk->blocks == NULL && !chunk_is_uniform (chunk) &&
+        (x1 - x0) * (y1 - y0) * (z1 - z0) <= CHUNK_SIZE * CHUNK_SIZE) {
+        for (guint64 z = z0; z < z1; z++)
+            for (guint64 y = y0; y < y1; y++) {
+                guint16 *row = fill_blocks + ((z - region->z) * region->height + (y - region->y)) * region->width - region->x;
+                for (guint64 x = x0; x < x1; x++)
+                    row[x] = chunk_get_block (chunk, x & CHUNK_MASK, y & CHUNK_MASK, z & CHUNK_MASK);
+            }
+        return;
+    }
+
+    guint16 block;
+    const guint16 *blocks = chunk_get_blocks (chunk, buffer, &block);
+    for (guint64 z = z0; z < z1; z++)
+        for (guint64 y = y0; y < y1; y++) {
+            guint16 *row = fill_blocks + ((z - region->z) * region->height + (y - region->y)) * region->width + (x0 - region->x);
+            if (blocks == NULL)
+                fill_span (row, block, x1 - x0);
+            else
+                memcpy (row, blocks + (((z & CHUNK_MASK) * CHUNK_SIZE) + (y & CHUNK_MASK)) * CHUNK_SIZE + (x0 & CHUNK_MASK), sizeof (guint16) * (x1 - x0));
+        }
+}
+
+/* Tracks when all the rows in a pv_map_get_blocks request are complete */
+typedef struct
+{
+    GMutex             mutex;
+    GCond              cond;
+    guint64            n_remaining;
+} RowContext;
+
+/* Row of chunks being decoded and copied by a worker thread */
+typedef struct
+{
+    PvMap             *map;
+    const PvMapRegion *region;
+    guint16           *blocks;
+    RowContext        *context;
+
+    /* Chunks in the row, and the ones that need decoding */
+    Chunk            **chunks;
+    ChunkGrid          grid;
+    GArray            *area_ids;
+    DecodeCache       *cache;
+} RowJob;
+
+static void
+row_job_run (RowJob  *job,
+             gpointer user_data)
+{
+    /* Areas are applied in order, as when decoding on a single thread */
+    if (job->area_ids != NULL) {
+        for (guint i = 0; i < job->area_ids->len; i++)
+            apply_area (job->map, get_area (job->map, g_array_index (job->area_ids, guint, i)), &job->grid, job->cache);
+        for (guint64 i = 0; i < job->grid.width; i++)
+            if (job->grid.chunks[i] != NULL)
+                chunk_compact (job->map, job->grid.chunks[i]);
+    }
+
+    g_autofree guint16 *buffer = chunk_buffer_new (job->map);
+    for (guint64 i = 0; i < job->grid.width; i++)
+        copy_chunk (job->chunks[i], buffer, job->region, job->blocks);
+
+    g_mutex_lock (&job->context->mutex);
+    job->context->n_remaining--;
+    if (job->context->n_remaining == 0)
+        g_cond_signal (&job->context->cond);
+    g_mutex_unlock (&job->context->mutex);
+}
+
+/* Decode and copy a large region with a worker for each row of chunks */
+static void
+get_blocks_parallel (PvMap             *self,
+                     const PvMapRegion *region,
+                     guint16           *fill_blocks)
+{
+    guint64 cx0 = region->x >> CHUNK_SHIFT;
+    guint64 cx1 = ((region->x + region->width - 1) >> CHUNK_SHIFT) + 1;
+    guint64 cy0 = region->y >> CHUNK_SHIFT;
+    guint64 cy1 = ((region->y + region->height - 1) >> CHUNK_SHIFT) + 1;
+    guint64 cz0 = region->z >> CHUNK_SHIFT;
+    guint64 cz1 = ((region->z + region->depth - 1) >> CHUNK_SHIFT) + 1;
+    guint64 row_size = cx1 - cx0;
+    guint64 n_rows = (cy1 - cy0) * (cz1 - cz0);
+
+    RowContext context;
+    g_mutex_init (&context.mutex);
+    g_cond_init (&context.cond);
+    context.n_remaining = n_rows;
+
+    /* The chunk table and area index are only accessed from this thread */
+    g_autofree Chunk **chunks = g_new0 (Chunk *, row_size * n_rows);
+    g_autofree Chunk **new_chunks = g_new0 (Chunk *, row_size * n_rows);
+    g_autofree Chunk *uniform_chunks = g_new (Chunk, row_size * n_rows);
+    g_autofree RowJob *jobs = g_new0 (RowJob, n_rows);
+    DecodeCache cache;
+    decode_cache_init (&cache);
+    guint64 j = 0;
+    for (guint64 cz = cz0; cz < cz1; cz++)
+        for (guint64 cy = cy0; cy < cy1; cy++, j++) {
+            RowJob *job = &jobs[j];
+            job->map = self;
+            job->region = region;
+            job->blocks = fill_blocks;
+            job->context = &context;
+            job->cache = &cache;
+            job->chunks = chunks + j * row_size;
+            ChunkGrid grid = { cx0, cy, cz, row_size, 1, 1, new_chunks + j * row_size };
+            job->grid = grid;
+
+            gboolean have_missing = FALSE;
+            for (guint64 cx = cx0; cx < cx1; cx++) {
+                gsize i = j * row_size + (cx - cx0);
+                chunks[i] = lookup_chunk (self, cx, cy, cz, &uniform_chunks[i]);
+                if (chunks[i] == NULL) {
+                    chunks[i] = new_chunks[i] = chunk_new (cx, cy, cz);
+                    have_missing = TRUE;
+                }
+            }
+            if (have_missing) {
+                job->area_ids = g_array_new (FALSE, FALSE, sizeof (guint));
+                pv_area_index_query (self->area_index,
+                                     cx0 * CHUNK_SIZE, cy * CHUNK_SIZE, cz * CHUNK_SIZE,
+                                     row_size * CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE,
+                                     job->area_ids);
+            }
+        }
+
+    if (self->row_pool == NULL) {
+        guint n_threads = MAX (g_get_num_processors (), 1);
+        self->row_pool = g_thread_pool_new ((GFunc) row_job_run, NULL, n_threads, FALSE, NULL);
+    }
+    for (j = 0; j < n_rows; j++)
+        g_thread_pool_push (self->row_pool, &jobs[j], NULL);
+
+    g_mutex_lock (&context.mutex);
+    while (context.n_remaining > 0)
+        g_cond_wait (&context.cond, &context.mutex);
+    g_mutex_unlock (&context.mutex);
+    g_mutex_clear (&context.mutex);
+    g_cond_clear (&context.cond);
+    decode_cache_clear (&cache);
+
+    for (j = 0; j < n_rows; j++)
+        g_clear_pointer (&jobs[j].area_ids, g_array_unref);
+    for (gsize i = 0; i < row_size * n_rows; i++)
+        if (new_chunks[i] != NULL)
+            add_chunk (self, new_chunks[i]);
+}
+
+void
+pv_map_get_blocks (PvMap   *self,
+                   guint64  fill_x,
+                   guint64  fill_y,
+                   guint64  fill_z,
+                   guint64  fill_width,
+                   guint64  fill_height,
+                   guint64  fill_depth,
+                   guint16 *fill_blocks)
+{
+    g_return_if_fail (PV_IS_MAP (self));
+
+    if (fill_width == 0 || fill_height == 0 || fill_depth == 0)
+        return;
+
+    flush_pending_chunks (self);
+
+    PvMapRegion region = { fill_x, fill_y, fill_z, fill_width, fill_height, fill_depth };
+    guint64 cx0 = fill_x >> CHUNK_SHIFT;
+    guint64 cx1 = ((fill_x + fill_width - 1) >> CHUNK_SHIFT) + 1;
+    guint64 cy0 = fill_y >> CHUNK_SHIFT;
+    guint64 cy1 = ((fill_y + fill_height - 1) >> CHUNK_SHIFT) + 1;
+    guint64 cz0 = fill_z >> CHUNK_SHIFT;
+    guint64 cz1 = ((fill_z + fill_depth - 1) >> CHUNK_SHIFT) + 1;
+
+    if ((cy1 - cy0) * (cz1 - cz0) > 1 && region_volume (&region) >= PARALLEL_GET_BLOCKS_VOLUME) {
+        get_blocks_parallel (self, &region, fill_blocks);
+        return;
+    }
+
+    decode_chunks (self, cx0, cy0, cz0, cx1 - cx0, cy1 - cy0, cz1 - cz0);
+
+    g_autofree guint16 *buffer = chunk_buffer_new (self);
+    for (guint64 cz = cz0; cz < cz1; cz++)
+        for (guint64 cy = cy0; cy < cy1; cy++)
+            for (guint64 cx = cx0; cx < cx1; cx++) {
+                Chunk uniform;
+                copy_chunk (lookup_chunk (self, cx, cy, cz, &uniform), buffer, &region, fill_blocks);
+            }
+}
+
+/* Create the hash tree levels, with all nodes needing to be calculated */
+static void
+build_hash_levels (PvMap *self)
+{
+    if (self->hash_levels != NULL)
+        return;
+
+    self->hash_levels = g_array_new (FALSE, FALSE, sizeof (HashLevel));
+    g_array_set_clear_func (self->hash_levels, (GDestroyNotify) hash_level_clear);
+    guint64 width = (self->width + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    guint64 height = (self->height + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    guint64 depth = (self->depth + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    while (width > 1 || height > 1 || depth > 1) {
+        HashLevel level;
+        level.width = (width + 1) >> 1;
+        level.height = (height + 1) >> 1;
+        level.depth = (depth + 1) >> 1;
+        gsize n_nodes = level.width * level.height * level.depth;
+        level.hashes = g_new0 (guint64, n_nodes);
+        level.valid = g_new0 (gboolean, n_nodes);
+        g_array_append_val (self->hash_levels, level);
+        width = level.width;
+        height = level.height;
+        depth = level.depth;
+    }
+}
+
+/* Get the hash of a node in the tree, level 0 being the chunks. Nodes outside the map have a hash of 0 */
+static guint64
+get_node_hash (PvMap   *self,
+               guint    level,
+               guint64  x,
+               guint64  y,
+               guint64  z,
+               guint16 *buffer)
+{
+    if (level == 0) {
+        if (x >= (self->width + CHUNK_SIZE - 1) >> CHUNK_SHIFT ||
+            y >= (self->height + CHUNK_SIZE - 1) >> CHUNK_SHIFT ||
+            z >= (self->depth + CHUNK_SIZE - 1) >> CHUNK_SHIFT)
+            return 0;
+        Chunk uniform;
+        Chunk *chunk = lookup_chunk (self, x, y, z, &uniform);
+        if (chunk == NULL)
+            return get_empty_hash ();
+        if (!chunk->hash_valid) {
+            guint16 block;
+            const guint16 *blocks = chunk_get_blocks (chunk, buffer, &block);
+            if (blocks != NULL)
+                chunk->hash = get_blocks_hash (blocks);
+            else if (block == 0)
+                chunk->hash = get_empty_hash ();
+            else {
+                fill_span (buffer, block, CHUNK_VOXELS);
+                chunk->hash = get_blocks_hash (buffer);
+            }
+            chunk->hash_valid = TRUE;
+        }
+        return chunk->hash;
+    }
+
+    HashLevel *l = &g_array_index (self->hash_levels, HashLevel, level - 1);
+    if (x >= l->width || y >= l->height || z >= l->depth)
+        return 0;
+
+    gsize index = (z * l->height + y) * l->width + x;
+    if (!l->valid[index]) {
+        guint64 children[8];
+        for (int i = 0; i < 8; i++)
+            children[i] = get_node_hash (self, level - 1, x * 2 + (i & 1), y * 2 + ((i >> 1) & 1), z * 2 + (i >> 2), buffer);
+        l->hashes[index] = pv_xxhash64 (children, sizeof (children), level);
+        l->valid[index] = TRUE;
+    }
+
+    return l->hashes[index];
+}
+
+#define PATCH_MAGIC "PvPt"
+
+/* Encodings for the blocks of a chunk in a patch */
+typedef enum
+{
+    PATCH_CHUNK_FILL,
+    PATCH_CHUNK_RLE,
+    PATCH_CHUNK_RASTER16,
+} PatchChunkType;
+
+/* Write the blocks of a chunk to a patch using the smallest encoding */
+static void
+append_patch_chunk (GByteArray *patch,
+                    Chunk      *chunk,
+                    guint16    *buffer)
+{
+    append_uint64 (patch, chunk->x);
+    append_uint64 (patch, chunk->y);
+    append_uint64 (patch, chunk->z);
+
+    guint16 block;
+    const guint16 *blocks = chunk_get_blocks (chunk, buffer, &block);
+    if (blocks != NULL && is_uniform (blocks)) {
+        block = blocks[0];
+        blocks = NULL;
+    }
+    if (blocks == NULL) {
+        append_uint8 (patch, PATCH_CHUNK_FILL);
+        append_uint16 (patch, block);
+        return;
+    }
+
+    /* Runs are stored as a base 128 length followed by the block, as in RLE areas */
+    g_autoptr(GByteArray) rle = g_byte_array_new ();
+    for (gsize offset = 0; offset < CHUNK_VOXELS && rle->len < sizeof (guint16) * CHUNK_VOXELS;) {
+        gsize run_length = 1;
+        while (offset + run_length < CHUNK_VOXELS && blocks[offset + run_length] == blocks[offset])
+            run_length++;
+        append_varint (rle, run_length);
+        append_uint16 (rle, blocks[offset]);
+        offset += run_length;
+    }
+    if (rle->len < sizeof (guint16) * CHUNK_VOXELS) {
+        append_uint8 (patch, PATCH_CHUNK_RLE);
+        append_uint32 (patch, rle->len);
+        g_byte_array_append (patch, rle->data, rle->len);
+        return;
+    }
+
+    append_uint8 (patch, PATCH_CHUNK_RASTER16);
+    for (gsize i = 0; i < CHUNK_VOXELS; i++)
+        append_uint16 (patch, blocks[i]);
+}
+
+/* Compare the hashes of two nodes, recursing into children until the chunks that differ are found */
+static void
+diff_node (PvMap      *self,
+           PvMap      *other,
+           guint       level,
+           guint64     x,
+           guint64     y,
+           guint64     z,
+           guint16    *buffer,
+           GByteArray *patch)
+{
+    if (get_node_hash (self, level, x, y, z, buffer) == get_node_hash (other, level, x, y, z, buffer))
+        return;
+
+    if (level == 0) {
+        Chunk uniform;
+        append_patch_chunk (patch, lookup_chunk (other, x, y, z, &uniform), buffer);
+        return;
+    }
+
+    for (int i = 0; i < 8; i++)
+        diff_node (self, other, level - 1, x * 2 + (i & 1), y * 2 + ((i >> 1) & 1), z * 2 + (i >> 2), buffer, patch);
+}
+
+/* Generate a patch that changes the blocks in map to match other.
+ * The first diff decodes both maps and hashes every chunk, later ones only hash the chunks that have changed.
+ * The patch includes the block types of other and only applies to a map with the same types, or the first of them */
+GBytes *
+pv_map_diff (PvMap *self,
+             PvMap *other)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), NULL);
+    g_return_val_if_fail (PV_IS_MAP (other), NULL);
+    g_return_val_if_fail (self->width == other->width && self->height == other->height && self->depth == other->depth, NULL);
+
+    guint64 chunks_width = (self->width + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    guint64 chunks_height = (self->height + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    guint64 chunks_depth = (self->depth + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    decode_chunks (self, 0, 0, 0, chunks_width, chunks_height, chunks_depth);
+    decode_chunks (other, 0, 0, 0, chunks_width, chunks_height, chunks_depth);
+    build_hash_levels (self);
+    build_hash_levels (other);
+
+    GByteArray *patch = g_byte_array_new ();
+    g_byte_array_append (patch, (const guint8 *) PATCH_MAGIC, 4);
+    append_uint64 (patch, self->width);
+    append_uint64 (patch, self->height);
+    append_uint64 (patch, self->depth);
+    append_block_types (patch, other->blocks);
+    g_autofree guint16 *buffer = g_new (guint16, CHUNK_VOXELS);
+    diff_node (self, other, self->hash_levels->len, 0, 0, 0, buffer, patch);
+
+    return g_byte_array_free_to_bytes (patch);
+}
+
+/* Read a chunk from a patch, decoding its blocks if blocks is not NULL */
+static gboolean
+read_patch_chunk (PvMap         *self,
+                  const guint8  *data,
+                  gsize          length,
+                  gsize         *offset,
+                  guint64       *x,
+                  guint64       *y,
+                  guint64       *z,
+                  guint16       *blocks,
+                  GError       **error)
+{
+    guint64 type, value;
+    if (!read_uint (data, length, offset, 8, x) ||
+        !read_uint (data, length, offset, 8, y) ||
+        !read_uint (data, length, offset, 8, z) ||
+        !read_uint (data, length, offset, 1, &type)) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough data");
+        return FALSE;
+    }
+    if (*x >= (self->width + CHUNK_SIZE - 1) >> CHUNK_SHIFT ||
+        *y >= (self->height + CHUNK_SIZE - 1) >> CHUNK_SHIFT ||
+        *z >= (self->depth + CHUNK_SIZE - 1) >> CHUNK_SHIFT) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Chunk %" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT " is outside the map", *x, *y, *z);
+        return FALSE;
+    }
+
+    switch (type) {
+    case PATCH_CHUNK_FILL:
+        if (!read_uint (data, length, offset, 2, &value)) {
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough data");
+            return FALSE;
+        }
+        if (blocks != NULL)
+            fill_span (blocks, value, CHUNK_VOXELS);
+        return TRUE;
+    case PATCH_CHUNK_RLE:
+        if (!read_uint (data, length, offset, 4, &value) || length - *offset < value) {
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough data");
+            return FALSE;
+        }
+        gsize end = *offset + value, n_blocks = 0;
+        while (*offset < end) {
+            guint64 run_length, block;
+            if (!read_varint (data, end, offset, &run_length) ||
+                !read_uint (data, end, offset, 2, &block) ||
+                run_length > CHUNK_VOXELS - n_blocks)
+                break;
+            if (blocks != NULL)
+                fill_span (blocks + n_blocks, block, run_length);
+            n_blocks += run_length;
+        }
+        if (n_blocks != CHUNK_VOXELS || *offset != end) {
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Invalid RLE data");
+            return FALSE;
+        }
+        return TRUE;
+    case PATCH_CHUNK_RASTER16:
+        if (length - *offset < sizeof (guint16) * CHUNK_VOXELS) {
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough data");
+            return FALSE;
+        }
+        if (blocks != NULL)
+            copy_blocks16 (blocks, data + *offset, CHUNK_VOXELS);
+        *offset += sizeof (guint16) * CHUNK_VOXELS;
+        return TRUE;
+    default:
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown chunk encoding %" G_GUINT64_FORMAT, type);
+        return FALSE;
+    }
+}
+
+/* Apply a patch generated by pv_map_diff, the map is unchanged if the patch is invalid */
+gboolean
+pv_map_apply_patch (PvMap   *self,
+                    GBytes  *patch,
+                    GError **error)
+{
+    g_return_val_if_fail (PV_IS_MAP (self), FALSE);
+    g_return_val_if_fail (!self->read_only, FALSE);
+
+    gsize length;
+    const guint8 *data = g_bytes_get_data (patch, &length);
+    gsize offset = strlen (PATCH_MAGIC);
+    guint64 width, height, depth;
+    if (length < offset || memcmp (data, PATCH_MAGIC, offset) != 0 ||
+        !read_uint (data, length, &offset, 8, &width) ||
+        !read_uint (data, length, &offset, 8, &height) ||
+        !read_uint (data, length, &offset, 8, &depth)) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Not a Pivox map patch");
+        return FALSE;
+    }
+    if (width != self->width || height != self->height || depth != self->depth) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Patch is for a %" G_GUINT64_FORMAT "x%" G_GUINT64_FORMAT "x%" G_GUINT64_FORMAT " map", width, height, depth);
+        return FALSE;
+    }
+
+    /* Block ids only mean the same thing if the map has the same block types, though the patch may add new ones */
+    guint64 n_blocks;
+    if (!read_varint (data, length, &offset, &n_blocks) || n_blocks > G_MAXUINT16 + 1) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough data");
+        return FALSE;
+    }
+    g_autoptr(GArray) blocks = g_array_new (FALSE, TRUE, sizeof (BlockType));
+    g_array_set_clear_func (blocks, (GDestroyNotify) block_type_clear);
+    for (guint64 i = 0; i < n_blocks; i++) {
+        BlockType block;
+        if (!read_block_type (data, length, &offset, &block)) {
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough data");
+            return FALSE;
+        }
+        g_array_append_val (blocks, block);
+    }
+    gboolean blocks_match = blocks->len >= self->blocks->len;
+    for (guint i = 0; i < self->blocks->len && blocks_match; i++) {
+        BlockType *a = &g_array_index (self->blocks, BlockType, i), *b = &g_array_index (blocks, BlockType, i);
+        if (g_strcmp0 (a->name, b->name) != 0 || a->red != b->red || a->green != b->green || a->blue != b->blue)
+            blocks_match = FALSE;
+    }
+    if (!blocks_match) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Patch is for a map with different block types");
+        return FALSE;
+    }
+
+    /* Check the whole patch before making any changes */
+    gsize chunks_offset = offset;
+    while (offset < length) {
+        guint64 cx, cy, cz;
+        if (!read_patch_chunk (self, data, length, &offset, &cx, &cy, &cz, NULL, error))
+            return FALSE;
+    }
+
+    for (guint i = self->blocks->len; i < blocks->len; i++) {
+        BlockType block = g_array_index (blocks, BlockType, i);
+        block.name = g_strdup (block.name);
+        g_array_append_val (self->blocks, block);
+    }
+
+    g_autofree guint16 *chunk_blocks = g_new (guint16, CHUNK_VOXELS);
+    pv_map_freeze_changes (self);
+    for (offset = chunks_offset; offset < length;) {
+        guint64 cx, cy, cz;
+        read_patch_chunk (self, data, length, &offset, &cx, &cy, &cz, chunk_blocks, NULL);
+
+        /* Pack the rows inside the map together */
+        guint64 x = cx * CHUNK_SIZE, y = cy * CHUNK_SIZE, z = cz * CHUNK_SIZE;
+        guint64 w = MIN (self->width - x, CHUNK_SIZE);
+        guint64 h = MIN (self->height - y, CHUNK_SIZE);
+        guint64 d = MIN (self->depth - z, CHUNK_SIZE);
+        for (guint64 bz = 0; bz < d; bz++)
+            for (guint64 by = 0; by < h; by++)
+                memmove (chunk_blocks + (bz * h + by) * w, chunk_blocks + (bz * CHUNK_SIZE + by) * CHUNK_SIZE, sizeof (guint16) * w);
+        pv_map_set_blocks (self, x, y, z, w, h, d, chunk_blocks);
+    }
+    pv_map_thaw_changes (self);
+
+    return TRUE;
 }
@@ -14,18 +14,152 @@
 
 G_DECLARE_FINAL_TYPE (PvMap, pv_map, PV, MAP, GObject)
 
+/* Blocks passed to PvMapChunkFunc are in a cube of this size */
+#define PV_MAP_CHUNK_SIZE 32
+
+/* Chunks are split into bricks of this size for pv_map_get_chunk_occupancy */
+#define PV_MAP_BRICK_SIZE 4
+
+typedef enum
+{
+    PV_MAP_COMPRESSION_NONE,
+    PV_MAP_COMPRESSION_DEFLATE,
+    PV_MAP_COMPRESSION_LZ4,
+} PvMapCompression;
+
+typedef enum
+{
+    PV_MAP_STORAGE_DENSE,
+    PV_MAP_STORAGE_DAG,
+    PV_MAP_STORAGE_PALETTE,
+} PvMapStorage;
+
+typedef struct
+{
+    guint64 x;
+    guint64 y;
+    guint64 z;
+    guint64 width;
+    guint64 height;
+    guint64 depth;
+} PvMapRegion;
+
+typedef struct
+{
+    guint64 x;
+    guint64 y;
+    guint64 z;
+    gint    normal_x;
+    gint    normal_y;
+    gint    normal_z;
+    gdouble distance;
+    guint16 block;
+} PvMapRaycastHit;
+
+typedef struct
+{
+    gdouble time;
+    gint    normal_x;
+    gint    normal_y;
+    gint    normal_z;
+} PvMapCollision;
+
+typedef struct
+{
+    guint   n_areas_before;
+    guint   n_areas_after;
+
+    /* Size of the area data stored in memory */
+    guint64 data_size_before;
+    guint64 data_size_after;
+
+    /* Average number of areas that overlap each chunk. This is a proxy for the
+     * time taken to decode the map, the areas aren't actually decoded */
+    gdouble areas_per_chunk_before;
+    gdouble areas_per_chunk_after;
+} PvMapCompactStats;
+
+typedef enum
+{
+    PV_MAP_CHUNK_FLAGS_NONE         = 0,
+    PV_MAP_CHUNK_FLAGS_SKIP_EMPTY   = 1 << 0,
+    PV_MAP_CHUNK_FLAGS_SKIP_UNIFORM = 1 << 1,
+} PvMapChunkFlags;
+
+typedef void (*PvMapChunkFunc) (PvMap             *map,
+                                const PvMapRegion *region,
+                                const guint16     *blocks,
+                                gpointer           user_data);
+
 PvMap     *pv_map_new              (void);
 
+/* A snapshot is a read-only copy of the map that shares its data. A map must only be
+ * used from one thread at a time, but a snapshot can be read or saved on another thread
+ * while the original map continues to be modified */
+PvMap     *pv_map_snapshot         (PvMap         *map);
+
+/* Maps with a data table only read data blocks from the stream when they are first needed.
+ * The stream must stay open and not be read or seeked by anything else while the map or
+ * its snapshots exist. Blocks that then fail to read are left empty and reported by
+ * pv_map_get_read_error(). pv_map_load_async() reads the ones areas use before it completes */
 gboolean       pv_map_load             (PvMap         *map,
                                         GInputStream  *stream,
                                         GCancellable  *cancellable,
                                         GError       **error);
 
+void           pv_map_load_async       (PvMap               *map,
+                                        GInputStream        *stream,
+                                        GCancellable        *cancellable,
+                                        GAsyncReadyCallback  callback,
+                                        gpointer             user_data);
+
+gboolean       pv_map_load_finish      (PvMap         *map,
+                                        GAsyncResult  *result,
+                                        GError       **error);
+
+gboolean       pv_map_load_bytes       (PvMap         *map,
+                                        GBytes        *bytes,
+                                        GError       **error);
+
+void           pv_map_load_bytes_async (PvMap               *map,
+                                        GBytes              *bytes,
+                                        GCancellable        *cancellable,
+                                        GAsyncReadyCallback  callback,
+                                        gpointer             user_data);
+
+gboolean       pv_map_load_file        (PvMap         *map,
+                                        const gchar   *filename,
+                                        GError       **error);
+
+const GError  *pv_map_get_read_error   (PvMap         *map);
+
 gboolean       pv_map_save             (PvMap         *map,
                                         GOutputStream *stream,
                                         GCancellable  *cancellable,
                                         GError       **error);
 
+void           pv_map_save_async       (PvMap               *map,
+                                        GOutputStream       *stream,
+                                        GCancellable        *cancellable,
+                                        GAsyncReadyCallback  callback,
+                                        gpointer             user_data);
+
+gboolean       pv_map_save_finish      (PvMap         *map,
+                                        GAsyncResult  *result,
+                                        GError       **error);
+
+gboolean       pv_map_compact          (PvMap             *map,
+                                        PvMapCompactStats *stats,
+                                        GCancellable      *cancellable,
+                                        GError           **error);
+
+GBytes        *pv_map_diff             (PvMap         *map,
+                                        PvMap         *other);
+
+gboolean       pv_map_apply_patch      (PvMap         *map,
+                                        GBytes        *patch,
+                                        GError       **error);
+
 void           pv_map_set_width        (PvMap         *map,
                                         guint64        width);
 
@@ -61,6 +195,27 @@ void           pv_map_set_author_email (PvMap         *map,
 
 const gchar   *pv_map_get_author_email (PvMap         *map);
 
+void           pv_map_set_compression  (PvMap            *map,
+                                        PvMapCompression  compression);
+
+PvMapCompression
+               pv_map_get_compression  (PvMap         *map);
+
+void           pv_map_set_binary_header (PvMap        *map,
+                                         gboolean      enabled);
+
+gboolean       pv_map_get_binary_header (PvMap        *map);
+
+void           pv_map_set_storage      (PvMap         *map,
+                                        PvMapStorage   storage);
+
+PvMapStorage   pv_map_get_storage      (PvMap         *map);
+
+void           pv_map_set_summed_volumes (PvMap       *map,
+                                          gboolean     enabled);
+
+gboolean       pv_map_get_summed_volumes (PvMap       *map);
+
 guint          pv_map_add_block        (PvMap         *map,
                                         const gchar   *name,
                                         guint8         red,
@@ -87,6 +242,15 @@ void           pv_map_add_area_raster8 (PvMap         *self,
                                         guint64        depth,
                                         guint8        *blocks);
 
+void           pv_map_add_area_rle     (PvMap         *self,
+                                        guint64        x,
+                                        guint64        y,
+                                        guint64        z,
+                                        guint64        width,
+                                        guint64        height,
+                                        guint64        depth,
+                                        guint8        *blocks);
+
 void           pv_map_get_blocks       (PvMap         *map,
                                         guint64        x,
                                         guint64        y,
@@ -95,3 +259,70 @@ void           pv_map_get_blocks       (PvMap         *map,
                                         guint64        height,
                                         guint64        depth,
                                         guint16       *blocks);
+
+void           pv_map_foreach_chunk    (PvMap           *map,
+                                        PvMapChunkFlags  flags,
+                                        PvMapChunkFunc   func,
+                                        gpointer         user_data);
+
+void           pv_map_get_chunk_occupancy (PvMap      *map,
+                                           guint64     x,
+                                           guint64     y,
+                                           guint64     z,
+                                           guint64    *occupancy);
+
+gboolean       pv_map_is_empty         (PvMap         *map,
+                                        guint64        x,
+                                        guint64        y,
+                                        guint64        z,
+                                        guint64        width,
+                                        guint64        height,
+                                        guint64        depth);
+
+guint64        pv_map_count_occupied   (PvMap         *map,
+                                        guint64        x,
+                                        guint64        y,
+                                        guint64        z,
+                                        guint64        width,
+                                        guint64        height,
+                                        guint64        depth);
+
+guint64        pv_map_count_blocks     (PvMap         *map,
+                                        guint16        block,
+                                        guint64        x,
+                                        guint64        y,
+                                        guint64        z,
+                                        guint64        width,
+                                        guint64        height,
+                                        guint64        depth);
+
+gboolean       pv_map_raycast          (PvMap           *map,
+                                        const gdouble   *origin,
+                                        const gdouble   *direction,
+                                        gdouble          max_distance,
+                                        PvMapRaycastHit *hit);
+
+gboolean       pv_map_sweep_box        (PvMap           *map,
+                                        const gdouble   *box_min,
+                                        const gdouble   *box_max,
+                                        const gdouble   *motion,
+                                        PvMapCollision  *collision);
+
+void           pv_map_set_block        (PvMap         *map,
+                                        guint64        x,
+                                        guint64        y,
+                                        guint64        z,
+                                        guint16        block);
+
+void           pv_map_set_blocks       (PvMap         *map,
+                                        guint64        x,
+                                        guint64        y,
+                                        guint64        z,
+                                        guint64        width,
+                                        guint64        height,
+                                        guint64        depth,
+                                        const guint16 *blocks);
+
+void           pv_map_freeze_changes   (PvMap         *map);
+
+void           pv_map_thaw_changes     (PvMap         *map);
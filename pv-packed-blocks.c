@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2018 Robert Ancell
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version. See http://www.gnu.org/copyleft/gpl.html the full text of the
+ * license.
+ */
+
+#include <string.h>
+
+#include "pv-packed-blocks.h"
+
+/* Blocks stored as indexes into a palette of the block types used.
+ * Indexes are packed into 64 bit words using the smallest power of two number of bits,
+ * so an index never spans two words. */
+
+struct _PvPackedBlocks
+{
+    gint     ref_count;
+
+    gsize    length;
+
+    /* Bits per index is 1 << bits_shift, or 0 bits if the palette has one block */
+    guint    bits;
+    guint    bits_shift;
+
+    /* Block types in ascending order */
+    guint    palette_size;
+    guint16 *palette;
+
+    guint64  words[];
+};
+
+/* Number of bits needed for an index into a palette of this size */
+static guint
+get_bits_shift (guint palette_size)
+{
+    guint shift = 0;
+    while ((1u << (1u << shift)) < palette_size)
+        shift++;
+    return shift;
+}
+
+PvPackedBlocks *
+pv_packed_blocks_new (const guint16 *blocks,
+                      gsize          length)
+{
+    /* Find the blocks used, and the index of each in the palette from the count of lower blocks */
+    guint64 used[(G_MAXUINT16 + 1) / 64] = { 0 };
+    for (gsize i = 0; i < length; i++)
+        used[blocks[i] >> 6] |= G_GUINT64_CONSTANT (1) << (blocks[i] & 63);
+    guint16 rank[(G_MAXUINT16 + 1) / 64];
+    guint palette_size = 0;
+    for (gsize i = 0; i < G_N_ELEMENTS (used); i++) {
+        rank[i] = palette_size;
+        palette_size += __builtin_popcountll (used[i]);
+    }
+
+    guint bits_shift = get_bits_shift (palette_size);
+    guint bits = palette_size > 1 ? 1u << bits_shift : 0;
+    gsize n_words = bits > 0 ? (length * bits + 63) / 64 : 0;
+    PvPackedBlocks *packed = g_malloc (sizeof (PvPackedBlocks) + sizeof (guint64) * n_words + sizeof (guint16) * palette_size);
+    packed->ref_count = 1;
+    packed->length = length;
+    packed->bits = bits;
+    packed->bits_shift = bits_shift;
+    packed->palette_size = palette_size;
+    packed->palette = (guint16 *) (packed->words + n_words);
+
+    guint index = 0;
+    for (gsize i = 0; i < G_N_ELEMENTS (used); i++)
+        for (guint64 u = used[i]; u != 0; u &= u - 1)
+            packed->palette[index++] = i * 64 + __builtin_ctzll (u);
+
+    if (bits == 0)
+        return packed;
+
+    memset (packed->words, 0, sizeof (guint64) * n_words);
+    for (gsize i = 0; i < length; i++) {
+        guint16 block = blocks[i];
+        guint64 below = used[block >> 6] & ((G_GUINT64_CONSTANT (1) << (block & 63)) - 1);
+        guint64 value = rank[block >> 6] + __builtin_popcountll (below);
+        gsize bit = i << bits_shift;
+        packed->words[bit / 64] |= value << (bit % 64);
+    }
+
+    return packed;
+}
+
+PvPackedBlocks *
+pv_packed_blocks_ref (PvPackedBlocks *packed)
+{
+    g_atomic_int_inc (&packed->ref_count);
+    return packed;
+}
+
+void
+pv_packed_blocks_unref (PvPackedBlocks *packed)
+{
+    if (g_atomic_int_dec_and_test (&packed->ref_count))
+        g_free (packed);
+}
+
+void
+pv_packed_blocks_decode (PvPackedBlocks *packed,
+                         guint16        *blocks)
+{
+    if (packed->bits == 0) {
+        for (gsize i = 0; i < packed->length; i++)
+            blocks[i] = packed->palette[0];
+        return;
+    }
+
+    guint64 mask = (G_GUINT64_CONSTANT (1) << packed->bits) - 1;
+    gsize n_per_word = 64 >> packed->bits_shift;
+    for (gsize i = 0, w = 0; i < packed->length; w++) {
+        guint64 word = packed->words[w];
+        gsize n = MIN (n_per_word, packed->length - i);
+        for (gsize j = 0; j < n; j++) {
+            blocks[i++] = packed->palette[word & mask];
+            word >>= packed->bits;
+        }
+    }
+}
+
+guint16
+pv_packed_blocks_get_block (PvPackedBlocks *packed,
+                            gsize           index)
+{
+    if (packed->bits == 0)
+        return packed->palette[0];
+
+    gsize bit = index << packed->bits_shift;
+    guint64 mask = (G_GUINT64_CONSTANT (1) << packed->bits) - 1;
+    return packed->palette[(packed->words[bit / 64] >> (bit % 64)) & mask];
+}
+
+guint
+pv_packed_blocks_get_palette_size (PvPackedBlocks *packed)
+{
+    return packed->palette_size;
+}
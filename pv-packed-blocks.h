@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2018 Robert Ancell
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version. See http://www.gnu.org/copyleft/gpl.html the full text of the
+ * license.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef struct _PvPackedBlocks PvPackedBlocks;
+
+PvPackedBlocks *pv_packed_blocks_new              (const guint16  *blocks,
+                                                   gsize           length);
+
+PvPackedBlocks *pv_packed_blocks_ref              (PvPackedBlocks *packed);
+
+void            pv_packed_blocks_unref            (PvPackedBlocks *packed);
+
+void            pv_packed_blocks_decode           (PvPackedBlocks *packed,
+                                                   guint16        *blocks);
+
+guint16         pv_packed_blocks_get_block        (PvPackedBlocks *packed,
+                                                   gsize           index);
+
+guint           pv_packed_blocks_get_palette_size (PvPackedBlocks *packed);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PvPackedBlocks, pv_packed_blocks_unref)
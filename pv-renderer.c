@@ -14,18 +14,13 @@
 #include "pv-renderer.h"
 #include "pv-vector.h"
 
-struct _PvRenderer
+/* Triangles for one chunk of the map, so edits only regenerate the chunks they touch */
+typedef struct
 {
-    GObject   parent_instance;
-
-    gchar    *gl_renderer;
-
-    PvMap    *map;
-
-    PvCamera *camera;
-
-    GLuint    program;
     GLuint    vao;
+    GLuint    vertex_buffer;
+    GLuint    triangle_buffer;
+
     GLfloat   north;
     GLfloat   south;
     GLfloat   east;
@@ -44,6 +39,34 @@ struct _PvRenderer
     GLint     top_size;
     GLint     bottom_offset;
     GLint     bottom_size;
+} Mesh;
+
+struct _PvRenderer
+{
+    GObject   parent_instance;
+
+    gchar    *gl_renderer;
+
+    PvMap    *map;
+
+    PvCamera *camera;
+
+    GLuint    program;
+
+    /* Size of the map the meshes were generated from */
+    gsize     width;
+    gsize     height;
+    gsize     depth;
+
+    /* Mesh for each chunk of the map */
+    gsize     meshes_width;
+    gsize     meshes_height;
+    gsize     meshes_depth;
+    Mesh     *meshes;
+
+    /* TRUE if all the triangles need to be generated, otherwise the regions that have changed */
+    gboolean  map_changed;
+    GArray   *changed_regions;
 };
 
 G_DEFINE_TYPE (PvRenderer, pv_renderer, G_TYPE_OBJECT)
@@ -96,38 +119,131 @@ add_uint (GArray *vertices,
     g_array_append_val (vertices, value);
 }
 
+/* A chunk is meshed from its blocks and the blocks bordering it */
+#define BORDER_SIZE (PV_MAP_CHUNK_SIZE + 2)
+
+/* Blocks in and around a chunk, blocks outside the map are empty */
+typedef struct
+{
+    /* Position of the first block in the map, one block before the chunk */
+    gint64    x;
+    gint64    y;
+    gint64    z;
+    guint16   blocks[BORDER_SIZE * BORDER_SIZE * BORDER_SIZE];
+
+    /* Blocks read from the map, before they are placed in blocks */
+    guint16   region[BORDER_SIZE * BORDER_SIZE * BORDER_SIZE];
+} ChunkBlocks;
+
 static guint16
-get_block (gsize width, gsize height, gsize depth, guint16 *blocks, guint x, guint y, guint z)
+get_block (ChunkBlocks *blocks, gint64 x, gint64 y, gint64 z)
 {
-    if (x >= width || y >= height || z >= depth)
+    x -= blocks->x;
+    y -= blocks->y;
+    z -= blocks->z;
+    if (x < 0 || x >= BORDER_SIZE || y < 0 || y >= BORDER_SIZE || z < 0 || z >= BORDER_SIZE)
         return 0;
-    guint64 index = ((z * 16) + y) * 16 + x;
-    return blocks[index];
+    return blocks->blocks[((z * BORDER_SIZE) + y) * BORDER_SIZE + x];
+}
+
+/* Read the blocks from the map in a box, ignoring any part outside the map */
+static void
+read_blocks (PvRenderer  *self,
+             ChunkBlocks *blocks,
+             gint64       x0,
+             gint64       y0,
+             gint64       z0,
+             gint64       x1,
+             gint64       y1,
+             gint64       z1)
+{
+    x0 = MAX (x0, 0), x1 = MIN (x1, (gint64) self->width);
+    y0 = MAX (y0, 0), y1 = MIN (y1, (gint64) self->height);
+    z0 = MAX (z0, 0), z1 = MIN (z1, (gint64) self->depth);
+    if (x0 >= x1 || y0 >= y1 || z0 >= z1)
+        return;
+
+    pv_map_get_blocks (self->map, x0, y0, z0, x1 - x0, y1 - y0, z1 - z0, blocks->region);
+    for (gint64 z = z0; z < z1; z++)
+        for (gint64 y = y0; y < y1; y++)
+            memcpy (blocks->blocks + ((z - blocks->z) * BORDER_SIZE + (y - blocks->y)) * BORDER_SIZE + (x0 - blocks->x),
+                    blocks->region + ((z - z0) * (y1 - y0) + (y - y0)) * (x1 - x0),
+                    sizeof (guint16) * (x1 - x0));
+}
+
+/* Read the blocks in chunk cx, cy, cz and the blocks bordering it */
+static void
+read_chunk_blocks (PvRenderer  *self,
+                   ChunkBlocks *blocks,
+                   gsize        cx,
+                   gsize        cy,
+                   gsize        cz)
+{
+    blocks->x = (gint64) (cx * PV_MAP_CHUNK_SIZE) - 1;
+    blocks->y = (gint64) (cy * PV_MAP_CHUNK_SIZE) - 1;
+    blocks->z = (gint64) (cz * PV_MAP_CHUNK_SIZE) - 1;
+    memset (blocks->blocks, 0, sizeof (blocks->blocks));
+    read_blocks (self, blocks, blocks->x, blocks->y, blocks->z, blocks->x + BORDER_SIZE, blocks->y + BORDER_SIZE, blocks->z + BORDER_SIZE);
+}
+
+/* Copy the blocks of a chunk from pv_map_foreach_chunk and read the blocks bordering it */
+static void
+read_chunk_border (PvRenderer        *self,
+                   ChunkBlocks       *blocks,
+                   const PvMapRegion *region,
+                   const guint16     *chunk_blocks)
+{
+    blocks->x = (gint64) region->x - 1;
+    blocks->y = (gint64) region->y - 1;
+    blocks->z = (gint64) region->z - 1;
+    memset (blocks->blocks, 0, sizeof (blocks->blocks));
+    for (gsize z = 0; z < region->depth; z++)
+        for (gsize y = 0; y < region->height; y++)
+            memcpy (blocks->blocks + ((z + 1) * BORDER_SIZE + (y + 1)) * BORDER_SIZE + 1,
+                    chunk_blocks + (z * PV_MAP_CHUNK_SIZE + y) * PV_MAP_CHUNK_SIZE,
+                    sizeof (guint16) * region->width);
+
+    gint64 x0 = region->x, x1 = x0 + region->width;
+    gint64 y0 = region->y, y1 = y0 + region->height;
+    gint64 z0 = region->z, z1 = z0 + region->depth;
+    read_blocks (self, blocks, x0 - 1, y0 - 1, z0 - 1, x1 + 1, y1 + 1, z0);
+    read_blocks (self, blocks, x0 - 1, y0 - 1, z1, x1 + 1, y1 + 1, z1 + 1);
+    read_blocks (self, blocks, x0 - 1, y0 - 1, z0, x1 + 1, y0, z1);
+    read_blocks (self, blocks, x0 - 1, y1, z0, x1 + 1, y1 + 1, z1);
+    read_blocks (self, blocks, x0 - 1, y0, z0, x0, y1, z1);
+    read_blocks (self, blocks, x1, y0, z0, x1 + 1, y1, z1);
+}
+
+/* Bricks are groups of blocks in a chunk, used to skip over empty space */
+#define CHUNK_BRICKS (PV_MAP_CHUNK_SIZE / PV_MAP_BRICK_SIZE)
+
+static gboolean
+is_brick_empty (guint64 *occupancy, guint x, guint y, guint z)
+{
+    guint bx = x / PV_MAP_BRICK_SIZE, by = y / PV_MAP_BRICK_SIZE, bz = z / PV_MAP_BRICK_SIZE;
+    return ((occupancy[bz] >> (by * CHUNK_BRICKS + bx)) & 1) == 0;
 }
 
 static GLfloat
-ambient_shade (gsize    width,
-               gsize    height,
-               gsize    depth,
-               guint16 *blocks,
-               GLfloat *pos)
+ambient_shade (ChunkBlocks *blocks,
+               GLfloat     *pos)
 {
     int n_around = 0;
-    if (get_block (width, height, depth, blocks, pos[0], pos[1], pos[2]) != 0)
+    if (get_block (blocks, pos[0], pos[1], pos[2]) != 0)
        n_around++;
-    if (get_block (width, height, depth, blocks, pos[0] - 1, pos[1], pos[2]) != 0)
+    if (get_block (blocks, pos[0] - 1, pos[1], pos[2]) != 0)
        n_around++;
-    if (get_block (width, height, depth, blocks, pos[0] - 1, pos[1] - 1, pos[2]) != 0)
+    if (get_block (blocks, pos[0] - 1, pos[1] - 1, pos[2]) != 0)
        n_around++;
-    if (get_block (width, height, depth, blocks, pos[0], pos[1] - 1, pos[2]) != 0)
+    if (get_block (blocks, pos[0], pos[1] - 1, pos[2]) != 0)
        n_around++;
-    if (get_block (width, height, depth, blocks, pos[0], pos[1], pos[2] - 1) != 0)
+    if (get_block (blocks, pos[0], pos[1], pos[2] - 1) != 0)
        n_around++;
-    if (get_block (width, height, depth, blocks, pos[0] - 1, pos[1], pos[2] - 1) != 0)
+    if (get_block (blocks, pos[0] - 1, pos[1], pos[2] - 1) != 0)
        n_around++;
-    if (get_block (width, height, depth, blocks, pos[0] - 1, pos[1] - 1, pos[2] - 1) != 0)
+    if (get_block (blocks, pos[0] - 1, pos[1] - 1, pos[2] - 1) != 0)
        n_around++;
-    if (get_block (width, height, depth, blocks, pos[0], pos[1] - 1, pos[2] - 1) != 0)
+    if (get_block (blocks, pos[0], pos[1] - 1, pos[2] - 1) != 0)
        n_around++;
 
     // FIXME: Work out concaveness properly
@@ -135,40 +251,37 @@ ambient_shade (gsize    width,
 }
 
 static void
-add_square (gsize    width,
-            gsize    height,
-            gsize    depth,
-            guint16 *blocks,
-            GArray  *vertices,
-            GArray  *triangles,
-            GLfloat *a,
-            GLfloat *v0,
-            GLfloat *v1,
-            GLfloat *face_color)
+add_square (ChunkBlocks *blocks,
+            GArray      *vertices,
+            GArray      *triangles,
+            GLfloat     *a,
+            GLfloat     *v0,
+            GLfloat     *v1,
+            GLfloat     *face_color)
 {
     guint start = vertices->len / 6;
 
     add_vec3 (vertices, a);
     GLfloat color[3];
-    vec3_mult (color, face_color, ambient_shade (width, height, depth, blocks, a));
+    vec3_mult (color, face_color, ambient_shade (blocks, a));
     add_vec3 (vertices, color);
 
     GLfloat b[3];
     vec3_add (b, a, v0);
     add_vec3 (vertices, b);
-    vec3_mult (color, face_color, ambient_shade (width, height, depth, blocks, b));
+    vec3_mult (color, face_color, ambient_shade (blocks, b));
     add_vec3 (vertices, color);
 
     GLfloat c[3];
     vec3_add (c, b, v1);
     add_vec3 (vertices, c);
-    vec3_mult (color, face_color, ambient_shade (width, height, depth, blocks, c));
+    vec3_mult (color, face_color, ambient_shade (blocks, c));
     add_vec3 (vertices, color);
 
     GLfloat d[3];
     vec3_add (d, a, v1);
     add_vec3 (vertices, d);
-    vec3_mult (color, face_color, ambient_shade (width, height, depth, blocks, d));
+    vec3_mult (color, face_color, ambient_shade (blocks, d));
     add_vec3 (vertices, color);
 
     add_uint (triangles, start + 0);
@@ -180,32 +293,42 @@ add_square (gsize    width,
 }
 
 static void
-setup (PvRenderer *self)
+mesh_clear (Mesh *mesh)
 {
-    if (self->vao != 0)
-        return;
+    if (mesh->vao != 0) {
+        glDeleteVertexArrays (1, &mesh->vao);
+        glDeleteBuffers (1, &mesh->vertex_buffer);
+        glDeleteBuffers (1, &mesh->triangle_buffer);
+    }
+    memset (mesh, 0, sizeof (Mesh));
+}
 
-    glGenVertexArrays (1, &self->vao);
-    glBindVertexArray (self->vao);
+/* Generate the triangles for the blocks in chunk cx, cy, cz, which have been read into blocks */
+static void
+generate_mesh (PvRenderer  *self,
+               Mesh        *mesh,
+               gsize        cx,
+               gsize        cy,
+               gsize        cz,
+               ChunkBlocks *blocks,
+               gfloat      *colors)
+{
+    mesh_clear (mesh);
 
-    gsize width = pv_map_get_width (self->map);
-    gsize height = pv_map_get_height (self->map);
-    gsize depth = pv_map_get_depth (self->map);
+    gint x0 = cx * PV_MAP_CHUNK_SIZE, x1 = MIN (x0 + PV_MAP_CHUNK_SIZE, self->width);
+    gint y0 = cy * PV_MAP_CHUNK_SIZE, y1 = MIN (y0 + PV_MAP_CHUNK_SIZE, self->height);
+    gint z0 = cz * PV_MAP_CHUNK_SIZE, z1 = MIN (z0 + PV_MAP_CHUNK_SIZE, self->depth);
 
-    g_autofree guint16 *blocks = g_malloc (sizeof (guint16) * width * height * depth);
-    pv_map_get_blocks (self->map, 0, 0, 0, width, height, depth, blocks);
+    /* Faces can only be seen from the side of the chunk they face */
+    mesh->west = x0;
+    mesh->east = x1;
+    mesh->south = y0;
+    mesh->north = y1;
+    mesh->bottom = z0;
+    mesh->top = z1;
 
-    gsize block_count = pv_map_get_block_count (self->map);
-    g_autofree gfloat *colors = g_malloc (sizeof (gfloat) * block_count * 3);
-    gsize offset = 0;
-    for (gsize block_id = 0; block_id < block_count; block_id++) {
-        guint8 red, green, blue;
-        pv_map_get_block_color (self->map, block_id, &red, &green, &blue);
-        colors[offset + 0] = red / 255.0;
-        colors[offset + 1] = green / 255.0;
-        colors[offset + 2] = blue / 255.0;
-        offset += 3;
-    }
+    guint64 occupancy[CHUNK_BRICKS];
+    pv_map_get_chunk_occupancy (self->map, x0, y0, z0, occupancy);
 
     GLfloat north[3] = {  1,  0,  0 };
     GLfloat south[3] = { -1,  0,  0 };
@@ -218,145 +341,146 @@ setup (PvRenderer *self)
      * Order from nearest to furtherest (so later triangles get rejected in the depth buffer) */
     g_autoptr(GArray) vertices = g_array_new (FALSE, FALSE, sizeof (GLfloat));
     g_autoptr(GArray) triangles = g_array_new (FALSE, FALSE, sizeof (GLuint));
-    self->north_offset = 0;
-    self->north_size = 0;
-    for (int x = 0; x < width; x++) {
-        for (int y = height; y >= 0; y--) {
-            for (int z = 0; z < depth; z++) {
-                guint16 block_id = get_block (width, height, depth, blocks, x, y, z);
+    mesh->north_offset = 0;
+    mesh->north_size = 0;
+    for (int x = x0; x < x1; x++) {
+        for (int y = y1 - 1; y >= y0; y--) {
+            for (int z = z0; z < z1; z++) {
+                if (is_brick_empty (occupancy, x - x0, y - y0, z - z0)) {
+                    z |= 3;
+                    continue;
+                }
+                guint16 block_id = get_block (blocks, x, y, z);
                 if (block_id == 0)
                     continue;
-                if (get_block (width, height, depth, blocks, x, y + 1, z) != 0)
+                if (get_block (blocks, x, y + 1, z) != 0)
                     continue;
 
                 GLfloat top_pos[3] = { x + 1, y + 1, z + 1 };
-                add_square (width, height, depth, blocks, vertices, triangles, top_pos, south, down, colors + block_id * 3);
-                self->north_size += 2;
-                if (y + 1 > self->north)
-                    self->north = y + 1;
+                add_square (blocks, vertices, triangles, top_pos, south, down, colors + block_id * 3);
+                mesh->north_size += 2;
             }
         }
     }
-    self->south_offset = self->north_offset + self->north_size;
-    self->south_size = 0;
-    for (int x = 0; x < width; x++) {
-        for (int y = 0; y < height; y++) {
-            for (int z = 0; z < depth; z++) {
-                guint16 block_id = get_block (width, height, depth, blocks, x, y, z);
+    mesh->south_offset = mesh->north_offset + mesh->north_size;
+    mesh->south_size = 0;
+    for (int x = x0; x < x1; x++) {
+        for (int y = y0; y < y1; y++) {
+            for (int z = z0; z < z1; z++) {
+                if (is_brick_empty (occupancy, x - x0, y - y0, z - z0)) {
+                    z |= 3;
+                    continue;
+                }
+                guint16 block_id = get_block (blocks, x, y, z);
                 if (block_id == 0)
                     continue;
-                if (get_block (width, height, depth, blocks, x, y - 1, z) != 0)
+                if (get_block (blocks, x, y - 1, z) != 0)
                     continue;
 
                 GLfloat base_pos[3] = { x, y, z };
-                add_square (width, height, depth, blocks, vertices, triangles, base_pos, up, north, colors + block_id * 3);
-                self->south_size += 2;
-                if (y < self->south)
-                    self->south = y;
+                add_square (blocks, vertices, triangles, base_pos, up, north, colors + block_id * 3);
+                mesh->south_size += 2;
             }
         }
     }
-    self->east_offset = self->south_offset + self->south_size;
-    self->east_size = 0;
-    for (int x = width; x >= 0; x--) {
-        for (int y = 0; y < height; y++) {
-            for (int z = 0; z < depth; z++) {
-                guint16 block_id = get_block (width, height, depth, blocks, x, y, z);
+    mesh->east_offset = mesh->south_offset + mesh->south_size;
+    mesh->east_size = 0;
+    for (int x = x1 - 1; x >= x0; x--) {
+        for (int y = y0; y < y1; y++) {
+            for (int z = z0; z < z1; z++) {
+                if (is_brick_empty (occupancy, x - x0, y - y0, z - z0)) {
+                    z |= 3;
+                    continue;
+                }
+                guint16 block_id = get_block (blocks, x, y, z);
                 if (block_id == 0)
                     continue;
-                if (get_block (width, height, depth, blocks, x + 1, y, z) != 0)
+                if (get_block (blocks, x + 1, y, z) != 0)
                     continue;
 
                 GLfloat top_pos[3] = { x + 1, y + 1, z + 1 };
-                add_square (width, height, depth, blocks, vertices, triangles, top_pos, down, west, colors + block_id * 3);
-                self->east_size += 2;
-                if (x > self->east)
-                    self->east = x;
+                add_square (blocks, vertices, triangles, top_pos, down, west, colors + block_id * 3);
+                mesh->east_size += 2;
             }
         }
     }
-    self->west_offset = self->east_offset + self->east_size;
-    self->west_size = 0;
-    for (int x = 0; x < width; x++) {
-        for (int y = 0; y < height; y++) {
-            for (int z = 0; z < depth; z++) {
-                guint16 block_id = get_block (width, height, depth, blocks, x, y, z);
+    mesh->west_offset = mesh->east_offset + mesh->east_size;
+    mesh->west_size = 0;
+    for (int x = x0; x < x1; x++) {
+        for (int y = y0; y < y1; y++) {
+            for (int z = z0; z < z1; z++) {
+                if (is_brick_empty (occupancy, x - x0, y - y0, z - z0)) {
+                    z |= 3;
+                    continue;
+                }
+                guint16 block_id = get_block (blocks, x, y, z);
                 if (block_id == 0)
                     continue;
-                if (get_block (width, height, depth, blocks, x - 1, y, z) != 0)
+                if (get_block (blocks, x - 1, y, z) != 0)
                     continue;
 
                 GLfloat base_pos[3] = { x, y, z };
-                add_square (width, height, depth, blocks, vertices, triangles, base_pos, east, up, colors + block_id * 3);
-                self->west_size += 2;
-                if (x < self->west)
-                    self->west = x;
+                add_square (blocks, vertices, triangles, base_pos, east, up, colors + block_id * 3);
+                mesh->west_size += 2;
             }
         }
     }
-    self->top_offset = self->west_offset + self->west_size;
-    self->top_size = 0;
-    for (int x = 0; x < width; x++) {
-        for (int y = 0; y < height; y++) {
-            for (int z = depth; z >= 0; z--) {
-                guint16 block_id = get_block (width, height, depth, blocks, x, y, z);
+    mesh->top_offset = mesh->west_offset + mesh->west_size;
+    mesh->top_size = 0;
+    for (int x = x0; x < x1; x++) {
+        for (int y = y0; y < y1; y++) {
+            for (int z = z1 - 1; z >= z0; z--) {
+                if (is_brick_empty (occupancy, x - x0, y - y0, z - z0)) {
+                    z &= ~3;
+                    continue;
+                }
+                guint16 block_id = get_block (blocks, x, y, z);
                 if (block_id == 0)
                     continue;
-                if (get_block (width, height, depth, blocks, x, y, z + 1) != 0)
+                if (get_block (blocks, x, y, z + 1) != 0)
                     continue;
 
                 GLfloat top_pos[3] = { x + 1, y + 1, z + 1 };
-                add_square (width, height, depth, blocks, vertices, triangles, top_pos, west, south, colors + block_id * 3);
-                self->top_size += 2;
-                if (z + 1 > self->top)
-                    self->top = z + 1;
+                add_square (blocks, vertices, triangles, top_pos, west, south, colors + block_id * 3);
+                mesh->top_size += 2;
             }
         }
     }
-    self->bottom_offset = self->top_offset + self->top_size;
-    self->bottom_size = 0;
-    for (int x = 0; x < width; x++) {
-        for (int y = 0; y < height; y++) {
-            for (int z = 0; z < depth; z++) {
-                guint16 block_id = get_block (width, height, depth, blocks, x, y, z);
+    mesh->bottom_offset = mesh->top_offset + mesh->top_size;
+    mesh->bottom_size = 0;
+    for (int x = x0; x < x1; x++) {
+        for (int y = y0; y < y1; y++) {
+            for (int z = z0; z < z1; z++) {
+                if (is_brick_empty (occupancy, x - x0, y - y0, z - z0)) {
+                    z |= 3;
+                    continue;
+                }
+                guint16 block_id = get_block (blocks, x, y, z);
                 if (block_id == 0)
                     continue;
-                if (get_block (width, height, depth, blocks, x, y, z - 1) != 0)
+                if (get_block (blocks, x, y, z - 1) != 0)
                     continue;
 
                 GLfloat base_pos[3] = { x, y, z };
-                add_square (width, height, depth, blocks, vertices, triangles, base_pos, north, east, colors + block_id * 3);
-                self->bottom_size += 2;
-                if (z < self->bottom)
-                    self->bottom = z;
+                add_square (blocks, vertices, triangles, base_pos, north, east, colors + block_id * 3);
+                mesh->bottom_size += 2;
             }
         }
     }
 
-    GLuint vertex_buffer;
-    glGenBuffers (1, &vertex_buffer);
-    glBindBuffer (GL_ARRAY_BUFFER, vertex_buffer);
-    glBufferData (GL_ARRAY_BUFFER, vertices->len * sizeof (GLfloat), vertices->data, GL_STATIC_DRAW);
-
-    GLuint triangle_buffer;
-    glGenBuffers (1, &triangle_buffer);
-    glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, triangle_buffer);
-    glBufferData (GL_ELEMENT_ARRAY_BUFFER, triangles->len * sizeof (GLuint), triangles->data, GL_STATIC_DRAW);
+    if (triangles->len == 0)
+        return;
 
-    GLuint vertex_shader = load_shader (GL_VERTEX_SHADER, "pv-vertex.glsl");
-    GLuint fragment_shader = load_shader (GL_FRAGMENT_SHADER, "pv-fragment.glsl");
+    glGenVertexArrays (1, &mesh->vao);
+    glBindVertexArray (mesh->vao);
 
-    self->program = glCreateProgram ();
-    glAttachShader (self->program, vertex_shader);
-    glAttachShader (self->program, fragment_shader);
-    glLinkProgram (self->program);
-    GLint status;
-    glGetProgramiv (self->program, GL_LINK_STATUS, &status);
-    if (status == GL_FALSE)
-       g_printerr ("Failed to link program\n");
+    glGenBuffers (1, &mesh->vertex_buffer);
+    glBindBuffer (GL_ARRAY_BUFFER, mesh->vertex_buffer);
+    glBufferData (GL_ARRAY_BUFFER, vertices->len * sizeof (GLfloat), vertices->data, GL_STATIC_DRAW);
 
-    glDetachShader (self->program, vertex_shader);
-    glDetachShader (self->program, fragment_shader);
+    glGenBuffers (1, &mesh->triangle_buffer);
+    glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, mesh->triangle_buffer);
+    glBufferData (GL_ELEMENT_ARRAY_BUFFER, triangles->len * sizeof (GLuint), triangles->data, GL_STATIC_DRAW);
 
     GLint position_attr = glGetAttribLocation (self->program, "position");
     glEnableVertexAttribArray (position_attr);
@@ -364,11 +488,149 @@ setup (PvRenderer *self)
     GLint color_attr = glGetAttribLocation (self->program, "color");
     glEnableVertexAttribArray (color_attr);
     glVertexAttribPointer (color_attr, 3, GL_FLOAT, GL_FALSE, 24, (void*)12);
+}
+
+typedef struct
+{
+    PvRenderer  *self;
+    ChunkBlocks *blocks;
+    gfloat      *colors;
+} BuildData;
+
+static void
+build_chunk_cb (PvMap             *map,
+                const PvMapRegion *region,
+                const guint16     *chunk_blocks,
+                gpointer           user_data)
+{
+    BuildData *data = user_data;
+    PvRenderer *self = data->self;
+
+    gsize cx = region->x / PV_MAP_CHUNK_SIZE, cy = region->y / PV_MAP_CHUNK_SIZE, cz = region->z / PV_MAP_CHUNK_SIZE;
+    read_chunk_border (self, data->blocks, region, chunk_blocks);
+    generate_mesh (self, &self->meshes[(cz * self->meshes_height + cy) * self->meshes_width + cx], cx, cy, cz, data->blocks, data->colors);
+}
+
+static void
+clear_meshes (PvRenderer *self)
+{
+    gsize n_meshes = self->meshes_width * self->meshes_height * self->meshes_depth;
+    for (gsize i = 0; i < n_meshes; i++)
+        mesh_clear (&self->meshes[i]);
+    g_clear_pointer (&self->meshes, g_free);
+    self->meshes_width = self->meshes_height = self->meshes_depth = 0;
+}
+
+static void
+setup (PvRenderer *self)
+{
+    if (self->program == 0) {
+        GLuint vertex_shader = load_shader (GL_VERTEX_SHADER, "pv-vertex.glsl");
+        GLuint fragment_shader = load_shader (GL_FRAGMENT_SHADER, "pv-fragment.glsl");
+
+        self->program = glCreateProgram ();
+        glAttachShader (self->program, vertex_shader);
+        glAttachShader (self->program, fragment_shader);
+        glLinkProgram (self->program);
+        GLint status;
+        glGetProgramiv (self->program, GL_LINK_STATUS, &status);
+        if (status == GL_FALSE)
+           g_printerr ("Failed to link program\n");
+
+        glDetachShader (self->program, vertex_shader);
+        glDetachShader (self->program, fragment_shader);
+    }
 
     if (self->gl_renderer == NULL) {
         self->gl_renderer = g_strdup ((gchar *) glGetString (GL_RENDERER));
         g_printerr ("Renderer: %s\n", self->gl_renderer);
     }
+
+    gsize width = pv_map_get_width (self->map);
+    gsize height = pv_map_get_height (self->map);
+    gsize depth = pv_map_get_depth (self->map);
+    if (width != self->width || height != self->height || depth != self->depth)
+        self->map_changed = TRUE;
+
+    if (!self->map_changed && self->changed_regions->len == 0)
+        return;
+
+    gsize block_count = pv_map_get_block_count (self->map);
+    g_autofree gfloat *colors = g_malloc (sizeof (gfloat) * block_count * 3);
+    gsize offset = 0;
+    for (gsize block_id = 0; block_id < block_count; block_id++) {
+        guint8 red, green, blue;
+        pv_map_get_block_color (self->map, block_id, &red, &green, &blue);
+        colors[offset + 0] = red / 255.0;
+        colors[offset + 1] = green / 255.0;
+        colors[offset + 2] = blue / 255.0;
+        offset += 3;
+    }
+
+    g_autofree ChunkBlocks *blocks = g_new (ChunkBlocks, 1);
+    if (self->map_changed) {
+        clear_meshes (self);
+        self->width = width;
+        self->height = height;
+        self->depth = depth;
+
+        self->meshes_width = (width + PV_MAP_CHUNK_SIZE - 1) / PV_MAP_CHUNK_SIZE;
+        self->meshes_height = (height + PV_MAP_CHUNK_SIZE - 1) / PV_MAP_CHUNK_SIZE;
+        self->meshes_depth = (depth + PV_MAP_CHUNK_SIZE - 1) / PV_MAP_CHUNK_SIZE;
+        self->meshes = g_new0 (Mesh, self->meshes_width * self->meshes_height * self->meshes_depth);
+
+        /* Visit the chunks in order so the whole map doesn't need to be decoded at once */
+        BuildData data = { self, blocks, colors };
+        pv_map_foreach_chunk (self->map, PV_MAP_CHUNK_FLAGS_SKIP_EMPTY, build_chunk_cb, &data);
+
+        self->map_changed = FALSE;
+        g_array_set_size (self->changed_regions, 0);
+        return;
+    }
+
+    /* Regenerate the chunks that touch the changed blocks (including neighbours, which are used for faces and shading) */
+    g_autofree gboolean *regenerate = g_new0 (gboolean, self->meshes_width * self->meshes_height * self->meshes_depth);
+    for (guint i = 0; i < self->changed_regions->len; i++) {
+        PvMapRegion *region = &g_array_index (self->changed_regions, PvMapRegion, i);
+        if (region->x >= width || region->y >= height || region->z >= depth)
+            continue;
+        gsize x0 = region->x, x1 = MIN (region->x + region->width, width);
+        gsize y0 = region->y, y1 = MIN (region->y + region->height, height);
+        gsize z0 = region->z, z1 = MIN (region->z + region->depth, depth);
+        if (x0 >= x1 || y0 >= y1 || z0 >= z1)
+            continue;
+
+        gsize cx0 = (x0 > 0 ? x0 - 1 : 0) / PV_MAP_CHUNK_SIZE, cx1 = MIN (x1 / PV_MAP_CHUNK_SIZE + 1, self->meshes_width);
+        gsize cy0 = (y0 > 0 ? y0 - 1 : 0) / PV_MAP_CHUNK_SIZE, cy1 = MIN (y1 / PV_MAP_CHUNK_SIZE + 1, self->meshes_height);
+        gsize cz0 = (z0 > 0 ? z0 - 1 : 0) / PV_MAP_CHUNK_SIZE, cz1 = MIN (z1 / PV_MAP_CHUNK_SIZE + 1, self->meshes_depth);
+        for (gsize cz = cz0; cz < cz1; cz++)
+            for (gsize cy = cy0; cy < cy1; cy++)
+                for (gsize cx = cx0; cx < cx1; cx++)
+                    regenerate[(cz * self->meshes_height + cy) * self->meshes_width + cx] = TRUE;
+    }
+    g_array_set_size (self->changed_regions, 0);
+
+    gsize mesh_index = 0;
+    for (gsize cz = 0; cz < self->meshes_depth; cz++)
+        for (gsize cy = 0; cy < self->meshes_height; cy++)
+            for (gsize cx = 0; cx < self->meshes_width; cx++) {
+                if (regenerate[mesh_index]) {
+                    mesh_clear (&self->meshes[mesh_index]);
+                    gsize x = cx * PV_MAP_CHUNK_SIZE, y = cy * PV_MAP_CHUNK_SIZE, z = cz * PV_MAP_CHUNK_SIZE;
+                    if (!pv_map_is_empty (self->map, x, y, z, MIN (PV_MAP_CHUNK_SIZE, width - x), MIN (PV_MAP_CHUNK_SIZE, height - y), MIN (PV_MAP_CHUNK_SIZE, depth - z))) {
+                        read_chunk_blocks (self, blocks, cx, cy, cz);
+                        generate_mesh (self, &self->meshes[mesh_index], cx, cy, cz, blocks, colors);
+                    }
+                }
+                mesh_index++;
+            }
+}
+
+static void
+map_changed_cb (PvRenderer *self,
+                GArray     *regions)
+{
+    g_array_append_vals (self->changed_regions, regions->data, regions->len);
 }
 
 static void
@@ -377,6 +639,10 @@ pv_renderer_dispose (GObject *object)
     PvRenderer *self = PV_RENDERER (object);
 
     g_clear_pointer (&self->gl_renderer, g_free);
+    g_clear_pointer (&self->meshes, g_free);
+    g_clear_pointer (&self->changed_regions, g_array_unref);
+    if (self->map != NULL)
+        g_signal_handlers_disconnect_by_data (self->map, self);
     g_clear_object (&self->map);
     g_clear_object (&self->camera);
 
@@ -394,6 +660,7 @@ pv_renderer_class_init (PvRendererClass *klass)
 void
 pv_renderer_init (PvRenderer *self)
 {
+    self->changed_regions = g_array_new (FALSE, FALSE, sizeof (PvMapRegion));
 }
 
 PvRenderer *
@@ -412,8 +679,21 @@ pv_renderer_set_map (PvRenderer *self,
     if (self->map == map)
         return;
 
+    if (self->map != NULL)
+        g_signal_handlers_disconnect_by_data (self->map, self);
     g_clear_object (&self->map);
-    self->map = g_object_ref (map);
+    if (map != NULL) {
+        self->map = g_object_ref (map);
+        g_signal_connect_object (self->map, "changed", G_CALLBACK (map_changed_cb), self, G_CONNECT_SWAPPED);
+    }
+    self->map_changed = TRUE;
+}
+
+PvMap *
+pv_renderer_get_map (PvRenderer *self)
+{
+    g_return_val_if_fail (PV_IS_RENDERER (self), NULL);
+    return self->map;
 }
 
 void
@@ -437,77 +717,98 @@ pv_renderer_get_camera (PvRenderer *self)
     return self->camera;
 }
 
-void
-pv_renderer_render (PvRenderer *self,
-                    guint       width,
-                    guint       height)
+/* Draw the faces in a mesh that can be seen from x, y, z, returns the number of triangles drawn */
+static GLint
+render_mesh (Mesh    *mesh,
+             GLfloat  x,
+             GLfloat  y,
+             GLfloat  z,
+             GLint    normal_location,
+             GLint    shade_location)
 {
-    g_return_if_fail (PV_IS_RENDERER (self));
-
-    setup (self);
-
-    glUseProgram (self->program);
-
-    GLint v_location = glGetUniformLocation (self->program, "ViewMatrix");
-    GLint vp_location = glGetUniformLocation (self->program, "ViewProjectionMatrix");
-    pv_camera_transform (self->camera, width, height, v_location, vp_location);
-
-    GLint normal_location = glGetUniformLocation (self->program, "Normal");
-    GLint shade_location = glGetUniformLocation (self->program, "Shade");
-
-    glBindVertexArray (self->vao);
+    glBindVertexArray (mesh->vao);
 
     GLint n_triangles = 0;
-    GLfloat x, y, z;
-    pv_camera_get_position (self->camera, &x, &y, &z);
-
     GLfloat light_direction[3] = { 1, 1, -1 };
 
-    if (x > self->west) {
+    if (x > mesh->west) {
         GLfloat normal[3] = { -1, 0, 0 };
         glUniform3f (normal_location, normal[0], normal[1], normal[2]);
         glUniform1f (shade_location, MAX (vec3_dot (light_direction, normal), 0.4));
-        glDrawElements (GL_TRIANGLES, self->east_size * 3, GL_UNSIGNED_INT, (const GLvoid *) (self->east_offset * 3 * 4));
-        n_triangles += self->east_size;
+        glDrawElements (GL_TRIANGLES, mesh->east_size * 3, GL_UNSIGNED_INT, (const GLvoid *) (mesh->east_offset * 3 * 4));
+        n_triangles += mesh->east_size;
     }
-    if (x < self->east) {
+    if (x < mesh->east) {
         GLfloat normal[3] = { 1, 0, 0 };
         glUniform3f (normal_location, normal[0], normal[1], normal[2]);
         glUniform1f (shade_location, MAX (vec3_dot (light_direction, normal), 0.4));
-        glDrawElements (GL_TRIANGLES, self->west_size * 3, GL_UNSIGNED_INT, (const GLvoid *) (self->west_offset * 3 * 4));
-        n_triangles += self->west_size;
+        glDrawElements (GL_TRIANGLES, mesh->west_size * 3, GL_UNSIGNED_INT, (const GLvoid *) (mesh->west_offset * 3 * 4));
+        n_triangles += mesh->west_size;
     }
 
-    if (y > self->south) {
+    if (y > mesh->south) {
         GLfloat normal[3] = { 0, -1, 0 };
         glUniform3f (normal_location, normal[0], normal[1], normal[2]);
         glUniform1f (shade_location, MAX (vec3_dot (light_direction, normal), 0.4));
-        glDrawElements (GL_TRIANGLES, self->north_size * 3, GL_UNSIGNED_INT, (const GLvoid *) (self->north_offset * 3 * 4));
-        n_triangles += self->north_size;
+        glDrawElements (GL_TRIANGLES, mesh->north_size * 3, GL_UNSIGNED_INT, (const GLvoid *) (mesh->north_offset * 3 * 4));
+        n_triangles += mesh->north_size;
     }
-    if (y < self->north) {
+    if (y < mesh->north) {
         GLfloat normal[3] = { 0, 1, 0 };
         glUniform3f (normal_location, normal[0], normal[1], normal[2]);
         glUniform1f (shade_location, MAX (vec3_dot (light_direction, normal), 0.4));
-        glDrawElements (GL_TRIANGLES, self->south_size * 3, GL_UNSIGNED_INT, (const GLvoid *) (self->south_offset * 3 * 4));
-        n_triangles += self->south_size;
+        glDrawElements (GL_TRIANGLES, mesh->south_size * 3, GL_UNSIGNED_INT, (const GLvoid *) (mesh->south_offset * 3 * 4));
+        n_triangles += mesh->south_size;
     }
 
-    if (z > self->bottom) {
+    if (z > mesh->bottom) {
         GLfloat normal[3] = { 0, 0, -1 };
         glUniform3f (normal_location, normal[0], normal[1], normal[2]);
         glUniform1f (shade_location, MAX (vec3_dot (light_direction, normal), 0.4));
-        glDrawElements (GL_TRIANGLES, self->top_size * 3, GL_UNSIGNED_INT, (const GLvoid *) (self->top_offset * 3 * 4));
-        n_triangles += self->top_size;
+        glDrawElements (GL_TRIANGLES, mesh->top_size * 3, GL_UNSIGNED_INT, (const GLvoid *) (mesh->top_offset * 3 * 4));
+        n_triangles += mesh->top_size;
     }
-    if (z < self->top) {
+    if (z < mesh->top) {
         GLfloat normal[3] = { 0, 0, 1 };
         glUniform3f (normal_location, normal[0], normal[1], normal[2]);
         glUniform1f (shade_location, MAX (vec3_dot (light_direction, normal), 0.4));
-        glDrawElements (GL_TRIANGLES, self->bottom_size * 3, GL_UNSIGNED_INT, (const GLvoid *) (self->bottom_offset * 3 * 4));
-        n_triangles += self->bottom_size;
+        glDrawElements (GL_TRIANGLES, mesh->bottom_size * 3, GL_UNSIGNED_INT, (const GLvoid *) (mesh->bottom_offset * 3 * 4));
+        n_triangles += mesh->bottom_size;
     }
 
+    return n_triangles;
+}
+
+void
+pv_renderer_render (PvRenderer *self,
+                    guint       width,
+                    guint       height)
+{
+    g_return_if_fail (PV_IS_RENDERER (self));
+
+    if (self->map == NULL)
+        return;
+
+    setup (self);
+
+    glUseProgram (self->program);
+
+    GLint v_location = glGetUniformLocation (self->program, "ViewMatrix");
+    GLint vp_location = glGetUniformLocation (self->program, "ViewProjectionMatrix");
+    pv_camera_transform (self->camera, width, height, v_location, vp_location);
+
+    GLint normal_location = glGetUniformLocation (self->program, "Normal");
+    GLint shade_location = glGetUniformLocation (self->program, "Shade");
+
+    GLint n_triangles = 0;
+    GLfloat x, y, z;
+    pv_camera_get_position (self->camera, &x, &y, &z);
+
+    gsize n_meshes = self->meshes_width * self->meshes_height * self->meshes_depth;
+    for (gsize i = 0; i < n_meshes; i++)
+        if (self->meshes[i].vao != 0)
+            n_triangles += render_mesh (&self->meshes[i], x, y, z, normal_location, shade_location);
+
     g_printerr ("Rendered %d triangles\n", n_triangles);
 }
 
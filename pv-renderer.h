@@ -22,6 +22,8 @@ PvRenderer  *pv_renderer_new          (void);
 void         pv_renderer_set_map      (PvRenderer *renderer,
                                        PvMap      *map);
 
+PvMap       *pv_renderer_get_map      (PvRenderer *renderer);
+
 void         pv_renderer_set_camera   (PvRenderer *renderer,
                                        PvCamera   *camera);
 
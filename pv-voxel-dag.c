@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2018 Robert Ancell
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version. See http://www.gnu.org/copyleft/gpl.html the full text of the
+ * license.
+ */
+
+#include <string.h>
+
+#include "pv-voxel-dag.h"
+
+/* A sparse voxel octree where identical subtrees are shared (a directed acyclic graph).
+ * Cubes of a single block are stored in the node IDs so don't need any nodes. */
+
+typedef struct
+{
+    guint   level;
+    guint32 children[8];
+    guint   ref_count;
+} Node;
+
+struct _PvVoxelDag
+{
+    gint        ref_count;
+
+    /* Size of the cubes stored is 2^levels */
+    guint       levels;
+
+    GMutex      mutex;
+
+    /* Nodes by ID, NULL for unused IDs */
+    GPtrArray  *nodes;
+    GArray     *free_ids;
+
+    /* Node IDs by contents */
+    GHashTable *node_ids;
+};
+
+static guint
+node_hash (gconstpointer key)
+{
+    const Node *node = key;
+    guint hash = node->level;
+    for (int i = 0; i < 8; i++)
+        hash = hash * 31 + node->children[i];
+    return hash;
+}
+
+static gboolean
+node_equal (gconstpointer a,
+            gconstpointer b)
+{
+    const Node *node_a = a, *node_b = b;
+    return node_a->level == node_b->level && memcmp (node_a->children, node_b->children, sizeof (node_a->children)) == 0;
+}
+
+PvVoxelDag *
+pv_voxel_dag_new (guint levels)
+{
+    PvVoxelDag *dag = g_new0 (PvVoxelDag, 1);
+    dag->ref_count = 1;
+    dag->levels = levels;
+    g_mutex_init (&dag->mutex);
+    dag->nodes = g_ptr_array_new_with_free_func (g_free);
+    dag->free_ids = g_array_new (FALSE, FALSE, sizeof (guint32));
+    dag->node_ids = g_hash_table_new (node_hash, node_equal);
+    return dag;
+}
+
+PvVoxelDag *
+pv_voxel_dag_ref (PvVoxelDag *dag)
+{
+    g_atomic_int_inc (&dag->ref_count);
+    return dag;
+}
+
+void
+pv_voxel_dag_unref (PvVoxelDag *dag)
+{
+    if (!g_atomic_int_dec_and_test (&dag->ref_count))
+        return;
+
+    g_hash_table_unref (dag->node_ids);
+    g_ptr_array_unref (dag->nodes);
+    g_array_unref (dag->free_ids);
+    g_mutex_clear (&dag->mutex);
+    g_free (dag);
+}
+
+static Node *
+get_node (PvVoxelDag *dag,
+          guint32     id)
+{
+    return g_ptr_array_index (dag->nodes, id);
+}
+
+static void
+ref_node (PvVoxelDag *dag,
+          guint32     id)
+{
+    if (!PV_VOXEL_DAG_IS_UNIFORM (id))
+        get_node (dag, id)->ref_count++;
+}
+
+static void
+unref_node (PvVoxelDag *dag,
+            guint32     id)
+{
+    if (PV_VOXEL_DAG_IS_UNIFORM (id))
+        return;
+
+    Node *node = get_node (dag, id);
+    node->ref_count--;
+    if (node->ref_count > 0)
+        return;
+
+    g_hash_table_remove (dag->node_ids, node);
+    for (int i = 0; i < 8; i++)
+        unref_node (dag, node->children[i]);
+    g_ptr_array_index (dag->nodes, id) = NULL;
+    g_free (node);
+    g_array_append_val (dag->free_ids, id);
+}
+
+/* Get the ID for a cube of 2^level blocks at the given location */
+static guint32
+add_cube (PvVoxelDag    *dag,
+          const guint16 *blocks,
+          guint          level,
+          guint          x,
+          guint          y,
+          guint          z)
+{
+    guint size = 1 << dag->levels;
+    if (level == 0)
+        return PV_VOXEL_DAG_UNIFORM (blocks[(z * size + y) * size + x]);
+
+    Node key;
+    key.level = level;
+    guint half = 1 << (level - 1);
+    gboolean is_uniform = TRUE;
+    for (int i = 0; i < 8; i++) {
+        key.children[i] = add_cube (dag, blocks, level - 1,
+                                    x + (i & 1 ? half : 0),
+                                    y + (i & 2 ? half : 0),
+                                    z + (i & 4 ? half : 0));
+        if (key.children[i] != key.children[0] || !PV_VOXEL_DAG_IS_UNIFORM (key.children[i]))
+            is_uniform = FALSE;
+    }
+    if (is_uniform)
+        return key.children[0];
+
+    /* Use existing node with the same contents */
+    gpointer value;
+    if (g_hash_table_lookup_extended (dag->node_ids, &key, NULL, &value)) {
+        guint32 id = GPOINTER_TO_UINT (value);
+        get_node (dag, id)->ref_count++;
+        for (int i = 0; i < 8; i++)
+            unref_node (dag, key.children[i]);
+        return id;
+    }
+
+    Node *node = g_new (Node, 1);
+    *node = key;
+    node->ref_count = 1;
+    guint32 id;
+    if (dag->free_ids->len > 0) {
+        id = g_array_index (dag->free_ids, guint32, dag->free_ids->len - 1);
+        g_array_set_size (dag->free_ids, dag->free_ids->len - 1);
+        g_ptr_array_index (dag->nodes, id) = node;
+    }
+    else {
+        id = dag->nodes->len;
+        g_ptr_array_add (dag->nodes, node);
+    }
+    g_hash_table_insert (dag->node_ids, node, GUINT_TO_POINTER (id));
+
+    return id;
+}
+
+/* Convert a cube of 2^levels blocks in Z, Y, X order into a node and take a reference to it */
+guint32
+pv_voxel_dag_add (PvVoxelDag    *dag,
+                  const guint16 *blocks)
+{
+    g_mutex_lock (&dag->mutex);
+    guint32 id = add_cube (dag, blocks, dag->levels, 0, 0, 0);
+    g_mutex_unlock (&dag->mutex);
+
+    return id;
+}
+
+void
+pv_voxel_dag_ref_node (PvVoxelDag *dag,
+                       guint32     id)
+{
+    if (PV_VOXEL_DAG_IS_UNIFORM (id))
+        return;
+
+    g_mutex_lock (&dag->mutex);
+    ref_node (dag, id);
+    g_mutex_unlock (&dag->mutex);
+}
+
+void
+pv_voxel_dag_unref_node (PvVoxelDag *dag,
+                         guint32     id)
+{
+    if (PV_VOXEL_DAG_IS_UNIFORM (id))
+        return;
+
+    g_mutex_lock (&dag->mutex);
+    unref_node (dag, id);
+    g_mutex_unlock (&dag->mutex);
+}
+
+static void
+decode_cube (PvVoxelDag *dag,
+             guint32     id,
+             guint       level,
+             guint       x,
+             guint       y,
+             guint       z,
+             guint16    *blocks)
+{
+    guint size = 1 << dag->levels;
+
+    if (PV_VOXEL_DAG_IS_UNIFORM (id)) {
+        guint16 block = PV_VOXEL_DAG_GET_BLOCK (id);
+        guint length = 1 << level;
+        for (guint cz = z; cz < z + length; cz++)
+            for (guint cy = y; cy < y + length; cy++) {
+                guint16 *row = blocks + (cz * size + cy) * size + x;
+                for (guint i = 0; i < length; i++)
+                    row[i] = block;
+            }
+        return;
+    }
+
+    Node *node = get_node (dag, id);
+    guint half = 1 << (level - 1);
+    for (int i = 0; i < 8; i++)
+        decode_cube (dag, node->children[i], level - 1,
+                     x + (i & 1 ? half : 0),
+                     y + (i & 2 ? half : 0),
+                     z + (i & 4 ? half : 0),
+                     blocks);
+}
+
+/* Write the blocks in a node into a cube of 2^levels blocks in Z, Y, X order */
+void
+pv_voxel_dag_decode (PvVoxelDag *dag,
+                     guint32     id,
+                     guint16    *blocks)
+{
+    g_mutex_lock (&dag->mutex);
+    decode_cube (dag, id, dag->levels, 0, 0, 0, blocks);
+    g_mutex_unlock (&dag->mutex);
+}
+
+/* Get a single block from a node */
+guint16
+pv_voxel_dag_get_block (PvVoxelDag *dag,
+                        guint32     id,
+                        guint       x,
+                        guint       y,
+                        guint       z)
+{
+    g_mutex_lock (&dag->mutex);
+    for (guint level = dag->levels; !PV_VOXEL_DAG_IS_UNIFORM (id); level--) {
+        Node *node = get_node (dag, id);
+        guint shift = level - 1;
+        id = node->children[((x >> shift) & 1) | ((y >> shift) & 1) << 1 | ((z >> shift) & 1) << 2];
+    }
+    g_mutex_unlock (&dag->mutex);
+
+    return PV_VOXEL_DAG_GET_BLOCK (id);
+}
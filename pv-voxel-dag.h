@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2018 Robert Ancell
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version. See http://www.gnu.org/copyleft/gpl.html the full text of the
+ * license.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef struct _PvVoxelDag PvVoxelDag;
+
+/* Node IDs with this bit set are a cube of a single block */
+#define PV_VOXEL_DAG_UNIFORM_FLAG 0x80000000u
+
+#define PV_VOXEL_DAG_UNIFORM(block)  (PV_VOXEL_DAG_UNIFORM_FLAG | (guint16) (block))
+#define PV_VOXEL_DAG_IS_UNIFORM(id)  (((id) & PV_VOXEL_DAG_UNIFORM_FLAG) != 0)
+#define PV_VOXEL_DAG_GET_BLOCK(id)   ((guint16) ((id) & 0xFFFF))
+
+PvVoxelDag *pv_voxel_dag_new            (guint          levels);
+
+PvVoxelDag *pv_voxel_dag_ref            (PvVoxelDag    *dag);
+
+void        pv_voxel_dag_unref          (PvVoxelDag    *dag);
+
+guint32     pv_voxel_dag_add            (PvVoxelDag    *dag,
+                                         const guint16 *blocks);
+
+void        pv_voxel_dag_ref_node       (PvVoxelDag    *dag,
+                                         guint32        id);
+
+void        pv_voxel_dag_unref_node     (PvVoxelDag    *dag,
+                                         guint32        id);
+
+void        pv_voxel_dag_decode         (PvVoxelDag    *dag,
+                                         guint32        id,
+                                         guint16       *blocks);
+
+guint16     pv_voxel_dag_get_block      (PvVoxelDag    *dag,
+                                         guint32        id,
+                                         guint          x,
+                                         guint          y,
+                                         guint          z);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PvVoxelDag, pv_voxel_dag_unref)
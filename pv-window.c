@@ -12,17 +12,24 @@
 
 #include "pv-window.h"
 
+/* Half the width of the box around the camera used for collisions */
+#define CAMERA_RADIUS 0.25
+
+/* Distance to keep from blocks so rounding errors don't move the camera inside them */
+#define CONTACT_OFFSET 0.001
+
 struct _PvWindow
 {
-    GtkWindow   parent_instance;
+    GtkWindow     parent_instance;
 
-    GtkGLArea  *gl_area;
+    GtkHeaderBar *header_bar;
+    GtkGLArea    *gl_area;
 
-    PvRenderer *renderer;
+    PvRenderer   *renderer;
 
-    GLfloat     move[3];
-    gdouble     pointer_x;
-    gdouble     pointer_y;
+    GLfloat       move[3];
+    gdouble       pointer_x;
+    gdouble       pointer_y;
 };
 
 G_DEFINE_TYPE (PvWindow, pv_window, GTK_TYPE_WINDOW)
@@ -72,6 +79,45 @@ unrealize_cb (PvWindow *self)
 {
 }
 
+/* Move the camera, sliding along any blocks it hits */
+static void
+move_camera (PvWindow *self)
+{
+    PvCamera *camera = pv_renderer_get_camera (self->renderer);
+    PvMap *map = pv_renderer_get_map (self->renderer);
+
+    gfloat x, y, z;
+    pv_camera_get_position (camera, &x, &y, &z);
+    gdouble position[3] = { x, y, z };
+    gdouble motion[3] = { self->move[0], self->move[1], self->move[2] };
+    for (int i = 0; i < 3; i++) {
+        gdouble box_min[3] = { position[0] - CAMERA_RADIUS, position[1] - CAMERA_RADIUS, position[2] - CAMERA_RADIUS };
+        gdouble box_max[3] = { position[0] + CAMERA_RADIUS, position[1] + CAMERA_RADIUS, position[2] + CAMERA_RADIUS };
+        PvMapCollision collision;
+        if (map == NULL || !pv_map_sweep_box (map, box_min, box_max, motion, &collision)) {
+            for (int j = 0; j < 3; j++)
+                position[j] += motion[j];
+            break;
+        }
+
+        /* Move up to the contact and continue with the motion along the surface */
+        for (int j = 0; j < 3; j++) {
+            position[j] += motion[j] * collision.time;
+            motion[j] *= 1.0 - collision.time;
+        }
+        position[0] += collision.normal_x * CONTACT_OFFSET;
+        position[1] += collision.normal_y * CONTACT_OFFSET;
+        position[2] += collision.normal_z * CONTACT_OFFSET;
+        if (collision.normal_x != 0)
+            motion[0] = 0;
+        if (collision.normal_y != 0)
+            motion[1] = 0;
+        if (collision.normal_z != 0)
+            motion[2] = 0;
+    }
+    pv_camera_set_position (camera, position[0], position[1], position[2]);
+}
+
 static gboolean
 key_event_cb (PvWindow    *self,
               GdkEventKey *event)
@@ -133,10 +179,7 @@ key_event_cb (PvWindow    *self,
     }
 
     if (old_move[0] != self->move[0] || old_move[1] != self->move[1] || old_move[2] != self->move[2]) {
-        PvCamera *camera = pv_renderer_get_camera (self->renderer);
-        gfloat x, y, z;
-        pv_camera_get_position (camera, &x, &y, &z);
-        pv_camera_set_position (camera, x + self->move[0], y + self->move[1], z + self->move[2]);
+        move_camera (self);
         gtk_widget_queue_draw (GTK_WIDGET (self->gl_area));
     }
 
@@ -208,6 +251,7 @@ pv_window_class_init (PvWindowClass *klass)
 
     gtk_widget_class_set_template_from_resource (widget_class, "/com/example/pivox/pv-window.ui");
 
+    gtk_widget_class_bind_template_child (widget_class, PvWindow, header_bar);
     gtk_widget_class_bind_template_child (widget_class, PvWindow, gl_area);
 
     gtk_widget_class_bind_template_callback (widget_class, key_event_cb);
@@ -246,3 +290,18 @@ pv_window_set_renderer (PvWindow   *self,
     self->renderer = g_object_ref (renderer);
     gtk_widget_queue_draw (GTK_WIDGET (self->gl_area));
 }
+
+void
+pv_window_set_status (PvWindow    *self,
+                      const gchar *status)
+{
+    g_return_if_fail (PV_IS_WINDOW (self));
+    gtk_header_bar_set_subtitle (self->header_bar, status);
+}
+
+void
+pv_window_redraw (PvWindow *self)
+{
+    g_return_if_fail (PV_IS_WINDOW (self));
+    gtk_widget_queue_draw (GTK_WIDGET (self->gl_area));
+}
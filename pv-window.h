@@ -20,3 +20,8 @@ PvWindow *pv_window_new          (void);
 
 void      pv_window_set_renderer (PvWindow   *window,
                                   PvRenderer *renderer);
+
+void      pv_window_set_status   (PvWindow    *window,
+                                  const gchar *status);
+
+void      pv_window_redraw       (PvWindow   *window);
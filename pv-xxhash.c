@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2018 Robert Ancell
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version. See http://www.gnu.org/copyleft/gpl.html the full text of the
+ * license.
+ */
+
+#include <string.h>
+
+#include "pv-xxhash.h"
+
+/* The 64 bit variant of the xxHash non-cryptographic hash */
+
+#define PRIME1 0x9E3779B185EBCA87ull
+#define PRIME2 0xC2B2AE3D27D4EB4Full
+#define PRIME3 0x165667B19E3779F9ull
+#define PRIME4 0x85EBCA77C2B2AE63ull
+#define PRIME5 0x27D4EB2F165667C5ull
+
+static guint64
+read_u64 (const guint8 *data)
+{
+    guint64 value;
+    memcpy (&value, data, 8);
+    return GUINT64_FROM_LE (value);
+}
+
+static guint32
+read_u32 (const guint8 *data)
+{
+    guint32 value;
+    memcpy (&value, data, 4);
+    return GUINT32_FROM_LE (value);
+}
+
+static guint64
+rotl64 (guint64 value,
+        int     shift)
+{
+    return (value << shift) | (value >> (64 - shift));
+}
+
+static guint64
+round64 (guint64 accumulator,
+         guint64 input)
+{
+    accumulator += input * PRIME2;
+    accumulator = rotl64 (accumulator, 31);
+    return accumulator * PRIME1;
+}
+
+static guint64
+merge_round (guint64 accumulator,
+             guint64 value)
+{
+    accumulator ^= round64 (0, value);
+    return accumulator * PRIME1 + PRIME4;
+}
+
+guint64
+pv_xxhash64 (gconstpointer data,
+             gsize         length,
+             guint64       seed)
+{
+    const guint8 *p = data;
+    const guint8 *end = p + length;
+    guint64 hash;
+
+    if (length >= 32) {
+        guint64 v1 = seed + PRIME1 + PRIME2;
+        guint64 v2 = seed + PRIME2;
+        guint64 v3 = seed;
+        guint64 v4 = seed - PRIME1;
+        for (; end - p >= 32; p += 32) {
+            v1 = round64 (v1, read_u64 (p));
+            v2 = round64 (v2, read_u64 (p + 8));
+            v3 = round64 (v3, read_u64 (p + 16));
+            v4 = round64 (v4, read_u64 (p + 24));
+        }
+        hash = rotl64 (v1, 1) + rotl64 (v2, 7) + rotl64 (v3, 12) + rotl64 (v4, 18);
+        hash = merge_round (hash, v1);
+        hash = merge_round (hash, v2);
+        hash = merge_round (hash, v3);
+        hash = merge_round (hash, v4);
+    }
+    else
+        hash = seed + PRIME5;
+
+    hash += length;
+
+    for (; end - p >= 8; p += 8) {
+        hash ^= round64 (0, read_u64 (p));
+        hash = rotl64 (hash, 27) * PRIME1 + PRIME4;
+    }
+    if (end - p >= 4) {
+        hash ^= read_u32 (p) * PRIME1;
+        hash = rotl64 (hash, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash ^= *p * PRIME5;
+        hash = rotl64 (hash, 11) * PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+
+    return hash;
+}